@@ -7,7 +7,12 @@ try:
 except:
     from sets import Set as set
 
-if not sys.platform.startswith('freebsd'):
+if sys.platform.startswith('freebsd'):
+    osreldate = int(os.popen('sysctl -n kern.osreldate').read())
+elif sys.platform.startswith('linux'):
+    # only the portable parts (sendfile) are built; for testing
+    osreldate = None
+else:
     print >> sys.stdout, "==> This package is for FreeBSD only."
     raise SystemExit
 
@@ -34,10 +39,25 @@ def update_deffiles():
 # update *.def files if sources are newer over them.
 update_deffiles()
 
+def evalcond(cond):
+    cond = cond.replace('defined(__FreeBSD__)', str(osreldate is not None))
+    cond = cond.replace('__FreeBSD_version', str(osreldate or 0))
+    return eval(cond.replace('&&', ' and '))
+
 # get effective libraries in this system
-libs = os.popen('unifdef -D__FreeBSD_version=`sysctl -n kern.osreldate` ' +
-                'src/.libraries.def', 'r').read().split()
-libs = list(set(filter(None, libs)))
+def effective_libraries():
+    libs, enabled = set(), []
+    for line in open('src/.libraries.def'):
+        line = line.strip()
+        if line.startswith('#if'):
+            enabled.append(evalcond(line[3:]))
+        elif line.startswith('#endif'):
+            enabled.pop()
+        elif line and False not in enabled:
+            libs.add(line)
+    return list(libs)
+
+libs = effective_libraries()
 
 setup(name = "py-freebsd",
       version = "0.9.3",
@@ -45,7 +65,7 @@ setup(name = "py-freebsd",
       author = "Hye-Shik Chang",
       author_email = "perky@FreeBSD.org",
       license = "BSD",
-      platforms = ['freebsd4', 'freebsd5', 'freebsd6'],
+      platforms = ['freebsd4', 'freebsd5', 'freebsd6', 'linux'],
       py_modules = ['freebsd_compat02'],
       ext_modules = [
           Extension(
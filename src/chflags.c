@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 EXPCONST(int UF_NODUMP)
 EXPCONST(int UF_IMMUTABLE)
 EXPCONST(int UF_APPEND)
@@ -104,3 +106,5 @@ PyFB_fchflags(PyObject *self, PyObject *args)
 		return OSERROR();
 	Py_RETURN_NONE;
 }
+
+#endif
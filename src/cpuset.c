@@ -0,0 +1,538 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifdef __FreeBSD__
+
+#if __FreeBSD_version >= 701000
+#include <sys/cpuset.h>
+#if __FreeBSD_version >= 1200000
+#include <sys/domainset.h>
+#endif
+
+/* constants */
+EXPCONST(int CPU_SETSIZE)
+
+EXPCONST(int CPU_LEVEL_ROOT)
+EXPCONST(int CPU_LEVEL_CPUSET)
+EXPCONST(int CPU_LEVEL_WHICH)
+
+EXPCONST(int CPU_WHICH_TID)
+EXPCONST(int CPU_WHICH_PID)
+EXPCONST(int CPU_WHICH_CPUSET)
+EXPCONST(int CPU_WHICH_IRQ)
+EXPCONST_IFAVAIL(int CPU_WHICH_JAIL)
+EXPCONST_IFAVAIL(int CPU_WHICH_DOMAIN)
+EXPCONST_IFAVAIL(int CPU_WHICH_INTRHANDLER)
+EXPCONST_IFAVAIL(int CPU_WHICH_ITHREAD)
+
+EXPCONST_IFAVAIL(int DOMAINSET_POLICY_ROUNDROBIN)
+EXPCONST_IFAVAIL(int DOMAINSET_POLICY_FIRSTTOUCH)
+EXPCONST_IFAVAIL(int DOMAINSET_POLICY_PREFER)
+EXPCONST_IFAVAIL(int DOMAINSET_POLICY_INTERLEAVE)
+
+/* Types */
+DECLTYPE(CPUMaskType, cpumaskobject)
+
+/* ---------------------------------------------------------------------- */
+/*				cpumaskobject				  */
+/* ---------------------------------------------------------------------- */
+
+typedef struct {
+	PyObject_HEAD
+	cpuset_t mask;
+} cpumaskobject;
+
+static PyTypeObject CPUMaskType;
+
+#define CPUMask_Check(v)	((v)->ob_type == &CPUMaskType)
+#define CPUMASK_NWORDS		(sizeof(cpuset_t) / sizeof(long))
+
+static cpumaskobject *
+cpumask_create(PyTypeObject *type)
+{
+	cpumaskobject *m;
+
+	m = (cpumaskobject *)type->tp_alloc(type, 0);
+	if (m != NULL)
+		CPU_ZERO(&m->mask);
+	return m;
+}
+
+/* Internal helper function to validate a CPU number */
+static int
+cpumask_checkcpu(long cpu)
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		PyErr_Format(PyExc_ValueError,
+			     "cpu number must be in range(0, %d)", CPU_SETSIZE);
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+cpumask_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	cpumaskobject *m;
+	PyObject *cpus = NULL, *it, *item;
+	long cpu;
+
+	if (!PyArg_ParseTuple(args, "|O:cpumask", &cpus))
+		return NULL;
+
+	m = cpumask_create(type);
+	if (m == NULL || cpus == NULL)
+		return (PyObject *)m;
+
+	it = PyObject_GetIter(cpus);
+	if (it == NULL)
+		goto error;
+	while ((item = PyIter_Next(it)) != NULL) {
+		cpu = PyInt_AsLong(item);
+		Py_DECREF(item);
+		if ((cpu == -1 && PyErr_Occurred()) ||
+		    cpumask_checkcpu(cpu) == -1) {
+			Py_DECREF(it);
+			goto error;
+		}
+		CPU_SET(cpu, &m->mask);
+	}
+	Py_DECREF(it);
+	if (PyErr_Occurred())
+		goto error;
+
+	return (PyObject *)m;
+
+error:
+	Py_DECREF(m);
+	return NULL;
+}
+
+static PyObject *
+cpumask_cpus(cpumaskobject *self)
+{
+	PyObject *r;
+	int cpu;
+
+	r = PyList_New(0);
+	if (r == NULL)
+		return NULL;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &self->mask) &&
+		    PyList_Append_StealRef(r, PyInt_FromLong(cpu)) == -1) {
+			Py_DECREF(r);
+			return NULL;
+		}
+
+	return r;
+}
+
+static PyObject *
+cpumask_setbit(cpumaskobject *self, PyObject *args)
+{
+	long cpu;
+
+	if (!PyArg_ParseTuple(args, "l:set", &cpu) ||
+	    cpumask_checkcpu(cpu) == -1)
+		return NULL;
+	CPU_SET(cpu, &self->mask);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+cpumask_clearbit(cpumaskobject *self, PyObject *args)
+{
+	long cpu;
+
+	if (!PyArg_ParseTuple(args, "l:clear", &cpu) ||
+	    cpumask_checkcpu(cpu) == -1)
+		return NULL;
+	CPU_CLR(cpu, &self->mask);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+cpumask_iter(cpumaskobject *self)
+{
+	PyObject *cpus, *it;
+
+	cpus = cpumask_cpus(self);
+	if (cpus == NULL)
+		return NULL;
+	it = PyObject_GetIter(cpus);
+	Py_DECREF(cpus);
+	return it;
+}
+
+static PyObject *
+cpumask_repr(cpumaskobject *self)
+{
+	PyObject *cpus, *cpusrepr, *r;
+
+	cpus = cpumask_cpus(self);
+	if (cpus == NULL)
+		return NULL;
+	cpusrepr = PyObject_Repr(cpus);
+	Py_DECREF(cpus);
+	if (cpusrepr == NULL)
+		return NULL;
+
+	r = PyString_FromFormat("cpumask(%s)", PyString_AS_STRING(cpusrepr));
+	Py_DECREF(cpusrepr);
+	return r;
+}
+
+static Py_ssize_t
+cpumask_length(cpumaskobject *self)
+{
+	Py_ssize_t n = 0;
+	int i;
+
+	for (i = 0; i < CPUMASK_NWORDS; i++)
+		n += __builtin_popcountl(self->mask.__bits[i]);
+	return n;
+}
+
+static int
+cpumask_contains(cpumaskobject *self, PyObject *o)
+{
+	long cpu;
+
+	cpu = PyInt_AsLong(o);
+	if (cpu == -1 && PyErr_Occurred())
+		return -1;
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return 0;
+	return CPU_ISSET(cpu, &self->mask) ? 1 : 0;
+}
+
+static int
+cpumask_nonzero(cpumaskobject *self)
+{
+	return !CPU_EMPTY(&self->mask);
+}
+
+/* Bitwise set operations are done a word at a time. */
+#define CPUMASK_BINOP(name, expr)					\
+static PyObject *							\
+cpumask_##name(PyObject *a, PyObject *b)				\
+{									\
+	cpumaskobject *r;						\
+	const long *x, *y;						\
+	int i;								\
+									\
+	if (!CPUMask_Check(a) || !CPUMask_Check(b)) {			\
+		Py_INCREF(Py_NotImplemented);				\
+		return Py_NotImplemented;				\
+	}								\
+									\
+	r = cpumask_create(&CPUMaskType);				\
+	if (r == NULL)							\
+		return NULL;						\
+	x = ((cpumaskobject *)a)->mask.__bits;				\
+	y = ((cpumaskobject *)b)->mask.__bits;				\
+	for (i = 0; i < CPUMASK_NWORDS; i++)				\
+		r->mask.__bits[i] = (expr);				\
+	return (PyObject *)r;						\
+}
+CPUMASK_BINOP(and, x[i] & y[i])
+CPUMASK_BINOP(or, x[i] | y[i])
+CPUMASK_BINOP(xor, x[i] ^ y[i])
+CPUMASK_BINOP(sub, x[i] & ~y[i])
+#undef CPUMASK_BINOP
+
+static PyObject *
+cpumask_richcompare(PyObject *a, PyObject *b, int op)
+{
+	int equal;
+
+	if (!CPUMask_Check(a) || !CPUMask_Check(b) ||
+	    (op != Py_EQ && op != Py_NE)) {
+		Py_INCREF(Py_NotImplemented);
+		return Py_NotImplemented;
+	}
+
+	equal = memcmp(&((cpumaskobject *)a)->mask,
+		       &((cpumaskobject *)b)->mask, sizeof(cpuset_t)) == 0;
+	return PyBool_FromLong(op == Py_EQ ? equal : !equal);
+}
+
+static PyNumberMethods cpumask_as_number = {
+	nb_subtract:	(binaryfunc)cpumask_sub,
+	nb_nonzero:	(inquiry)cpumask_nonzero,
+	nb_and:		(binaryfunc)cpumask_and,
+	nb_xor:		(binaryfunc)cpumask_xor,
+	nb_or:		(binaryfunc)cpumask_or,
+};
+
+static PySequenceMethods cpumask_as_sequence = {
+	sq_length:	(lenfunc)cpumask_length,
+	sq_contains:	(objobjproc)cpumask_contains,
+};
+
+static PyMethodDef cpumask_methods[] = {
+	{"cpus", (PyCFunction)cpumask_cpus, METH_NOARGS,
+	 "cpus():\nreturns a sorted list of the CPUs in the mask."},
+	{"set", (PyCFunction)cpumask_setbit, METH_VARARGS,
+	 "set(cpu):\nadds `cpu` to the mask."},
+	{"clear", (PyCFunction)cpumask_clearbit, METH_VARARGS,
+	 "clear(cpu):\nremoves `cpu` from the mask."},
+	{NULL, NULL}
+};
+
+static char cpumask_doc[] =
+"cpumask([cpus]):\n"
+"a set of CPUs backed by a cpuset_t.  It supports len(), `in`,\n"
+"iteration and the &, |, ^ and - set operators, which are done on the\n"
+"bitmask words in C.";
+
+static PyTypeObject CPUMaskType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"cpumask",
+	tp_basicsize:	sizeof(cpumaskobject),
+	tp_dealloc:	(destructor)PyObject_Del,
+	tp_repr:	(reprfunc)cpumask_repr,
+	tp_as_number:	&cpumask_as_number,
+	tp_as_sequence:	&cpumask_as_sequence,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES,
+	tp_richcompare:	(richcmpfunc)cpumask_richcompare,
+	tp_iter:	(getiterfunc)cpumask_iter,
+	tp_methods:	cpumask_methods,
+	tp_new:		cpumask_new,
+	tp_doc:		cpumask_doc,
+};
+
+
+static char PyFB_cpuset_getaffinity__doc__[] =
+"cpuset_getaffinity(level, which, id):\n"
+"returns the cpumask of the object specified by `which` (one of\n"
+"const.CPU_WHICH_*) and `id` at `level` (one of const.CPU_LEVEL_*).\n"
+"An `id` of -1 means the current thread, process or set.";
+
+static PyObject *
+PyFB_cpuset_getaffinity(PyObject *self, PyObject *args)
+{
+	cpumaskobject *m;
+	int level, which;
+	long long id;
+
+	if (!PyArg_ParseTuple(args, "iiL:cpuset_getaffinity", &level,
+			      &which, &id))
+		return NULL;
+
+	m = cpumask_create(&CPUMaskType);
+	if (m == NULL)
+		return NULL;
+
+	if (cpuset_getaffinity(level, which, (id_t)id, sizeof(cpuset_t),
+			       &m->mask) == -1) {
+		Py_DECREF(m);
+		return OSERROR();
+	}
+
+	return (PyObject *)m;
+}
+
+
+static char PyFB_cpuset_setaffinity__doc__[] =
+"cpuset_setaffinity(level, which, id, mask):\n"
+"restricts the object specified by `level`, `which` and `id` to the\n"
+"CPUs in cpumask `mask`.";
+
+static PyObject *
+PyFB_cpuset_setaffinity(PyObject *self, PyObject *args)
+{
+	cpumaskobject *m;
+	int level, which;
+	long long id;
+
+	if (!PyArg_ParseTuple(args, "iiLO!:cpuset_setaffinity", &level,
+			      &which, &id, &CPUMaskType, &m))
+		return NULL;
+
+	if (cpuset_setaffinity(level, which, (id_t)id, sizeof(cpuset_t),
+			       &m->mask) == -1)
+		return OSERROR();
+
+	Py_RETURN_NONE;
+}
+
+
+static char PyFB_cpuset__doc__[] =
+"cpuset():\n"
+"creates a new cpuset, moves the current process into it and returns\n"
+"its set id.";
+
+static PyObject *
+PyFB_cpuset(PyObject *self)
+{
+	cpusetid_t setid;
+
+	if (cpuset(&setid) == -1)
+		return OSERROR();
+
+	return PyInt_FromLong(setid);
+}
+
+
+static char PyFB_cpuset_setid__doc__[] =
+"cpuset_setid(which, id, setid):\n"
+"moves the object specified by `which` and `id` into set `setid`.";
+
+static PyObject *
+PyFB_cpuset_setid(PyObject *self, PyObject *args)
+{
+	int which, setid;
+	long long id;
+
+	if (!PyArg_ParseTuple(args, "iLi:cpuset_setid", &which, &id, &setid))
+		return NULL;
+
+	if (cpuset_setid(which, (id_t)id, setid) == -1)
+		return OSERROR();
+
+	Py_RETURN_NONE;
+}
+
+
+static char PyFB_cpuset_getid__doc__[] =
+"cpuset_getid(level, which, id):\n"
+"returns the id of the set at `level` that the object specified by\n"
+"`which` and `id` belongs to.";
+
+static PyObject *
+PyFB_cpuset_getid(PyObject *self, PyObject *args)
+{
+	cpusetid_t setid;
+	int level, which;
+	long long id;
+
+	if (!PyArg_ParseTuple(args, "iiL:cpuset_getid", &level, &which, &id))
+		return NULL;
+
+	if (cpuset_getid(level, which, (id_t)id, &setid) == -1)
+		return OSERROR();
+
+	return PyInt_FromLong(setid);
+}
+
+
+#if __FreeBSD_version >= 1200000
+static char PyFB_cpuset_getdomain__doc__[] =
+"cpuset_getdomain(level, which, id):\n"
+"returns the memory domain policy of the object specified by `level`,\n"
+"`which` and `id` as a (domains, policy) tuple, where `domains` is a\n"
+"list of NUMA domain numbers and `policy` one of\n"
+"const.DOMAINSET_POLICY_*.";
+
+static PyObject *
+PyFB_cpuset_getdomain(PyObject *self, PyObject *args)
+{
+	domainset_t mask;
+	PyObject *domains;
+	int level, which, policy, domain;
+	long long id;
+
+	if (!PyArg_ParseTuple(args, "iiL:cpuset_getdomain", &level, &which,
+			      &id))
+		return NULL;
+
+	DOMAINSET_ZERO(&mask);
+	if (cpuset_getdomain(level, which, (id_t)id, sizeof(mask), &mask,
+			     &policy) == -1)
+		return OSERROR();
+
+	domains = PyList_New(0);
+	if (domains == NULL)
+		return NULL;
+	for (domain = 0; domain < DOMAINSET_SETSIZE; domain++)
+		if (DOMAINSET_ISSET(domain, &mask) &&
+		    PyList_Append_StealRef(domains,
+				PyInt_FromLong(domain)) == -1) {
+			Py_DECREF(domains);
+			return NULL;
+		}
+
+	return Py_BuildValue("(Ni)", domains, policy);
+}
+
+
+static char PyFB_cpuset_setdomain__doc__[] =
+"cpuset_setdomain(level, which, id, domains, policy):\n"
+"sets the memory domain policy of the object specified by `level`,\n"
+"`which` and `id` to the NUMA domains in sequence `domains` with\n"
+"`policy`.";
+
+static PyObject *
+PyFB_cpuset_setdomain(PyObject *self, PyObject *args)
+{
+	domainset_t mask;
+	PyObject *domains, *seq;
+	int level, which, policy, i;
+	long long id;
+	long domain;
+
+	if (!PyArg_ParseTuple(args, "iiLOi:cpuset_setdomain", &level, &which,
+			      &id, &domains, &policy))
+		return NULL;
+
+	seq = PySequence_Fast(domains, "argument 4 must be a sequence");
+	if (seq == NULL)
+		return NULL;
+
+	DOMAINSET_ZERO(&mask);
+	for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+		domain = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+		if (domain == -1 && PyErr_Occurred()) {
+			Py_DECREF(seq);
+			return NULL;
+		}
+		if (domain < 0 || domain >= DOMAINSET_SETSIZE) {
+			Py_DECREF(seq);
+			PyErr_Format(PyExc_ValueError,
+				     "domain must be in range(0, %d)",
+				     DOMAINSET_SETSIZE);
+			return NULL;
+		}
+		DOMAINSET_SET(domain, &mask);
+	}
+	Py_DECREF(seq);
+
+	if (cpuset_setdomain(level, which, (id_t)id, sizeof(mask), &mask,
+			     policy) == -1)
+		return OSERROR();
+
+	Py_RETURN_NONE;
+}
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,281 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifdef __FreeBSD__
+
+#if __FreeBSD_version >= 600000
+
+LIB_DEPENDS(devstat)
+#include <devstat.h>
+
+/* Types */
+DECLTYPE(DevstatTrackerType, devstattrackerobject)
+
+/* ---------------------------------------------------------------------- */
+/*			     devstattrackerobject			  */
+/* ---------------------------------------------------------------------- */
+
+#define DEVSTAT_NCOLUMNS 8
+
+static const struct {
+	const char *name;
+	devstat_metric metric;
+} devstat_columns[DEVSTAT_NCOLUMNS] = {
+	{"reads", DSM_TRANSFERS_PER_SECOND_READ},
+	{"writes", DSM_TRANSFERS_PER_SECOND_WRITE},
+	{"readmb", DSM_MB_PER_SECOND_READ},
+	{"writemb", DSM_MB_PER_SECOND_WRITE},
+	{"readms", DSM_MS_PER_TRANSACTION_READ},
+	{"writems", DSM_MS_PER_TRANSACTION_WRITE},
+	{"busy", DSM_BUSY_PCT},
+	{"queue", DSM_QUEUE_LENGTH},
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct statinfo cur, last;
+	int sampled;
+	PyObject *names;	/* device name tuple of the last sample */
+} devstattrackerobject;
+
+static PyTypeObject DevstatTrackerType;
+
+static PyObject *
+devstattracker_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	devstattrackerobject *self;
+
+	if (!PyArg_ParseTuple(args, ":devstattracker"))
+		return NULL;
+
+	if (devstat_checkversion(NULL) == -1) {
+		PyErr_SetString(PyExc_OSError, devstat_errbuf);
+		return NULL;
+	}
+
+	self = (devstattrackerobject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	memset(&self->cur, 0, sizeof(self->cur));
+	memset(&self->last, 0, sizeof(self->last));
+	self->sampled = 0;
+	self->names = NULL;
+	self->cur.dinfo = calloc(1, sizeof(struct devinfo));
+	self->last.dinfo = calloc(1, sizeof(struct devinfo));
+	if (self->cur.dinfo == NULL || self->last.dinfo == NULL) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+
+	return (PyObject *)self;
+}
+
+static void
+devstattracker_freedinfo(struct devinfo *dinfo)
+{
+	if (dinfo != NULL) {
+		free(dinfo->mem_ptr);
+		free(dinfo);
+	}
+}
+
+static void
+devstattracker_dealloc(devstattrackerobject *self)
+{
+	devstattracker_freedinfo(self->cur.dinfo);
+	devstattracker_freedinfo(self->last.dinfo);
+	Py_XDECREF(self->names);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+/* Internal helper function to find the previous sample of a device */
+static struct devstat *
+devstattracker_prev(devstattrackerobject *self, int i)
+{
+	struct devinfo *cur = self->cur.dinfo, *last = self->last.dinfo;
+	struct devstat *dev = &cur->devices[i];
+	int j;
+
+	if (!self->sampled)
+		return NULL;
+	if (cur->generation == last->generation && i < last->numdevs)
+		return &last->devices[i];
+	for (j = 0; j < last->numdevs; j++)
+		if (last->devices[j].device_number == dev->device_number &&
+		    last->devices[j].unit_number == dev->unit_number &&
+		    strcmp(last->devices[j].device_name,
+			   dev->device_name) == 0)
+			return &last->devices[j];
+	return NULL;
+}
+
+static char devstattracker_sample_doc[] =
+"sample():\n"
+"takes a devstat snapshot of all devices and returns a dict of columns\n"
+"aligned with the device list: `name` (a tuple) and `reads`, `writes`\n"
+"(transfers per second), `readmb`, `writemb` (MB per second),\n"
+"`readms`, `writems` (ms per transaction), `busy` (percent) and\n"
+"`queue` (queue length) as arrays computed since the previous sample.\n"
+"Devices that were not present in the previous sample report zero.";
+
+static PyObject *
+devstattracker_sample(devstattrackerobject *self)
+{
+	struct devinfo *dinfo;
+	struct devstat *dev, *prev;
+	long double etime, v;
+	uint64_t queue;
+	double *rates;
+	PyObject *r, *names, *arr;
+	int n, i, k, res, samelayout;
+
+	Py_BEGIN_ALLOW_THREADS
+	res = devstat_getdevs(NULL, &self->cur);
+	Py_END_ALLOW_THREADS
+	if (res == -1) {
+		PyErr_SetString(PyExc_OSError, devstat_errbuf);
+		return NULL;
+	}
+
+	dinfo = self->cur.dinfo;
+	n = dinfo->numdevs;
+	rates = PyMem_New(double, DEVSTAT_NCOLUMNS * (n > 0 ? n : 1));
+	if (rates == NULL)
+		return PyErr_NoMemory();
+
+	etime = self->cur.snap_time - self->last.snap_time;
+	samelayout = self->sampled &&
+		     dinfo->generation == self->last.dinfo->generation;
+
+	for (i = 0; i < n; i++) {
+		dev = &dinfo->devices[i];
+		prev = devstattracker_prev(self, i);
+		for (k = 0; k < DEVSTAT_NCOLUMNS; k++) {
+			v = 0;
+			if (prev != NULL && etime > 0) {
+				if (devstat_columns[k].metric ==
+				    DSM_QUEUE_LENGTH) {
+					res = devstat_compute_statistics(dev,
+						prev, etime, DSM_QUEUE_LENGTH,
+						&queue, DSM_NONE);
+					v = queue;
+				}
+				else
+					res = devstat_compute_statistics(dev,
+						prev, etime,
+						devstat_columns[k].metric, &v,
+						DSM_NONE);
+				if (res == -1)
+					v = 0;
+			}
+			rates[k * n + i] = (double)v;
+		}
+	}
+
+	/* Reuse the name tuple as long as the device list did not change;
+	 * it is immutable, so callers cannot corrupt later samples. */
+	if (samelayout && self->names != NULL) {
+		names = self->names;
+		Py_INCREF(names);
+	}
+	else {
+		names = PyTuple_New(n);
+		for (i = 0; names != NULL && i < n; i++) {
+			PyObject *name;
+
+			name = PyString_FromFormat("%s%d",
+					dinfo->devices[i].device_name,
+					dinfo->devices[i].unit_number);
+			if (name == NULL) {
+				Py_DECREF(names);
+				names = NULL;
+			}
+			else
+				PyTuple_SET_ITEM(names, i, name);
+		}
+	}
+
+	r = (names != NULL) ? PyDict_New() : NULL;
+	if (r == NULL)
+		goto error;
+	PyDict_SetItemString(r, "name", names);
+
+	for (k = 0; k < DEVSTAT_NCOLUMNS; k++) {
+		arr = array_fromdoubles(&rates[k * n], n);
+		if (arr == NULL) {
+			Py_DECREF(r);
+			goto error;
+		}
+		PyDict_SetItemString_StealRef(r,
+				(char *)devstat_columns[k].name, arr);
+	}
+	PyMem_Del(rates);
+
+	/* The current snapshot becomes the previous one; its buffers are
+	 * reused by devstat_getdevs() next time. */
+	dinfo = self->last.dinfo;
+	self->last = self->cur;
+	self->cur.dinfo = dinfo;
+	self->sampled = 1;
+	Py_XDECREF(self->names);
+	self->names = names;
+
+	return r;
+
+error:
+	Py_XDECREF(names);
+	PyMem_Del(rates);
+	return NULL;
+}
+
+static PyMethodDef devstattracker_methods[] = {
+	{"sample", (PyCFunction)devstattracker_sample, METH_NOARGS,
+	 devstattracker_sample_doc},
+	{NULL, NULL}
+};
+
+static char devstattracker_doc[] =
+"devstattracker():\n"
+"keeps the previous devstat(3) snapshot of all disks and computes\n"
+"per-device IOPS, throughput, latency and busy percentage in C.";
+
+static PyTypeObject DevstatTrackerType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"devstattracker",
+	tp_basicsize:	sizeof(devstattrackerobject),
+	tp_dealloc:	(destructor)devstattracker_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	devstattracker_methods,
+	tp_new:		devstattracker_new,
+	tp_doc:		devstattracker_doc,
+};
+#endif
+
+#endif
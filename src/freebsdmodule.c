@@ -26,6 +26,11 @@
  * $FreeBSD$
  */
 
+#include "Python.h"
+#include "structmember.h"
+#include "structseq.h"
+#include "version.h"
+
 #include <iso646.h>
 #include <sys/param.h>
 #include <sys/types.h>
@@ -35,10 +40,6 @@
 #include <sys/uio.h>
 #include <fcntl.h>
 
-#include "Python.h"
-#include "structmember.h"
-#include "version.h"
-
 union multitype {
 	int m_int;
 	unsigned int m_uint;
@@ -65,6 +66,7 @@ struct FlagRepr {
 #endif
 
 /* 2.3 compatibility */
+#ifndef Py_VISIT
 #define Py_VISIT(op)                                    \
 	do {                                            \
 		if (op) {                               \
@@ -73,7 +75,9 @@ struct FlagRepr {
 				return vret;		\
 		}                                       \
 	} while (0)
+#endif
 
+#ifdef __FreeBSD__
 static PyObject *
 repr_flag(const struct FlagRepr *flags, unsigned int v)
 {
@@ -111,6 +115,7 @@ repr_flag(const struct FlagRepr *flags, unsigned int v)
 		return r;
 	}
 }
+#endif
 
 __inline__ void
 PyDict_SetItemString_StealRef(PyObject *d, char *name, PyObject *o)
@@ -119,6 +124,18 @@ PyDict_SetItemString_StealRef(PyObject *d, char *name, PyObject *o)
 	Py_DECREF(o);
 }
 
+__inline__ int
+PyList_Append_StealRef(PyObject *l, PyObject *o)
+{
+	int r;
+
+	if (o == NULL)
+		return -1;
+	r = PyList_Append(l, o);
+	Py_DECREF(o);
+	return r;
+}
+
 /* int -> int */
 #define SETDICT_INT(dict, name, value)					\
 	PyDict_SetItemString_StealRef(dict, name,			\
@@ -160,10 +177,43 @@ PyDict_SetItemString_StealRef(PyObject *d, char *name, PyObject *o)
 #define EXPCONST_MIN_OSREL(osrev, decl)
 #define EXPCONST_MAX_OSREL(osrev, decl)
 #define DECLTYPE(typeobject, objstruct)
+#define DECLSTRUCTSEQ(typeobject, desc)
 #define LIB_DEPENDS(lib)
 
 #define OSERROR() PyErr_SetFromErrno(PyExc_OSError)
 
+/* Creates (not raises) an OSError for per-item results of bulk calls */
+static PyObject *
+oserror_fromerrno(int err)
+{
+	return PyObject_CallFunction(PyExc_OSError, "is", err, strerror(err));
+}
+
+/* Internal helper function to build an array.array('d') from C doubles */
+static PyObject *
+array_fromdoubles(const double *v, Py_ssize_t n)
+{
+	static PyObject *arraytype = NULL;
+	PyObject *mod, *s, *r;
+
+	if (arraytype == NULL) {
+		mod = PyImport_ImportModule("array");
+		if (mod == NULL)
+			return NULL;
+		arraytype = PyObject_GetAttrString(mod, "array");
+		Py_DECREF(mod);
+		if (arraytype == NULL)
+			return NULL;
+	}
+
+	s = PyString_FromStringAndSize((const char *)v, n * sizeof(double));
+	if (s == NULL)
+		return NULL;
+	r = PyObject_CallFunction(arraytype, "sO", "d", s);
+	Py_DECREF(s);
+	return r;
+}
+
 #include ".sources.def"
 
 /* Module Methods */
@@ -199,6 +249,13 @@ create_newmodule(char *name)
 		return;							\
 	PyModule_AddObject(m, (type).tp_name, (PyObject *)&(type));
 
+/* struct sequences are named "freebsd.xxx"; register them as "xxx" */
+#define INITSTRUCTSEQ(type, desc)					\
+	PyStructSequence_InitType(&(type), &(desc));			\
+	Py_INCREF(&(type));						\
+	PyModule_AddObject(m, strchr((desc).name, '.') + 1,		\
+			   (PyObject *)&(type));
+
 void
 initfreebsd(void)
 {
@@ -215,10 +272,12 @@ initfreebsd(void)
 		return;
 	PyModule_AddObject(m, "const", constmod);
 
+#ifdef __FreeBSD__
 	{
 		PyObject *d = PyModule_GetDict(constmod);
 		#include ".const.def"
 	}
+#endif
 
 	PyModule_AddStringConstant(m, "__version__", __version__);
 
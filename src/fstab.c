@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <fstab.h>
 
 static PyObject *
@@ -75,7 +77,8 @@ PyFB_getfsent(PyObject *self)
 static char PyFB_getfsspec__doc__[] =
 "getfsspec(spec):\n"
 "return an object containing the broken-out fields of a line in the\n"
-"file system description file, <fstab.h>.";
+"file system description file, <fstab.h>.  raises KeyError if no\n"
+"entry has the special device `spec`.";
 
 static PyObject *
 PyFB_getfsspec(PyObject *self, PyObject *args)
@@ -86,8 +89,10 @@ PyFB_getfsspec(PyObject *self, PyObject *args)
 	if (! PyArg_ParseTuple(args, "s:getfsspec", &spec))
 		return NULL;
 
-	if ((tab = getfsspec(spec)) == NULL)
-		return OSERROR();
+	if ((tab = getfsspec(spec)) == NULL) {
+		PyErr_SetString(PyExc_KeyError, spec);
+		return NULL;
+	}
 
 	return PyObject_FromFstab(tab);
 }
@@ -96,7 +101,8 @@ PyFB_getfsspec(PyObject *self, PyObject *args)
 static char PyFB_getfsfile__doc__[] =
 "getfsfile(file):\n"
 "return an object containing the broken-out fields of a line in the\n"
-"file system description file, <fstab.h>.";
+"file system description file, <fstab.h>.  raises KeyError if no\n"
+"entry is mounted on `file`.";
 
 static PyObject *
 PyFB_getfsfile(PyObject *self, PyObject *args)
@@ -107,8 +113,518 @@ PyFB_getfsfile(PyObject *self, PyObject *args)
 	if (! PyArg_ParseTuple(args, "s:getfsfile", &file))
 		return NULL;
 
-	if ((tab = getfsfile(file)) == NULL)
-		return OSERROR();
+	if ((tab = getfsfile(file)) == NULL) {
+		PyErr_SetString(PyExc_KeyError, file);
+		return NULL;
+	}
 
 	return PyObject_FromFstab(tab);
 }
+
+#endif
+
+/*
+ * fstab parses the whole file once into entries indexed by special
+ * device and mount point, with mntops split into option names and
+ * values.  The parser follows fstab(5) and does not depend on FreeBSD,
+ * so it can be tested against fixture files on other platforms.
+ */
+
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Types */
+DECLSTRUCTSEQ(FstabEntryType, fstabentry_desc)
+DECLTYPE(FstabType, fstabobject)
+
+#ifndef _PATH_FSTAB
+#define _PATH_FSTAB	"/etc/fstab"
+#endif
+
+#ifdef __FreeBSD__
+#define FSTAB_MTIME(st)	((st).st_mtimespec)
+#else
+#define FSTAB_MTIME(st)	((st).st_mtim)
+#endif
+
+static PyStructSequence_Field fstabentry_fields[] = {
+	{"spec",	"block special device or remote file system"},
+	{"file",	"mount point"},
+	{"vfstype",	"file system type"},
+	{"mntops",	"mount options as written"},
+	{"type",	"rw, rq, ro, sw or xx from the options"},
+	{"freq",	"dump frequency in days"},
+	{"passno",	"fsck pass number"},
+	{"options",	"frozenset of the option names"},
+	{"values",	"tuple of (name, value) for name=value options"},
+	{0}
+};
+
+static PyStructSequence_Desc fstabentry_desc = {
+	"freebsd.fstabentry",
+	"fstabentry: An entry of the file system description file.",
+	fstabentry_fields,
+	9,
+};
+
+static PyTypeObject FstabEntryType;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *path;
+	double interval;
+	struct timespec checked;	/* monotonic time of the last stat */
+	struct timespec mtime;		/* mtime of the parsed file */
+	PyObject *entries;		/* entries in file order */
+	PyObject *byspec;		/* spec -> entry */
+	PyObject *byfile;		/* mount point -> entry */
+} fstabobject;
+
+static PyTypeObject FstabType;
+
+#define FSTAB_NFIELDS	6
+#define FSTAB_ITEM(e, i)	(((PyStructSequence *)(e))->ob_item[i])
+
+/* Decodes \ooo octal escapes (\040 for a space) in place. */
+static void
+fstab_unescape(char *s)
+{
+	char *d = s;
+
+	for (; *s != '\0'; s++, d++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '7' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) |
+			     (s[3] - '0');
+			s += 3;
+		}
+		else
+			*d = *s;
+	}
+	*d = '\0';
+}
+
+/*
+ * Splits one line in place into spec, file, vfstype, mntops, freq and
+ * passno.  returns the number of fields, 0 for blank and comment lines.
+ */
+static int
+fstab_split(char *line, char *fields[FSTAB_NFIELDS])
+{
+	int n = 0;
+
+	while (n < FSTAB_NFIELDS) {
+		while (*line == ' ' || *line == '\t')
+			line++;
+		if (*line == '\0' || *line == '#')
+			break;
+		fields[n++] = line;
+		while (*line != '\0' && *line != ' ' && *line != '\t')
+			line++;
+		if (*line != '\0')
+			*line++ = '\0';
+	}
+	return n;
+}
+
+/*
+ * Splits mntops into a frozenset of option names and a tuple of
+ * (name, value) pairs for the options written as name=value, and picks
+ * the fstab type from it.  Both are immutable since entries are shared
+ * by all lookups.
+ */
+static int
+fstab_options(const char *mntops, char type[3], PyObject **names,
+	      PyObject **values)
+{
+	PyObject *nlist, *vlist, *name, *pair;
+	const char *p, *end, *eq;
+	size_t len;
+	int r = -1;
+
+	type[0] = '\0';
+	*names = *values = NULL;
+	nlist = PyList_New(0);
+	vlist = PyList_New(0);
+	if (nlist == NULL || vlist == NULL)
+		goto out;
+
+	for (p = mntops; *p != '\0'; p = (*end ? end + 1 : end)) {
+		end = strchr(p, ',');
+		if (end == NULL)
+			end = p + strlen(p);
+		eq = memchr(p, '=', end - p);
+		len = (eq != NULL ? eq : end) - p;
+		if (len == 0)
+			continue;
+
+		name = PyString_FromStringAndSize(p, len);
+		if (name == NULL || PyList_Append(nlist, name) == -1) {
+			Py_XDECREF(name);
+			goto out;
+		}
+		if (eq != NULL) {
+			pair = Py_BuildValue("(Os#)", name, eq + 1,
+					     (int)(end - eq - 1));
+			if (PyList_Append_StealRef(vlist, pair) == -1) {
+				Py_DECREF(name);
+				goto out;
+			}
+		}
+		else if (type[0] == '\0' && len == 2 &&
+			 (strncmp(p, "rw", 2) == 0 ||
+			  strncmp(p, "rq", 2) == 0 ||
+			  strncmp(p, "ro", 2) == 0 ||
+			  strncmp(p, "sw", 2) == 0 ||
+			  strncmp(p, "xx", 2) == 0)) {
+			type[0] = p[0];
+			type[1] = p[1];
+			type[2] = '\0';
+		}
+		Py_DECREF(name);
+	}
+
+	*names = PyFrozenSet_New(nlist);
+	*values = PyList_AsTuple(vlist);
+	if (*names != NULL && *values != NULL)
+		r = 0;
+	else {
+		Py_CLEAR(*names);
+		Py_CLEAR(*values);
+	}
+
+out:
+	Py_XDECREF(nlist);
+	Py_XDECREF(vlist);
+	return r;
+}
+
+static PyObject *
+fstab_entry(char *fields[FSTAB_NFIELDS], int n)
+{
+	PyObject *r, *names, *values;
+	char type[3];
+
+	if (fstab_options(fields[3], type, &names, &values) == -1)
+		return NULL;
+
+	r = PyStructSequence_New(&FstabEntryType);
+	if (r == NULL) {
+		Py_DECREF(names);
+		Py_DECREF(values);
+		return NULL;
+	}
+	PyStructSequence_SET_ITEM(r, 0, PyString_FromString(fields[0]));
+	PyStructSequence_SET_ITEM(r, 1, PyString_FromString(fields[1]));
+	PyStructSequence_SET_ITEM(r, 2, PyString_FromString(fields[2]));
+	PyStructSequence_SET_ITEM(r, 3, PyString_FromString(fields[3]));
+	PyStructSequence_SET_ITEM(r, 4, PyString_FromString(type));
+	PyStructSequence_SET_ITEM(r, 5,
+		PyInt_FromLong(n > 4 ? atoi(fields[4]) : 0));
+	PyStructSequence_SET_ITEM(r, 6,
+		PyInt_FromLong(n > 5 ? atoi(fields[5]) : 0));
+	PyStructSequence_SET_ITEM(r, 7, names);
+	PyStructSequence_SET_ITEM(r, 8, values);
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(r);
+		return NULL;
+	}
+	return r;
+}
+
+/* Parses the file text `buf' (modified in place) into the indexes. */
+static int
+fstab_build(fstabobject *self, char *buf)
+{
+	PyObject *entries, *byspec, *byfile, *e;
+	char *line, *next, *fields[FSTAB_NFIELDS];
+	int n;
+
+	entries = PyList_New(0);
+	byspec = PyDict_New();
+	byfile = PyDict_New();
+	if (entries == NULL || byspec == NULL || byfile == NULL)
+		goto error;
+
+	for (line = buf; line != NULL; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+
+		/* lines with fewer than four fields are skipped like
+		 * getfsent(3) does */
+		n = fstab_split(line, fields);
+		if (n < 4)
+			continue;
+		fstab_unescape(fields[0]);
+		fstab_unescape(fields[1]);
+
+		e = fstab_entry(fields, n);
+		if (e == NULL || PyList_Append_StealRef(entries, e) == -1)
+			goto error;
+		/* the first entry wins as with getfsspec(3) */
+		if (PyDict_GetItem(byspec, FSTAB_ITEM(e, 0)) == NULL &&
+		    PyDict_SetItem(byspec, FSTAB_ITEM(e, 0), e) == -1)
+			goto error;
+		if (PyDict_GetItem(byfile, FSTAB_ITEM(e, 1)) == NULL &&
+		    PyDict_SetItem(byfile, FSTAB_ITEM(e, 1), e) == -1)
+			goto error;
+	}
+
+	Py_XDECREF(self->entries);
+	Py_XDECREF(self->byspec);
+	Py_XDECREF(self->byfile);
+	self->entries = entries;
+	self->byspec = byspec;
+	self->byfile = byfile;
+	return 0;
+
+error:
+	Py_XDECREF(entries);
+	Py_XDECREF(byspec);
+	Py_XDECREF(byfile);
+	return -1;
+}
+
+/* Reads the whole file.  Called without the GIL; returns NULL with
+ * errno set on failure. */
+static char *
+fstab_readfile(const char *path, struct stat *st)
+{
+	size_t len = 0;
+	ssize_t r;
+	char *buf;
+	int fd, err;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat(fd, st) == -1 ||
+	    (buf = malloc(st->st_size + 1)) == NULL) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	while (len < (size_t)st->st_size) {
+		r = read(fd, buf + len, st->st_size - len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1) {
+			err = errno;
+			free(buf);
+			close(fd);
+			errno = err;
+			return NULL;
+		}
+		if (r == 0)
+			break;
+		len += r;
+	}
+	close(fd);
+	buf[len] = '\0';
+	return buf;
+}
+
+/* Reads and parses the file, keeping its mtime for later checks. */
+static int
+fstab_reload(fstabobject *self)
+{
+	struct stat st;
+	char *buf;
+	int r;
+
+	Py_BEGIN_ALLOW_THREADS
+	buf = fstab_readfile(PyString_AS_STRING(self->path), &st);
+	Py_END_ALLOW_THREADS
+	if (buf == NULL) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+				PyString_AS_STRING(self->path));
+		return -1;
+	}
+
+	r = fstab_build(self, buf);
+	free(buf);
+	if (r == 0) {
+		self->mtime = FSTAB_MTIME(st);
+		clock_gettime(CLOCK_MONOTONIC, &self->checked);
+	}
+	return r;
+}
+
+/* Reparses the file if its mtime changed since it was loaded. */
+static int
+fstab_check(fstabobject *self)
+{
+	struct timespec now;
+	struct stat st;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - self->checked.tv_sec) +
+	    (now.tv_nsec - self->checked.tv_nsec) / 1e9 < self->interval)
+		return 0;
+	self->checked = now;
+
+	if (stat(PyString_AS_STRING(self->path), &st) == -1 ||
+	    (FSTAB_MTIME(st).tv_sec == self->mtime.tv_sec &&
+	     FSTAB_MTIME(st).tv_nsec == self->mtime.tv_nsec))
+		return 0;
+	return fstab_reload(self);
+}
+
+static PyObject *
+fstab_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"path", "interval", NULL};
+	fstabobject *self;
+	char *path = _PATH_FSTAB;
+	double interval = 1.0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sd:fstab", kwlist,
+					 &path, &interval))
+		return NULL;
+
+	self = (fstabobject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	self->interval = interval;
+	self->entries = self->byspec = self->byfile = NULL;
+	self->path = PyString_FromString(path);
+	if (self->path == NULL || fstab_reload(self) == -1) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+static void
+fstab_dealloc(fstabobject *self)
+{
+	Py_XDECREF(self->path);
+	Py_XDECREF(self->entries);
+	Py_XDECREF(self->byspec);
+	Py_XDECREF(self->byfile);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyObject *
+fstab_lookup(fstabobject *self, PyObject *args, int byfile,
+	     const char *fmt)
+{
+	PyObject *key, *r;
+
+	if (!PyArg_ParseTuple(args, fmt, &PyString_Type, &key))
+		return NULL;
+	if (fstab_check(self) == -1)
+		return NULL;
+
+	r = PyDict_GetItem(byfile ? self->byfile : self->byspec, key);
+	if (r == NULL) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+	Py_INCREF(r);
+	return r;
+}
+
+static char fstab_getfsspec_doc[] =
+"getfsspec(spec):\n"
+"returns the first entry for special device `spec` or raises KeyError.";
+
+static PyObject *
+fstab_getfsspec(fstabobject *self, PyObject *args)
+{
+	return fstab_lookup(self, args, 0, "O!:getfsspec");
+}
+
+static char fstab_getfsfile_doc[] =
+"getfsfile(file):\n"
+"returns the first entry mounted on `file` or raises KeyError.";
+
+static PyObject *
+fstab_getfsfile(fstabobject *self, PyObject *args)
+{
+	return fstab_lookup(self, args, 1, "O!:getfsfile");
+}
+
+static char fstab_getfsent_doc[] =
+"getfsent():\n"
+"returns a list of all entries in file order.";
+
+static PyObject *
+fstab_getfsent(fstabobject *self)
+{
+	if (fstab_check(self) == -1)
+		return NULL;
+	return PyList_GetSlice(self->entries, 0,
+			       PyList_GET_SIZE(self->entries));
+}
+
+static char fstab_refresh_doc[] =
+"refresh():\n"
+"parses the file again unconditionally.";
+
+static PyObject *
+fstab_refresh(fstabobject *self)
+{
+	if (fstab_reload(self) == -1)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+fstab_length(fstabobject *self)
+{
+	return PyList_GET_SIZE(self->entries);
+}
+
+static PyMethodDef fstab_methods[] = {
+	{"getfsspec", (PyCFunction)fstab_getfsspec, METH_VARARGS,
+	 fstab_getfsspec_doc},
+	{"getfsfile", (PyCFunction)fstab_getfsfile, METH_VARARGS,
+	 fstab_getfsfile_doc},
+	{"getfsent", (PyCFunction)fstab_getfsent, METH_NOARGS,
+	 fstab_getfsent_doc},
+	{"refresh", (PyCFunction)fstab_refresh, METH_NOARGS,
+	 fstab_refresh_doc},
+	{NULL, NULL}
+};
+
+static PyMemberDef fstab_members[] = {
+	{"path", T_OBJECT, offsetof(fstabobject, path), READONLY,
+	 "file system description file"},
+	{"interval", T_DOUBLE, offsetof(fstabobject, interval), 0,
+	 "minimum seconds between two mtime checks"},
+	{NULL}
+};
+
+static PySequenceMethods fstab_as_sequence = {
+	sq_length:	(lenfunc)fstab_length,
+};
+
+static char fstab_doc[] =
+"fstab([path, interval=1.0]):\n"
+"parses the file system description file (/etc/fstab by default) once\n"
+"and answers getfsspec(), getfsfile() and getfsent() from indexes,\n"
+"returning fstabentry records with mntops split into `options` (a\n"
+"frozenset of names) and `values` (name, value) pairs.  Records are\n"
+"shared and immutable.  The file is parsed again when its mtime\n"
+"changes, checked at most every `interval` seconds.";
+
+static PyTypeObject FstabType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"fstab",
+	tp_basicsize:	sizeof(fstabobject),
+	tp_dealloc:	(destructor)fstab_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_as_sequence:	&fstab_as_sequence,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	fstab_methods,
+	tp_members:	fstab_members,
+	tp_new:		fstab_new,
+	tp_doc:		fstab_doc,
+};
@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #if __FreeBSD_version >= 500101
 
 LIB_DEPENDS(geom)
@@ -55,3 +57,5 @@ PyFB_geom_getxml(PyObject *self)
 /*
  * The End, no more, it is over and out..
  */
+
+#endif
@@ -0,0 +1,960 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * A small streaming parser for the kern.geom.confxml document and a
+ * tree object built on top of it.  Nothing here depends on FreeBSD
+ * except reading the document from the running kernel, so the parser
+ * can be tested against captured documents on other platforms.
+ */
+
+/* Types */
+DECLTYPE(GeomTreeType, geomtreeobject)
+DECLTYPE(GeomSnapshotType, geomsnapshotobject)
+
+/* ---------------------------------------------------------------------- */
+/*				confxml parser				  */
+/* ---------------------------------------------------------------------- */
+
+#define GXML_MAXDEPTH	32
+#define GXML_MAXNAME	64
+
+/*
+ * SAX-like callbacks.  `id' and `ref' are the values of the attributes
+ * of the same names or NULL, and `text' is the decoded character data
+ * of elements without child elements.  A callback returns -1 with a
+ * Python exception set to abort parsing.
+ */
+struct gxml_handler {
+	int (*start)(void *ctx, int depth, const char *tag, const char *id,
+		     const char *ref);
+	int (*end)(void *ctx, int depth, const char *tag, const char *text,
+		   int haschild);
+};
+
+struct gxml_buf {
+	char *s;
+	size_t len, size;
+};
+
+static int
+gxml_bufput(struct gxml_buf *b, const char *s, size_t n)
+{
+	char *ns;
+
+	if (b->len + n + 1 > b->size) {
+		size_t nsize = b->size ? b->size : 256;
+		while (b->len + n + 1 > nsize)
+			nsize *= 2;
+		ns = PyMem_Realloc(b->s, nsize);
+		if (ns == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		b->s = ns;
+		b->size = nsize;
+	}
+	memcpy(b->s + b->len, s, n);
+	b->len += n;
+	b->s[b->len] = '\0';
+	return 0;
+}
+
+/* Appends character data with the predefined and numeric entities
+ * decoded.  Unknown entities are kept verbatim. */
+static int
+gxml_bufputtext(struct gxml_buf *b, const char *p, const char *end)
+{
+	static const struct { const char *name; char c; } entities[] = {
+		{"amp;", '&'}, {"lt;", '<'}, {"gt;", '>'},
+		{"quot;", '"'}, {"apos;", '\''}, {NULL, 0},
+	};
+	const char *amp;
+	char c;
+	long v;
+	int i;
+
+	while ((amp = memchr(p, '&', end - p)) != NULL) {
+		if (gxml_bufput(b, p, amp - p) == -1)
+			return -1;
+		p = amp + 1;
+		c = '&';
+		if (p < end && *p == '#') {
+			char *q;
+			v = (p + 1 < end && p[1] == 'x') ?
+			    strtol(p + 2, &q, 16) : strtol(p + 1, &q, 10);
+			if (q < end && *q == ';' && v > 0 && v < 256) {
+				c = (char)v;
+				p = q + 1;
+			}
+		}
+		else
+			for (i = 0; entities[i].name != NULL; i++) {
+				size_t n = strlen(entities[i].name);
+				if ((size_t)(end - p) >= n &&
+				    memcmp(p, entities[i].name, n) == 0) {
+					c = entities[i].c;
+					p += n;
+					break;
+				}
+			}
+		if (gxml_bufput(b, &c, 1) == -1)
+			return -1;
+	}
+	return gxml_bufput(b, p, end - p);
+}
+
+static int
+gxml_error(const char *xml, const char *p)
+{
+	PyErr_Format(PyExc_ValueError, "malformed geom XML at offset %ld",
+		     (long)(p - xml));
+	return -1;
+}
+
+/* Copies the value of attribute `name' out of the attribute list
+ * [p, end) into `out'.  returns 1 if found. */
+static int
+gxml_attr(const char *p, const char *end, const char *name, char *out)
+{
+	size_t nlen = strlen(name), vlen;
+	const char *v, *q;
+
+	for (; p < end; p++) {
+		if ((size_t)(end - p) > nlen + 2 && memcmp(p, name, nlen) == 0 &&
+		    p[nlen] == '=' && (p[nlen + 1] == '"' ||
+		    p[nlen + 1] == '\'') && (p[-1] == ' ' || p[-1] == '\t' ||
+		    p[-1] == '\n' || p[-1] == '\r')) {
+			v = p + nlen + 2;
+			q = memchr(v, p[nlen + 1], end - v);
+			if (q == NULL)
+				return 0;
+			vlen = q - v;
+			if (vlen >= GXML_MAXNAME)
+				vlen = GXML_MAXNAME - 1;
+			memcpy(out, v, vlen);
+			out[vlen] = '\0';
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Walks the document once, calling the handler for each element. */
+static int
+gxml_parse(const char *xml, size_t len, const struct gxml_handler *h,
+	   void *ctx)
+{
+	const char *p = xml, *end = xml + len, *q, *nend, *textstart = NULL;
+	char tags[GXML_MAXDEPTH][GXML_MAXNAME];
+	char haschild[GXML_MAXDEPTH];
+	char id[GXML_MAXNAME], ref[GXML_MAXNAME];
+	struct gxml_buf text = { NULL, 0, 0 };
+	int depth = 0, hasid, hasref, selfclose, r = -1;
+	size_t n;
+
+	while (p < end) {
+		p = memchr(p, '<', end - p);
+		if (p == NULL)
+			break;
+
+		if (p + 1 < end && (p[1] == '?' || p[1] == '!')) {
+			/* declarations, comments, doctype */
+			if (p + 3 < end && memcmp(p, "<!--", 4) == 0) {
+				for (q = p + 4; q + 2 < end &&
+				     memcmp(q, "-->", 3) != 0; q++)
+					;
+				if (q + 2 >= end)
+					goto malformed;
+				p = q + 3;
+				continue;
+			}
+			q = memchr(p, '>', end - p);
+			if (q == NULL)
+				goto malformed;
+			p = q + 1;
+			continue;
+		}
+
+		q = memchr(p, '>', end - p);
+		if (q == NULL)
+			goto malformed;
+
+		if (p[1] == '/') {
+			/* end tag */
+			if (depth == 0)
+				goto malformed;
+			for (nend = p + 2; nend < q && !isspace(*nend); nend++)
+				;
+			n = nend - (p + 2);
+			if (n != strlen(tags[depth - 1]) ||
+			    memcmp(p + 2, tags[depth - 1], n) != 0)
+				goto malformed;
+			text.len = 0;
+			if (text.s != NULL)
+				text.s[0] = '\0';
+			if (!haschild[depth - 1] &&
+			    gxml_bufputtext(&text, textstart, p) == -1)
+				goto out;
+			depth--;
+			if (h->end(ctx, depth, tags[depth],
+				   text.s ? text.s : "", haschild[depth]) == -1)
+				goto out;
+			p = q + 1;
+			continue;
+		}
+
+		/* start tag */
+		selfclose = (q[-1] == '/');
+		for (nend = p + 1; nend < q && !isspace(*nend) && *nend != '/';
+		     nend++)
+			;
+		n = nend - (p + 1);
+		if (n == 0 || n >= GXML_MAXNAME || depth >= GXML_MAXDEPTH)
+			goto malformed;
+		if (depth > 0)
+			haschild[depth - 1] = 1;
+		memcpy(tags[depth], p + 1, n);
+		tags[depth][n] = '\0';
+		haschild[depth] = 0;
+
+		hasid = gxml_attr(nend, q, "id", id);
+		hasref = gxml_attr(nend, q, "ref", ref);
+		if (h->start(ctx, depth, tags[depth], hasid ? id : NULL,
+			     hasref ? ref : NULL) == -1)
+			goto out;
+
+		if (selfclose) {
+			if (h->end(ctx, depth, tags[depth], "", 0) == -1)
+				goto out;
+		}
+		else {
+			depth++;
+			textstart = q + 1;
+		}
+		p = q + 1;
+	}
+
+	if (depth != 0)
+		goto malformed;
+	r = 0;
+	goto out;
+
+malformed:
+	gxml_error(xml, p);
+out:
+	PyMem_Free(text.s);
+	return r;
+}
+
+/* ---------------------------------------------------------------------- */
+/*				geomtreeobject				  */
+/* ---------------------------------------------------------------------- */
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *classes;	/* class name -> class */
+	PyObject *geoms;	/* (class name, geom name) -> geom */
+	PyObject *providers;	/* provider name -> provider */
+	PyObject *ids;		/* id -> class, geom, provider or consumer */
+} geomtreeobject;
+
+static PyTypeObject GeomTreeType;
+
+struct gtree_builder {
+	PyObject *root;
+	PyObject *ids;
+	PyObject *refs;		/* (node, key) pairs to resolve */
+	PyObject *stack[GXML_MAXDEPTH + 1];	/* borrowed */
+	int config;		/* depth of the innermost <config>, or -1 */
+	int hasref[GXML_MAXDEPTH];
+};
+
+/* Elements that carry an id become nodes with these child lists. */
+static const struct {
+	const char *tag;
+	const char *list;	/* key in the parent node */
+	const char *children[3];
+} gtree_nodes[] = {
+	{"class", "classes", {"geoms", NULL}},
+	{"geom", "geoms", {"providers", "consumers", NULL}},
+	{"provider", "providers", {"consumers", NULL}},
+	{"consumer", "consumers", {NULL}},
+	{NULL},
+};
+
+static const char *gtree_numeric[] = {
+	"rank", "mediasize", "sectorsize", "stripesize", "stripeoffset", NULL,
+};
+
+static int
+gtree_start(void *ctx, int depth, const char *tag, const char *id,
+	    const char *ref)
+{
+	struct gtree_builder *b = ctx;
+	PyObject *parent = b->stack[depth], *node, *list;
+	int i, j;
+
+	b->hasref[depth] = 0;
+
+	if (id != NULL) {
+		for (i = 0; gtree_nodes[i].tag != NULL; i++)
+			if (strcmp(gtree_nodes[i].tag, tag) == 0)
+				break;
+
+		node = PyDict_New();
+		if (node == NULL)
+			return -1;
+		SETDICT_STR(node, "id", id);
+		for (j = 0; gtree_nodes[i].tag != NULL &&
+		     gtree_nodes[i].children[j] != NULL; j++)
+			PyDict_SetItemString_StealRef(node,
+				(char *)gtree_nodes[i].children[j],
+				PyList_New(0));
+
+		list = PyDict_GetItemString(parent, gtree_nodes[i].tag ?
+				(char *)gtree_nodes[i].list : (char *)tag);
+		if (list == NULL) {
+			list = PyList_New(0);
+			if (list == NULL) {
+				Py_DECREF(node);
+				return -1;
+			}
+			PyDict_SetItemString_StealRef(parent,
+				gtree_nodes[i].tag ? (char *)gtree_nodes[i].list :
+				(char *)tag, list);
+		}
+		if (PyList_Append(list, node) == -1 ||
+		    PyDict_SetItemString(b->ids, (char *)id, node) == -1) {
+			Py_DECREF(node);
+			return -1;
+		}
+		Py_DECREF(node);
+		b->stack[depth + 1] = node;
+	}
+	else if (depth > 0 && strcmp(tag, "config") == 0) {
+		node = PyDict_New();
+		if (node == NULL)
+			return -1;
+		PyDict_SetItemString_StealRef(parent, "config", node);
+		if (b->config < 0)
+			b->config = depth;
+		b->stack[depth + 1] = node;
+	}
+	else {
+		if (ref != NULL) {
+			PyObject *pair;
+
+			SETDICT_STR(parent, (char *)tag, ref);
+			pair = Py_BuildValue("(Os)", parent, tag);
+			if (PyList_Append_StealRef(b->refs, pair) == -1)
+				return -1;
+			b->hasref[depth] = 1;
+		}
+		b->stack[depth + 1] = parent;
+	}
+
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+static int
+gtree_end(void *ctx, int depth, const char *tag, const char *text,
+	  int haschild)
+{
+	struct gtree_builder *b = ctx;
+	PyObject *parent = b->stack[depth], *v = NULL;
+	int i;
+
+	if (b->config == depth)
+		b->config = -1;
+
+	/* only leaves hold values; nodes and containers are done */
+	if (haschild || b->hasref[depth] ||
+	    b->stack[depth + 1] != parent || depth == 0)
+		return 0;
+
+	if (b->config < 0)
+		for (i = 0; gtree_numeric[i] != NULL; i++)
+			if (strcmp(gtree_numeric[i], tag) == 0) {
+				v = PyInt_FromString((char *)text, NULL, 10);
+				if (v == NULL)
+					PyErr_Clear();
+				break;
+			}
+	if (v == NULL)
+		v = PyString_FromString(text);
+	if (v == NULL)
+		return -1;
+	PyDict_SetItemString_StealRef(parent, (char *)tag, v);
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+static const struct gxml_handler gtree_handler = {
+	gtree_start, gtree_end,
+};
+
+/* Replaces id references with the nodes and links consumers to the
+ * providers they are attached to. */
+static int
+gtree_resolve(struct gtree_builder *b)
+{
+	PyObject *pair, *node, *key, *target, *consumers;
+	Py_ssize_t i;
+
+	for (i = 0; i < PyList_GET_SIZE(b->refs); i++) {
+		pair = PyList_GET_ITEM(b->refs, i);
+		node = PyTuple_GET_ITEM(pair, 0);
+		key = PyTuple_GET_ITEM(pair, 1);
+		target = PyDict_GetItem(b->ids, PyDict_GetItem(node, key));
+		if (target == NULL)
+			target = Py_None;
+		if (PyDict_SetItem(node, key, target) == -1)
+			return -1;
+
+		if (target != Py_None &&
+		    strcmp(PyString_AS_STRING(key), "provider") == 0 &&
+		    PyDict_GetItemString(node, "geom") != NULL) {
+			/* a consumer attached to a provider */
+			consumers = PyDict_GetItemString(target, "consumers");
+			if (consumers != NULL &&
+			    PyList_Append(consumers, node) == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Builds the name indexes of the tree from the class list. */
+static int
+gtree_index(geomtreeobject *self, PyObject *root)
+{
+	PyObject *classes, *cls, *geoms, *geom, *provs, *prov, *name, *key;
+	Py_ssize_t i, j, k;
+
+	classes = PyDict_GetItemString(root, "classes");
+	if (classes == NULL)
+		return 0;
+
+	for (i = 0; i < PyList_GET_SIZE(classes); i++) {
+		cls = PyList_GET_ITEM(classes, i);
+		name = PyDict_GetItemString(cls, "name");
+		if (name == NULL)
+			continue;
+		if (PyDict_SetItem(self->classes, name, cls) == -1)
+			return -1;
+
+		geoms = PyDict_GetItemString(cls, "geoms");
+		for (j = 0; j < PyList_GET_SIZE(geoms); j++) {
+			geom = PyList_GET_ITEM(geoms, j);
+			key = Py_BuildValue("(OO)", name,
+				PyDict_GetItemString(geom, "name") ?
+				PyDict_GetItemString(geom, "name") : Py_None);
+			if (key == NULL ||
+			    PyDict_SetItem(self->geoms, key, geom) == -1) {
+				Py_XDECREF(key);
+				return -1;
+			}
+			Py_DECREF(key);
+
+			provs = PyDict_GetItemString(geom, "providers");
+			for (k = 0; k < PyList_GET_SIZE(provs); k++) {
+				prov = PyList_GET_ITEM(provs, k);
+				if (PyDict_GetItemString(prov, "name") &&
+				    PyDict_SetItem(self->providers,
+					PyDict_GetItemString(prov, "name"),
+					prov) == -1)
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+geomtree_build(geomtreeobject *self, const char *xml, size_t len)
+{
+	struct gtree_builder b;
+	int r = -1;
+
+	memset(&b, 0, sizeof(b));
+	b.config = -1;
+	b.root = PyDict_New();
+	b.refs = PyList_New(0);
+	b.ids = self->ids;
+	b.stack[0] = b.root;
+	if (b.root == NULL || b.refs == NULL)
+		goto out;
+
+	if (gxml_parse(xml, len, &gtree_handler, &b) == -1 ||
+	    gtree_resolve(&b) == -1 || gtree_index(self, b.root) == -1)
+		goto out;
+	r = 0;
+
+out:
+	Py_XDECREF(b.root);
+	Py_XDECREF(b.refs);
+	return r;
+}
+
+/* Falls back to the document of the running kernel when no `xml' was
+ * given.  Anything returned in `sysxml' must be free()d by the caller. */
+static int
+geom_loadxml(const char *func, char **xml, int *len, char **sysxml)
+{
+	*sysxml = NULL;
+	if (*xml != NULL)
+		return 0;
+
+#if defined(__FreeBSD__) && __FreeBSD_version >= 500101
+	*sysxml = geom_getxml();
+	if (*sysxml == NULL) {
+		OSERROR();
+		return -1;
+	}
+	*xml = *sysxml;
+	*len = strlen(*sysxml);
+	return 0;
+#else
+	PyErr_Format(PyExc_TypeError,
+		     "%s() needs an xml argument on this platform", func);
+	return -1;
+#endif
+}
+
+static PyObject *
+geomtree_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	geomtreeobject *self;
+	char *xml = NULL, *sysxml;
+	int len = 0, r;
+
+	if (!PyArg_ParseTuple(args, "|s#:geomtree", &xml, &len) ||
+	    geom_loadxml("geomtree", &xml, &len, &sysxml) == -1)
+		return NULL;
+
+	self = (geomtreeobject *)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		free(sysxml);
+		return NULL;
+	}
+
+	self->classes = PyDict_New();
+	self->geoms = PyDict_New();
+	self->providers = PyDict_New();
+	self->ids = PyDict_New();
+	if (self->classes == NULL || self->geoms == NULL ||
+	    self->providers == NULL || self->ids == NULL)
+		r = -1;
+	else
+		r = geomtree_build(self, xml, len);
+
+	free(sysxml);
+	if (r == -1) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	return (PyObject *)self;
+}
+
+static void
+geomtree_dealloc(geomtreeobject *self)
+{
+	Py_XDECREF(self->classes);
+	Py_XDECREF(self->geoms);
+	Py_XDECREF(self->providers);
+	Py_XDECREF(self->ids);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyMemberDef geomtree_members[] = {
+	{"classes", T_OBJECT, offsetof(geomtreeobject, classes), READONLY,
+	 "dict of classes by name"},
+	{"geoms", T_OBJECT, offsetof(geomtreeobject, geoms), READONLY,
+	 "dict of geoms by (class name, geom name)"},
+	{"providers", T_OBJECT, offsetof(geomtreeobject, providers), READONLY,
+	 "dict of providers by name"},
+	{"ids", T_OBJECT, offsetof(geomtreeobject, ids), READONLY,
+	 "dict of all classes, geoms, providers and consumers by id"},
+	{NULL}
+};
+
+static char geomtree_doc[] =
+"geomtree([xml]):\n"
+"parses a kern.geom.confxml document, by default the one of the running\n"
+"kernel, into a tree of dicts.  Classes have `geoms`, geoms have\n"
+"`providers` and `consumers`, and providers have the `consumers`\n"
+"attached to them.  The `class`, `geom` and `provider` references are\n"
+"resolved to the nodes themselves, and numeric fields are ints.";
+
+static PyTypeObject GeomTreeType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"geomtree",
+	tp_basicsize:	sizeof(geomtreeobject),
+	tp_dealloc:	(destructor)geomtree_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_members:	geomtree_members,
+	tp_new:		geomtree_new,
+	tp_doc:		geomtree_doc,
+};
+
+
+/* ---------------------------------------------------------------------- */
+/*			      geomsnapshotobject			  */
+/* ---------------------------------------------------------------------- */
+
+#define GPROV_MAXNAME	128
+#define GPROV_MAXSTATE	32
+
+/* What a snapshot remembers of each provider. */
+struct gprov_summary {
+	char name[GPROV_MAXNAME];
+	char mode[16];
+	char state[GPROV_MAXSTATE];	/* config state of provider or geom */
+	long long mediasize;
+	long long sectorsize;
+	long long error;
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct gprov_summary *provs;	/* sorted by name */
+	int nprovs;
+} geomsnapshotobject;
+
+static PyTypeObject GeomSnapshotType;
+
+struct gsnap_builder {
+	struct gprov_summary *provs;
+	int nprovs, size;
+	int geomdepth, provdepth, configdepth;
+	char geomstate[GPROV_MAXSTATE];
+};
+
+static void
+gsnap_copy(char *dst, const char *src, size_t size)
+{
+	snprintf(dst, size, "%s", src);
+}
+
+static int
+gsnap_start(void *ctx, int depth, const char *tag, const char *id,
+	    const char *ref)
+{
+	struct gsnap_builder *b = ctx;
+	struct gprov_summary *p;
+
+	if (id != NULL && strcmp(tag, "geom") == 0) {
+		b->geomdepth = depth;
+		b->geomstate[0] = '\0';
+	}
+	else if (id != NULL && strcmp(tag, "provider") == 0) {
+		if (b->nprovs == b->size) {
+			b->size = b->size ? b->size * 2 : 64;
+			p = PyMem_Resize(b->provs, struct gprov_summary,
+					 b->size);
+			if (p == NULL) {
+				PyErr_NoMemory();
+				return -1;
+			}
+			b->provs = p;
+		}
+		p = &b->provs[b->nprovs++];
+		memset(p, 0, sizeof(*p));
+		p->error = 0;
+		gsnap_copy(p->state, b->geomstate, sizeof(p->state));
+		b->provdepth = depth;
+	}
+	else if (strcmp(tag, "config") == 0 && b->configdepth < 0)
+		b->configdepth = depth;
+
+	return 0;
+}
+
+static int
+gsnap_end(void *ctx, int depth, const char *tag, const char *text,
+	  int haschild)
+{
+	struct gsnap_builder *b = ctx;
+	struct gprov_summary *p;
+
+	if (depth == b->configdepth)
+		b->configdepth = -1;
+	else if (depth == b->provdepth)
+		b->provdepth = -1;
+	else if (depth == b->geomdepth)
+		b->geomdepth = -1;
+	if (haschild)
+		return 0;
+
+	p = (b->provdepth >= 0) ? &b->provs[b->nprovs - 1] : NULL;
+
+	if (b->configdepth >= 0) {
+		if (depth != b->configdepth + 1 ||
+		    (strcmp(tag, "state") != 0 && strcmp(tag, "State") != 0))
+			return 0;
+		if (p != NULL)
+			gsnap_copy(p->state, text, sizeof(p->state));
+		else if (b->geomdepth >= 0)
+			gsnap_copy(b->geomstate, text, sizeof(b->geomstate));
+		return 0;
+	}
+
+	if (p == NULL || depth != b->provdepth + 1)
+		return 0;
+	if (strcmp(tag, "name") == 0)
+		gsnap_copy(p->name, text, sizeof(p->name));
+	else if (strcmp(tag, "mode") == 0)
+		gsnap_copy(p->mode, text, sizeof(p->mode));
+	else if (strcmp(tag, "mediasize") == 0)
+		p->mediasize = strtoll(text, NULL, 10);
+	else if (strcmp(tag, "sectorsize") == 0)
+		p->sectorsize = strtoll(text, NULL, 10);
+	else if (strcmp(tag, "error") == 0)
+		p->error = strtoll(text, NULL, 10);
+	return 0;
+}
+
+static const struct gxml_handler gsnap_handler = {
+	gsnap_start, gsnap_end,
+};
+
+static int
+gsnap_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct gprov_summary *)a)->name,
+		      ((const struct gprov_summary *)b)->name);
+}
+
+/* Parses a document into a sorted provider summary array. */
+static int
+gsnap_build(const char *xml, size_t len, struct gprov_summary **provs,
+	    int *nprovs)
+{
+	struct gsnap_builder b;
+
+	memset(&b, 0, sizeof(b));
+	b.geomdepth = b.provdepth = b.configdepth = -1;
+	if (gxml_parse(xml, len, &gsnap_handler, &b) == -1) {
+		PyMem_Free(b.provs);
+		return -1;
+	}
+
+	qsort(b.provs, b.nprovs, sizeof(struct gprov_summary), gsnap_cmp);
+	*provs = b.provs;
+	*nprovs = b.nprovs;
+	return 0;
+}
+
+static PyObject *
+geomsnapshot_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	geomsnapshotobject *self;
+	char *xml = NULL, *sysxml;
+	int len = 0, r;
+
+	if (!PyArg_ParseTuple(args, "|s#:geomsnapshot", &xml, &len) ||
+	    geom_loadxml("geomsnapshot", &xml, &len, &sysxml) == -1)
+		return NULL;
+
+	self = (geomsnapshotobject *)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		free(sysxml);
+		return NULL;
+	}
+
+	self->provs = NULL;
+	self->nprovs = 0;
+	r = gsnap_build(xml, len, &self->provs, &self->nprovs);
+	free(sysxml);
+	if (r == -1) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	return (PyObject *)self;
+}
+
+static void
+geomsnapshot_dealloc(geomsnapshotobject *self)
+{
+	PyMem_Free(self->provs);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+/* Adds (old, new) to `changes' under `field' */
+#define GSNAP_CHANGE(changes, field, fmt, o, n)				\
+	PyDict_SetItemString_StealRef(changes, field,			\
+				      Py_BuildValue("(" fmt fmt ")", o, n))
+
+static PyObject *
+gsnap_compare(const struct gprov_summary *o, const struct gprov_summary *n)
+{
+	PyObject *changes;
+
+	changes = PyDict_New();
+	if (changes == NULL)
+		return NULL;
+
+	if (o->mediasize != n->mediasize)
+		GSNAP_CHANGE(changes, "mediasize", "L", o->mediasize,
+			     n->mediasize);
+	if (o->sectorsize != n->sectorsize)
+		GSNAP_CHANGE(changes, "sectorsize", "L", o->sectorsize,
+			     n->sectorsize);
+	if (o->error != n->error)
+		GSNAP_CHANGE(changes, "error", "L", o->error, n->error);
+	if (strcmp(o->mode, n->mode) != 0)
+		GSNAP_CHANGE(changes, "mode", "s", o->mode, n->mode);
+	if (strcmp(o->state, n->state) != 0)
+		GSNAP_CHANGE(changes, "state", "s", o->state, n->state);
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(changes);
+		return NULL;
+	}
+	return changes;
+}
+
+static char geomsnapshot_diff_doc[] =
+"diff([xml]):\n"
+"compares the snapshot with a newer confxml document, by default the\n"
+"one of the running kernel, and returns a dict with the names of the\n"
+"`added` and `removed` providers and a `changed` dict that maps\n"
+"provider names to {field: (old, new)} for mediasize, sectorsize,\n"
+"mode, state and error.  The snapshot then represents the newer\n"
+"document.";
+
+static PyObject *
+geomsnapshot_diff(geomsnapshotobject *self, PyObject *args)
+{
+	struct gprov_summary *provs = NULL;
+	PyObject *r = NULL, *added, *removed, *changed, *c;
+	char *xml = NULL, *sysxml;
+	int len = 0, nprovs, i, j, cmp;
+
+	if (!PyArg_ParseTuple(args, "|s#:diff", &xml, &len) ||
+	    geom_loadxml("diff", &xml, &len, &sysxml) == -1)
+		return NULL;
+
+	i = gsnap_build(xml, len, &provs, &nprovs);
+	free(sysxml);
+	if (i == -1)
+		return NULL;
+
+	added = PyList_New(0);
+	removed = PyList_New(0);
+	changed = PyDict_New();
+	if (added == NULL || removed == NULL || changed == NULL)
+		goto out;
+
+	/* both arrays are sorted by name; walk them in step */
+	for (i = j = 0; i < self->nprovs || j < nprovs;) {
+		if (i == self->nprovs)
+			cmp = 1;
+		else if (j == nprovs)
+			cmp = -1;
+		else
+			cmp = strcmp(self->provs[i].name, provs[j].name);
+
+		if (cmp < 0) {
+			if (PyList_Append_StealRef(removed,
+			    PyString_FromString(self->provs[i++].name)) == -1)
+				goto out;
+		}
+		else if (cmp > 0) {
+			if (PyList_Append_StealRef(added,
+			    PyString_FromString(provs[j++].name)) == -1)
+				goto out;
+		}
+		else {
+			c = gsnap_compare(&self->provs[i], &provs[j]);
+			if (c == NULL)
+				goto out;
+			if (PyDict_Size(c) > 0 &&
+			    PyDict_SetItemString(changed, provs[j].name,
+						 c) == -1) {
+				Py_DECREF(c);
+				goto out;
+			}
+			Py_DECREF(c);
+			i++, j++;
+		}
+	}
+
+	r = Py_BuildValue("{sOsOsO}", "added", added, "removed", removed,
+			  "changed", changed);
+	if (r != NULL) {
+		PyMem_Free(self->provs);
+		self->provs = provs;
+		self->nprovs = nprovs;
+		provs = NULL;
+	}
+
+out:
+	Py_XDECREF(added);
+	Py_XDECREF(removed);
+	Py_XDECREF(changed);
+	PyMem_Free(provs);
+	return r;
+}
+
+static Py_ssize_t
+geomsnapshot_length(geomsnapshotobject *self)
+{
+	return self->nprovs;
+}
+
+static PySequenceMethods geomsnapshot_as_sequence = {
+	sq_length:	(lenfunc)geomsnapshot_length,
+};
+
+static PyMethodDef geomsnapshot_methods[] = {
+	{"diff", (PyCFunction)geomsnapshot_diff, METH_VARARGS,
+	 geomsnapshot_diff_doc},
+	{NULL, NULL}
+};
+
+static char geomsnapshot_doc[] =
+"geomsnapshot([xml]):\n"
+"keeps a compact C summary of every provider in a confxml document,\n"
+"by default the one of the running kernel, so that topology changes\n"
+"can be detected with diff() without building a geomtree.  len()\n"
+"returns the number of providers.";
+
+static PyTypeObject GeomSnapshotType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"geomsnapshot",
+	tp_basicsize:	sizeof(geomsnapshotobject),
+	tp_dealloc:	(destructor)geomsnapshot_dealloc,
+	tp_as_sequence:	&geomsnapshot_as_sequence,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	geomsnapshot_methods,
+	tp_new:		geomsnapshot_new,
+	tp_doc:		geomsnapshot_doc,
+};
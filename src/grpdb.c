@@ -0,0 +1,569 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifdef __FreeBSD__
+
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
+
+/* Types */
+DECLTYPE(GroupIndexType, groupindexobject)
+
+static PyObject *
+PyObject_FromGroup(struct group *grp)
+{
+	PyObject *r, *mem;
+	char **m;
+
+	mem = PyList_New(0);
+	if (mem == NULL)
+		return NULL;
+	for (m = grp->gr_mem; m != NULL && *m != NULL; m++)
+		if (PyList_Append_StealRef(mem,
+					   PyString_FromString(*m)) == -1) {
+			Py_DECREF(mem);
+			return NULL;
+		}
+
+	r = PyDict_New();
+	SETDICT_STR(r, "name", grp->gr_name);
+	SETDICT_STR(r, "passwd", grp->gr_passwd);
+	SETDICT_INT(r, "gid", grp->gr_gid);
+	PyDict_SetItemString_StealRef(r, "mem", mem);
+
+	return r;
+}
+
+
+static char PyFB_getgrgid__doc__[] =
+"getgrgid(gid):\n"
+"search the group database for the given group id, always returning\n"
+"the first one encountered.";
+
+static PyObject *
+PyFB_getgrgid(PyObject *self, PyObject *args)
+{
+	struct group *grp;
+	int gid;
+
+	if (!PyArg_ParseTuple(args, "i:getgrgid", &gid))
+		return NULL;
+
+	errno = 0;
+	grp = getgrgid((gid_t)gid);
+	if (grp == NULL) {
+		if (errno == 0) {
+			PyObject *gidn = PyInt_FromLong(gid);
+			PyErr_SetObject(PyExc_KeyError, gidn);
+			Py_DECREF(gidn);
+			return NULL;
+		}
+		else
+			return OSERROR();
+	}
+	return PyObject_FromGroup(grp);
+}
+
+static char PyFB_getgrnam__doc__[] =
+"getgrnam(name):\n"
+"search the group database for the given group name, always\n"
+"returning the first one encountered.";
+
+static PyObject *
+PyFB_getgrnam(PyObject *self, PyObject *args)
+{
+	struct group *grp;
+	char *name;
+
+	if (!PyArg_ParseTuple(args, "s:getgrnam", &name))
+		return NULL;
+
+	errno = 0;
+	grp = getgrnam(name);
+	if (grp == NULL) {
+		if (errno == 0) {
+			PyErr_SetString(PyExc_KeyError, name);
+			return NULL;
+		}
+		else
+			return OSERROR();
+	}
+	return PyObject_FromGroup(grp);
+}
+
+static char PyFB_getgrent__doc__[] =
+"getgrent():\n"
+"reads the whole group database and is intended for programs\n"
+"that wish to process the complete list of groups.";
+
+static PyObject *
+PyFB_getgrent(PyObject *self)
+{
+	PyObject *r;
+	struct group *grp;
+
+	r = PyList_New(0);
+	if (r == NULL)
+		return NULL;
+
+	setgrent();
+	while ((grp = getgrent()) != NULL)
+		if (PyList_Append_StealRef(r, PyObject_FromGroup(grp)) == -1) {
+			Py_DECREF(r);
+			r = NULL;
+			break;
+		}
+	endgrent();
+
+	return r;
+}
+
+static char PyFB_getgrouplist__doc__[] =
+"getgrouplist(name, basegid):\n"
+"returns the list of group ids user `name` is a member of, starting\n"
+"with `basegid` which is usually the group id from the password file.\n"
+"raises OSError (ERANGE) if the user is in more groups than fit in\n"
+"65536 entries.";
+
+static PyObject *
+PyFB_getgrouplist(PyObject *self, PyObject *args)
+{
+	PyObject *r;
+	gid_t *groups;
+	char *name;
+	int basegid, ngroups, size, i, res;
+
+	if (!PyArg_ParseTuple(args, "si:getgrouplist", &name, &basegid))
+		return NULL;
+
+	size = sysconf(_SC_NGROUPS_MAX) + 1;
+	if (size < 16)
+		size = 16;
+
+	for (;;) {
+		groups = PyMem_New(gid_t, size);
+		if (groups == NULL)
+			return PyErr_NoMemory();
+		ngroups = size;
+		Py_BEGIN_ALLOW_THREADS
+		res = getgrouplist(name, (gid_t)basegid, groups, &ngroups);
+		Py_END_ALLOW_THREADS
+		if (res != -1 || size >= 65536)
+			break;
+		/* too small; some versions report the size needed */
+		PyMem_Del(groups);
+		size = (ngroups > size) ? ngroups : size * 2;
+	}
+	if (res == -1) {
+		/* never hand out a silently truncated list */
+		PyMem_Del(groups);
+		errno = ERANGE;
+		return OSERROR();
+	}
+	if (ngroups > size)
+		ngroups = size;
+
+	r = PyList_New(ngroups);
+	for (i = 0; r != NULL && i < ngroups; i++)
+		PyList_SET_ITEM(r, i, PyInt_FromLong(groups[i]));
+	PyMem_Del(groups);
+
+	return r;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/*			      groupindexobject				  */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * groupindex answers "which groups is uid X in" from a flat table built
+ * in one pass over the password and group databases: the users sorted
+ * by uid, each pointing at its sorted run of gids (primary group
+ * included).  Both lookups are binary searches.
+ */
+
+struct gidx_user {
+	uid_t	uid;
+	int	off, n;		/* run of gids in the gid vector */
+};
+
+struct gidx {
+	struct gidx_user *users;
+	int	nusers;
+	gid_t	*gids;
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct gidx x;
+} groupindexobject;
+
+static PyTypeObject GroupIndexType;
+
+struct gidx_name {
+	char	*name;
+	uid_t	uid;
+};
+
+struct gidx_pair {
+	uid_t	uid;
+	gid_t	gid;
+};
+
+static int
+gidx_cmpname(const void *a, const void *b)
+{
+	return strcmp(((const struct gidx_name *)a)->name,
+		      ((const struct gidx_name *)b)->name);
+}
+
+static int
+gidx_cmppair(const void *a, const void *b)
+{
+	const struct gidx_pair *p = a, *q = b;
+
+	if (p->uid != q->uid)
+		return p->uid < q->uid ? -1 : 1;
+	if (p->gid != q->gid)
+		return p->gid < q->gid ? -1 : 1;
+	return 0;
+}
+
+static void
+gidx_free(struct gidx *x)
+{
+	free(x->users);
+	free(x->gids);
+	memset(x, 0, sizeof(*x));
+}
+
+static int
+gidx_addpair(struct gidx_pair **pairs, int *npairs, int *size,
+	     uid_t uid, gid_t gid)
+{
+	struct gidx_pair *p;
+
+	if (*npairs == *size) {
+		p = realloc(*pairs, sizeof(*p) * (*size ? *size * 2 : 1024));
+		if (p == NULL)
+			return -1;
+		*pairs = p;
+		*size = *size ? *size * 2 : 1024;
+	}
+	(*pairs)[*npairs].uid = uid;
+	(*pairs)[*npairs].gid = gid;
+	(*npairs)++;
+	return 0;
+}
+
+/* Builds the index from the databases.  Called without the GIL. */
+static int
+gidx_load(struct gidx *x)
+{
+	struct gidx_name *names = NULL, key, *found;
+	struct gidx_pair *pairs = NULL;
+	int nnames = 0, namesize = 0, npairs = 0, pairsize = 0;
+	int i, j, r = -1;
+	struct passwd *pwd;
+	struct group *grp;
+	char **m;
+
+	memset(x, 0, sizeof(*x));
+
+	/* login names to uids, and every user's primary group */
+	setpwent();
+	while ((pwd = getpwent()) != NULL) {
+		if (nnames == namesize) {
+			found = realloc(names, sizeof(*names) *
+					(namesize ? namesize * 2 : 256));
+			if (found == NULL)
+				goto endpw;
+			names = found;
+			namesize = namesize ? namesize * 2 : 256;
+		}
+		names[nnames].name = strdup(pwd->pw_name);
+		if (names[nnames].name == NULL)
+			goto endpw;
+		names[nnames++].uid = pwd->pw_uid;
+		if (gidx_addpair(&pairs, &npairs, &pairsize,
+				 pwd->pw_uid, pwd->pw_gid) == -1)
+			goto endpw;
+	}
+	r = 0;
+endpw:
+	endpwent();
+	if (r == -1)
+		goto out;
+	if (nnames > 0)
+		qsort(names, nnames, sizeof(*names), gidx_cmpname);
+
+	/* supplementary groups by member name */
+	r = -1;
+	setgrent();
+	while ((grp = getgrent()) != NULL)
+		for (m = grp->gr_mem; m != NULL && *m != NULL; m++) {
+			key.name = *m;
+			found = (nnames > 0) ? bsearch(&key, names, nnames,
+					sizeof(*names), gidx_cmpname) : NULL;
+			if (found != NULL &&
+			    gidx_addpair(&pairs, &npairs, &pairsize,
+					 found->uid, grp->gr_gid) == -1)
+				goto endgr;
+		}
+	r = 0;
+endgr:
+	endgrent();
+	if (r == -1)
+		goto out;
+
+	/* sort by (uid, gid) and fold into per-user runs */
+	r = -1;
+	if (npairs > 0)
+		qsort(pairs, npairs, sizeof(*pairs), gidx_cmppair);
+	x->users = malloc(sizeof(*x->users) * (npairs ? npairs : 1));
+	x->gids = malloc(sizeof(*x->gids) * (npairs ? npairs : 1));
+	if (x->users == NULL || x->gids == NULL)
+		goto out;
+	for (i = 0, j = 0; i < npairs; i++) {
+		if (i > 0 && gidx_cmppair(&pairs[i - 1], &pairs[i]) == 0)
+			continue;
+		if (x->nusers == 0 ||
+		    x->users[x->nusers - 1].uid != pairs[i].uid) {
+			x->users[x->nusers].uid = pairs[i].uid;
+			x->users[x->nusers].off = j;
+			x->users[x->nusers].n = 0;
+			x->nusers++;
+		}
+		x->gids[j++] = pairs[i].gid;
+		x->users[x->nusers - 1].n++;
+	}
+	r = 0;
+
+out:
+	for (i = 0; i < nnames; i++)
+		free(names[i].name);
+	free(names);
+	free(pairs);
+	if (r == -1)
+		gidx_free(x);
+	return r;
+}
+
+static struct gidx_user *
+gidx_find(struct gidx *x, uid_t uid)
+{
+	int lo = 0, hi = x->nusers - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (x->users[mid].uid == uid)
+			return &x->users[mid];
+		if (x->users[mid].uid < uid)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+static int
+gidx_ismember(struct gidx *x, struct gidx_user *u, gid_t gid)
+{
+	gid_t *v = x->gids + u->off;
+	int lo = 0, hi = u->n - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (v[mid] == gid)
+			return 1;
+		if (v[mid] < gid)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return 0;
+}
+
+static int
+groupindex_reload(groupindexobject *self)
+{
+	struct gidx x;
+	int r;
+
+	Py_BEGIN_ALLOW_THREADS
+	r = gidx_load(&x);
+	Py_END_ALLOW_THREADS
+	if (r == -1) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	gidx_free(&self->x);
+	self->x = x;
+	return 0;
+}
+
+static PyObject *
+groupindex_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	groupindexobject *self;
+
+	if (!PyArg_ParseTuple(args, ":groupindex"))
+		return NULL;
+
+	self = (groupindexobject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	memset(&self->x, 0, sizeof(self->x));
+	if (groupindex_reload(self) == -1) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+static void
+groupindex_dealloc(groupindexobject *self)
+{
+	gidx_free(&self->x);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static struct gidx_user *
+groupindex_user(groupindexobject *self, int uid)
+{
+	struct gidx_user *u;
+
+	u = gidx_find(&self->x, (uid_t)uid);
+	if (u == NULL) {
+		PyObject *uidn = PyInt_FromLong(uid);
+		PyErr_SetObject(PyExc_KeyError, uidn);
+		Py_DECREF(uidn);
+	}
+	return u;
+}
+
+static char groupindex_groups_doc[] =
+"groups(uid):\n"
+"returns the sorted list of gids user `uid` is a member of, including\n"
+"the primary group.  raises KeyError for an unknown uid.";
+
+static PyObject *
+groupindex_groups(groupindexobject *self, PyObject *args)
+{
+	struct gidx_user *u;
+	PyObject *r;
+	int uid, i;
+
+	if (!PyArg_ParseTuple(args, "i:groups", &uid))
+		return NULL;
+
+	if ((u = groupindex_user(self, uid)) == NULL)
+		return NULL;
+
+	r = PyList_New(u->n);
+	for (i = 0; r != NULL && i < u->n; i++)
+		PyList_SET_ITEM(r, i,
+			PyInt_FromLong(self->x.gids[u->off + i]));
+	return r;
+}
+
+static char groupindex_ismember_doc[] =
+"ismember(uid, gid):\n"
+"returns whether user `uid` is a member of group `gid`.";
+
+static PyObject *
+groupindex_ismember(groupindexobject *self, PyObject *args)
+{
+	struct gidx_user *u;
+	int uid, gid;
+
+	if (!PyArg_ParseTuple(args, "ii:ismember", &uid, &gid))
+		return NULL;
+
+	u = gidx_find(&self->x, (uid_t)uid);
+	return PyBool_FromLong(u != NULL &&
+			       gidx_ismember(&self->x, u, (gid_t)gid));
+}
+
+static char groupindex_refresh_doc[] =
+"refresh():\n"
+"rebuilds the index from the password and group databases.";
+
+static PyObject *
+groupindex_refresh(groupindexobject *self)
+{
+	if (groupindex_reload(self) == -1)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+groupindex_length(groupindexobject *self)
+{
+	return self->x.nusers;
+}
+
+static PyMethodDef groupindex_methods[] = {
+	{"groups", (PyCFunction)groupindex_groups, METH_VARARGS,
+	 groupindex_groups_doc},
+	{"ismember", (PyCFunction)groupindex_ismember, METH_VARARGS,
+	 groupindex_ismember_doc},
+	{"refresh", (PyCFunction)groupindex_refresh, METH_NOARGS,
+	 groupindex_refresh_doc},
+	{NULL, NULL}
+};
+
+static PySequenceMethods groupindex_as_sequence = {
+	sq_length:	(lenfunc)groupindex_length,
+};
+
+static char groupindex_doc[] =
+"groupindex():\n"
+"builds a uid to group membership index in one pass over the password\n"
+"and group databases.  groups() and ismember() are binary searches in\n"
+"C; call refresh() to pick up database changes.";
+
+static PyTypeObject GroupIndexType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"groupindex",
+	tp_basicsize:	sizeof(groupindexobject),
+	tp_dealloc:	(destructor)groupindex_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_as_sequence:	&groupindex_as_sequence,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	groupindex_methods,
+	tp_new:		groupindex_new,
+	tp_doc:		groupindex_doc,
+};
+
+#endif
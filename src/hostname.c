@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 static char PyFB_gethostname__doc__[] =
 "gethostname():\n"
 "returns the standard host name for the current processor, as\n"
@@ -62,3 +64,5 @@ PyFB_sethostname(PyObject *self, PyObject *args)
 
 	Py_RETURN_NONE;
 }
+
+#endif
@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <sys/jail.h>
 
 static char PyFB_jail__doc__[] =
@@ -39,23 +41,55 @@ static char PyFB_jail__doc__[] =
 static PyObject *
 PyFB_jail(PyObject *self, PyObject *args)
 {
-	struct jail jp;
-	char *ipaddr;
+	char *path, *hostname, *ipaddr;
+	struct in_addr ip;
 
-	if (!PyArg_ParseTuple(args, "sss:jail", &(jp.path),
-			      &(jp.hostname), &ipaddr))
+	if (!PyArg_ParseTuple(args, "sss:jail", &path, &hostname, &ipaddr))
 		return NULL;
 
-	jp.version   = 0;
-	jp.ip_number = inet_addr(ipaddr);
-
-	if (jp.ip_number == INADDR_NONE) {
+	ip.s_addr = inet_addr(ipaddr);
+	if (ip.s_addr == INADDR_NONE) {
 		PyErr_SetString(PyExc_ValueError, "malformed internet address");
 		return NULL;
 	}
 
-	if (jail(&jp) == -1)
-		return OSERROR();
+#if __FreeBSD_version >= 800000
+	{
+		/* the same jail through jail_set(2), without the version 0
+		 * struct jail compatibility shim in the kernel */
+		struct iovec iov[6];
+
+		iov[0].iov_base = "path";
+		iov[0].iov_len = sizeof("path");
+		iov[1].iov_base = path;
+		iov[1].iov_len = strlen(path) + 1;
+		iov[2].iov_base = "host.hostname";
+		iov[2].iov_len = sizeof("host.hostname");
+		iov[3].iov_base = hostname;
+		iov[3].iov_len = strlen(hostname) + 1;
+		iov[4].iov_base = "ip4.addr";
+		iov[4].iov_len = sizeof("ip4.addr");
+		iov[5].iov_base = &ip;
+		iov[5].iov_len = sizeof(ip);
+
+		if (jail_set(iov, 6, JAIL_CREATE | JAIL_ATTACH) == -1)
+			return OSERROR();
+	}
+#else
+	{
+		struct jail jp;
+
+		jp.version   = 0;
+		jp.path      = path;
+		jp.hostname  = hostname;
+		jp.ip_number = ntohl(ip.s_addr);
+
+		if (jail(&jp) == -1)
+			return OSERROR();
+	}
+#endif
 
 	Py_RETURN_NONE;
 }
+
+#endif
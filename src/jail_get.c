@@ -24,75 +24,856 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __FreeBSD__
+
+#if __FreeBSD_version >= 800000
+
+LIB_DEPENDS(jail)
+#include <sys/sysctl.h>
+#include <sys/wait.h>
+#include <jail.h>
+
+EXPCONST(int JAIL_CREATE)
+EXPCONST(int JAIL_UPDATE)
+EXPCONST(int JAIL_ATTACH)
+EXPCONST(int JAIL_DYING)
+
+/*
+ * Jail parameters are handled with libjail, which looks up the type of
+ * each parameter in the security.jail.param sysctl tree once per call
+ * and builds the iovecs for jail_get(2) and jail_set(2).
+ */
+
+/* parameters returned by jail_get() and jail_list() by default */
+static const char *jailparam_defaults[] = {
+	"jid", "name", "path", "host.hostname", "ip4.addr", NULL,
+};
+
+static PyObject *
+jailparam_error(void)
+{
+	PyObject *v;
+
+	v = Py_BuildValue("(is)", errno, jail_errmsg);
+	if (v != NULL) {
+		PyErr_SetObject(PyExc_OSError, v);
+		Py_DECREF(v);
+	}
+	return NULL;
+}
+
+/*
+ * Initializes jp[0] as the key parameter `key' and jp[1..] with the
+ * parameter names in sequence `names' (or the defaults if NULL).
+ * returns the number of parameters or -1 on error.
+ */
+static int
+jailparam_setup(struct jailparam **jpp, const char *key, PyObject *names)
+{
+	struct jailparam *jp;
+	PyObject *seq = NULL;
+	const char *name;
+	int n, i;
+
+	if (names != NULL) {
+		seq = PySequence_Fast(names, "params must be a sequence");
+		if (seq == NULL)
+			return -1;
+		n = PySequence_Fast_GET_SIZE(seq);
+	}
+	else
+		for (n = 0; jailparam_defaults[n] != NULL; n++)
+			;
+
+	jp = PyMem_New(struct jailparam, n + 1);
+	if (jp == NULL) {
+		Py_XDECREF(seq);
+		PyErr_NoMemory();
+		return -1;
+	}
+	memset(jp, 0, sizeof(struct jailparam) * (n + 1));
+
+	if (jailparam_init(&jp[0], key) == -1) {
+		PyMem_Free(jp);
+		Py_XDECREF(seq);
+		jailparam_error();
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (seq != NULL) {
+			name = PyString_AsString(
+					PySequence_Fast_GET_ITEM(seq, i));
+			if (name == NULL)
+				goto error;
+		}
+		else
+			name = jailparam_defaults[i];
+		if (jailparam_init(&jp[i + 1], name) == -1) {
+			jailparam_error();
+			goto error;
+		}
+	}
+
+	Py_XDECREF(seq);
+	*jpp = jp;
+	return n + 1;
+
+error:
+	jailparam_free(jp, i + 1);
+	PyMem_Free(jp);
+	Py_XDECREF(seq);
+	return -1;
+}
+
+static void
+jailparam_release(struct jailparam *jp, int n)
+{
+	jailparam_free(jp, n);
+	PyMem_Free(jp);
+}
+
+/* Converts a fetched parameter value to the matching Python type. */
+static PyObject *
+jailparam_topython(struct jailparam *jp)
+{
+	PyObject *r;
+	char *s;
+
+	if (jp->jp_value == NULL)
+		Py_RETURN_NONE;
+
+	if ((jp->jp_flags & (JP_BOOL | JP_NOBOOL)) &&
+	    jp->jp_valuelen == sizeof(int))
+		return PyBool_FromLong(*(int *)jp->jp_value);
+
+	if (!(jp->jp_flags & JP_JAILSYS))
+		switch (jp->jp_ctltype & CTLTYPE) {
+		case CTLTYPE_INT:
+			if (jp->jp_valuelen == sizeof(int))
+				return PyInt_FromLong(*(int *)jp->jp_value);
+			break;
+		case CTLTYPE_UINT:
+			if (jp->jp_valuelen == sizeof(unsigned int))
+				return PyLong_FromUnsignedLong(
+					*(unsigned int *)jp->jp_value);
+			break;
+		case CTLTYPE_LONG:
+			if (jp->jp_valuelen == sizeof(long))
+				return PyInt_FromLong(*(long *)jp->jp_value);
+			break;
+		case CTLTYPE_ULONG:
+			if (jp->jp_valuelen == sizeof(unsigned long))
+				return PyLong_FromUnsignedLong(
+					*(unsigned long *)jp->jp_value);
+			break;
+		case CTLTYPE_STRING:
+			return PyString_FromString(jp->jp_value);
+		}
+
+	/* addresses, arrays and the like in their usual text form */
+	s = jailparam_export(jp);
+	if (s == NULL)
+		return jailparam_error();
+	r = PyString_FromString(s);
+	free(s);
+	return r;
+}
+
+/* Imports a Python value into a parameter using its text form. */
+static int
+jailparam_frompython(struct jailparam *jp, PyObject *v)
+{
+	PyObject *s, *sep;
+	int r;
+
+	if (v == Py_None)
+		s = PyString_FromString("");
+	else if (PyBool_Check(v))
+		s = PyString_FromString(v == Py_True ? "true" : "false");
+	else if (PyList_Check(v) || PyTuple_Check(v)) {
+		PyObject *strs;
+		Py_ssize_t i;
+
+		strs = PyList_New(PySequence_Size(v));
+		for (i = 0; strs != NULL && i < PyList_GET_SIZE(strs); i++) {
+			PyObject *item = PyObject_Str(
+					PySequence_Fast_GET_ITEM(v, i));
+			if (item == NULL) {
+				Py_DECREF(strs);
+				strs = NULL;
+			}
+			else
+				PyList_SET_ITEM(strs, i, item);
+		}
+		if (strs == NULL)
+			return -1;
+		sep = PyString_FromString(",");
+		s = (sep != NULL) ? _PyString_Join(sep, strs) : NULL;
+		Py_XDECREF(sep);
+		Py_DECREF(strs);
+	}
+	else
+		s = PyObject_Str(v);
+	if (s == NULL)
+		return -1;
+
+	r = jailparam_import(jp, PyString_AS_STRING(s));
+	Py_DECREF(s);
+	if (r == -1) {
+		jailparam_error();
+		return -1;
+	}
+	return 0;
+}
+
+/* Column name of a parameter; the defaults keep their old short names. */
+static const char *
+jailparam_column(struct jailparam *jp, int defaults)
+{
+	if (defaults && strcmp(jp->jp_name, "host.hostname") == 0)
+		return "hostname";
+	if (defaults && strcmp(jp->jp_name, "ip4.addr") == 0)
+		return "ip4";
+	return jp->jp_name;
+}
+
+/* Fetches one jail selected by the key parameter jp[0].  returns the
+ * jid, 0 if there is no such jail, or -1 with an exception set. */
+static int
+jailparam_fetch(struct jailparam *jp, int n)
+{
+	int jid;
+
+	Py_BEGIN_ALLOW_THREADS
+	jid = jailparam_get(jp, n, 0);
+	Py_END_ALLOW_THREADS
+
+	if (jid == -1) {
+		if (errno == ENOENT)
+			return 0;
+		jailparam_error();
+	}
+	return jid;
+}
+
+static PyObject *
+jailparam_todict(struct jailparam *jp, int n, int defaults)
+{
+	PyObject *d, *v;
+	int i;
+
+	d = PyDict_New();
+	if (d == NULL)
+		return NULL;
+
+	for (i = 1; i < n; i++) {
+		v = jailparam_topython(&jp[i]);
+		if (v == NULL) {
+			Py_DECREF(d);
+			return NULL;
+		}
+		PyDict_SetItemString_StealRef(d,
+			(char *)jailparam_column(&jp[i], defaults), v);
+	}
+
+	return d;
+}
+
+/* Sets up the key parameter to select a jail by jid or name. */
+static int
+jailparam_setup_key(struct jailparam **jpp, PyObject *jail, PyObject *names)
+{
+	int n, r;
+
+	if (PyString_Check(jail)) {
+		n = jailparam_setup(jpp, "name", names);
+		if (n == -1)
+			return -1;
+		r = jailparam_import(&(*jpp)[0], PyString_AS_STRING(jail));
+	}
+	else {
+		int jid = PyInt_AsLong(jail);
+		char buf[16];
+
+		if (jid == -1 && PyErr_Occurred())
+			return -1;
+		n = jailparam_setup(jpp, "jid", names);
+		if (n == -1)
+			return -1;
+		/* imported as text: libjail keeps raw values by reference */
+		snprintf(buf, sizeof(buf), "%d", jid);
+		r = jailparam_import(&(*jpp)[0], buf);
+	}
+
+	if (r == -1) {
+		jailparam_release(*jpp, n);
+		jailparam_error();
+		return -1;
+	}
+	return n;
+}
+
+/* Stores a jail's parameter dict `d' in `r' under the jail's name. */
+static int
+jailparam_setbyname(PyObject *r, int jid, PyObject *d)
+{
+	PyObject *name;
+	char *s;
+	int res;
+
+	name = PyDict_GetItemString(d, "name");
+	if (name != NULL)
+		res = PyDict_SetItem(r, name, d);
+	else {
+		s = jail_getname(jid);
+		if (s == NULL) {
+			Py_DECREF(d);
+			jailparam_error();
+			return -1;
+		}
+		res = PyDict_SetItemString(r, s, d);
+		free(s);
+	}
+	Py_DECREF(d);
+	return res;
+}
+
 static char PyFB_jail_get__doc__[] =
-"jail_get(jid):\n"
-"The jail_get() system call retrieves jail parameters.\n"
-"The jail to read can be specified by using either the jail's jid or name.\n"
-"The returned parameters are the the jail's jid, name, path, hostname and IPv4 address.\n"
-"In order to list the parameters of all jails use 0 (zero) as the jid.\n";
+"jail_get(jail[, params]):\n"
+"returns a dict of the parameters of the jail selected by its jid or\n"
+"name.  `params` is a sequence of jail parameter names; by default\n"
+"the jail's jid, name, path, hostname and ip4 are returned.  A jid of\n"
+"0 (zero) returns a dict of all jails keyed by name.  Integer and\n"
+"boolean parameters are returned as such and the others in their\n"
+"text form.";
 
 static PyObject *
 PyFB_jail_get(PyObject *self, PyObject *args)
 {
-	PyObject *r, *d;
-        struct iovec jparams[10];
-	struct in_addr ip4;
-	char path[MAXPATHLEN], hostname[MAXHOSTNAMELEN], name[MAXHOSTNAMELEN];
-	int jid;
+	PyObject *jail, *names = NULL, *r, *d;
+	struct jailparam *jp;
+	int n, jid, defaults;
 
-        if (!PyArg_ParseTuple(args, "i:jail_get", &jid))
+	if (!PyArg_ParseTuple(args, "O|O:jail_get", &jail, &names))
 		return NULL;
+	defaults = (names == NULL);
+
+	if (PyInt_Check(jail) && PyInt_AS_LONG(jail) == 0) {
+		n = jailparam_setup(&jp, "lastjid", names);
+		if (n == -1)
+			return NULL;
+
+		r = PyDict_New();
+		for (jid = 0; r != NULL;) {
+			if (jailparam_import_raw(&jp[0], &jid,
+						 sizeof(jid)) == -1) {
+				jailparam_error();
+				break;
+			}
+			jid = jailparam_fetch(jp, n);
+			if (jid <= 0)
+				break;
+
+			d = jailparam_todict(jp, n, defaults);
+			if (d == NULL)
+				break;
+			if (jailparam_setbyname(r, jid, d) == -1)
+				break;
+		}
+	}
+	else {
+		n = jailparam_setup_key(&jp, jail, names);
+		if (n == -1)
+			return NULL;
 
-	*(const void **) &jparams[0].iov_base = "lastjid";
-	jparams[0].iov_len = sizeof("lastjid");
-	jparams[1].iov_base = &jid;
-	jparams[1].iov_len = sizeof(jid);
+		r = NULL;
+		jid = jailparam_fetch(jp, n);
+		if (jid == 0)
+			PyErr_SetString(PyExc_KeyError, "no such jail");
+		else if (jid > 0)
+			r = jailparam_todict(jp, n, defaults);
+	}
 
-	*(const void **) &jparams[2].iov_base = "path";
-	jparams[2].iov_len = sizeof("path");
-	jparams[3].iov_base = &path;
-	jparams[3].iov_len = MAXPATHLEN;
+	jailparam_release(jp, n);
+	if (PyErr_Occurred()) {
+		Py_XDECREF(r);
+		return NULL;
+	}
+	return r;
+}
 
-	*(const void **) &jparams[4].iov_base = "host.hostname";
-	jparams[4].iov_len = sizeof("host.hostname");
-	jparams[5].iov_base = &hostname;
-	jparams[5].iov_len = MAXHOSTNAMELEN;
+static char PyFB_jail_list__doc__[] =
+"jail_list([params]):\n"
+"fetches the parameters named in `params` (by default jid, name,\n"
+"path, host.hostname and ip4.addr) of all jails in one pass and\n"
+"returns them as a dict of columns, each a list with one entry per\n"
+"jail.";
 
-	*(const void **) &jparams[6].iov_base = "name";
-	jparams[6].iov_len = sizeof("name");
-	jparams[7].iov_base = &name;
-	jparams[7].iov_len = MAXHOSTNAMELEN;
+static PyObject *
+PyFB_jail_list(PyObject *self, PyObject *args)
+{
+	PyObject *names = NULL, *r, *cols, *col;
+	struct jailparam *jp;
+	int n, i, jid;
 
-	*(const void **) &jparams[8].iov_base = "ip4.addr";
-	jparams[8].iov_len = sizeof("ip4.addr");
-	jparams[9].iov_base = &ip4;
-	jparams[9].iov_len = sizeof(struct in_addr);
+	if (!PyArg_ParseTuple(args, "|O:jail_list", &names))
+		return NULL;
 
+	n = jailparam_setup(&jp, "lastjid", names);
+	if (n == -1)
+		return NULL;
+
+	/* one list per parameter, in parameter order */
+	cols = PyTuple_New(n - 1);
 	r = PyDict_New();
+	for (i = 1; cols != NULL && r != NULL && i < n; i++) {
+		col = PyList_New(0);
+		if (col == NULL)
+			break;
+		PyTuple_SET_ITEM(cols, i - 1, col);
+		PyDict_SetItemString(r, jp[i].jp_name, col);
+	}
 
-	if (jid == 0) {
-		while ((jid = jail_get(jparams, 10, 0)) > 0) {
-			d = PyDict_New();
-			SETDICT_INT(d, "jid", jid);
-			SETDICT_STR(d, "ip4", inet_ntoa(ip4));
-			SETDICT_STR(d, "path", path);
-			SETDICT_STR(d, "hostname", hostname);
-			PyDict_SetItemString(r, name, d);
+	for (jid = 0; !PyErr_Occurred();) {
+		if (jailparam_import_raw(&jp[0], &jid, sizeof(jid)) == -1) {
+			jailparam_error();
+			break;
 		}
-	} else {
-		/*
-		 * Decrement the jid by 1 to allow fetching parameters of the jid passed.
-		 * See jail(2) for more info.
-		 */
-		jid--;
-		jid = jail_get(jparams, 10, 0);
-		SETDICT_INT(r, "jid", jid);
-		SETDICT_STR(r, "name", name);
-		SETDICT_STR(r, "ip4", inet_ntoa(ip4));
-		SETDICT_STR(r, "path", path);
-		SETDICT_STR(r, "hostname", hostname);
+		jid = jailparam_fetch(jp, n);
+		if (jid <= 0)
+			break;
+		for (i = 1; i < n; i++)
+			if (PyList_Append_StealRef(PyTuple_GET_ITEM(cols, i - 1),
+				jailparam_topython(&jp[i])) == -1)
+				break;
 	}
 
-	return (r);
+	jailparam_release(jp, n);
+	Py_XDECREF(cols);
+	if (PyErr_Occurred()) {
+		Py_XDECREF(r);
+		return NULL;
+	}
+	return r;
 }
 
+/*
+ * Imports the parameters in dict `params' into a new array with room
+ * for `extra' more entries.  returns the number imported or -1.
+ */
+static int
+jailparam_fromdict(PyObject *params, int extra, struct jailparam **jpp)
+{
+	PyObject *key, *value;
+	struct jailparam *jp;
+	Py_ssize_t pos = 0;
+	int n = 0;
+
+	jp = PyMem_New(struct jailparam, PyDict_Size(params) + extra + 1);
+	if (jp == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	while (PyDict_Next(params, &pos, &key, &value)) {
+		if (!PyString_Check(key)) {
+			PyErr_SetString(PyExc_TypeError,
+					"parameter names must be strings");
+			goto error;
+		}
+		if (jailparam_init(&jp[n], PyString_AS_STRING(key)) == -1) {
+			jailparam_error();
+			goto error;
+		}
+		n++;
+		if (jailparam_frompython(&jp[n - 1], value) == -1)
+			goto error;
+	}
+
+	*jpp = jp;
+	return n;
+
+error:
+	jailparam_release(jp, n);
+	return -1;
+}
+
+/* Creates or updates a jail from dict `params'.  returns the jid. */
+static int
+jail_setdict(PyObject *params, int flags)
+{
+	struct jailparam *jp;
+	int n, jid;
+
+	n = jailparam_fromdict(params, 0, &jp);
+	if (n == -1)
+		return -1;
+
+	Py_BEGIN_ALLOW_THREADS
+	jid = jailparam_set(jp, n, flags);
+	Py_END_ALLOW_THREADS
+	if (jid == -1)
+		jailparam_error();
+
+	jailparam_release(jp, n);
+	return jid;
+}
+
+static char PyFB_jail_set__doc__[] =
+"jail_set(params[, flags]):\n"
+"creates or modifies a jail with the parameters in dict `params`.\n"
+"`flags` is a combination of const.JAIL_CREATE (the default),\n"
+"JAIL_UPDATE, JAIL_ATTACH and JAIL_DYING.  Values may be strings,\n"
+"integers, booleans or sequences of those.  returns the jid.";
+
+static PyObject *
+PyFB_jail_set(PyObject *self, PyObject *args)
+{
+	PyObject *params;
+	int flags = JAIL_CREATE, jid;
+
+	if (!PyArg_ParseTuple(args, "O!|i:jail_set", &PyDict_Type, &params,
+			      &flags))
+		return NULL;
+
+	jid = jail_setdict(params, flags);
+	if (jid == -1)
+		return NULL;
+	return PyInt_FromLong(jid);
+}
+
+static char PyFB_jail_create__doc__[] =
+"jail_create(params[, attach=False]):\n"
+"creates a new jail with the parameters in dict `params` and returns\n"
+"its jid.  ip4.addr and ip6.addr may be given as sequences to assign\n"
+"several addresses.  if `attach` is true, the current process is\n"
+"moved into the new jail as well.";
+
+static PyObject *
+PyFB_jail_create(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = {"params", "attach", NULL};
+	PyObject *params;
+	int attach = 0, jid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|i:jail_create",
+					 kwlist, &PyDict_Type, &params,
+					 &attach))
+		return NULL;
+
+	jid = jail_setdict(params, JAIL_CREATE | (attach ? JAIL_ATTACH : 0));
+	if (jid == -1)
+		return NULL;
+	return PyInt_FromLong(jid);
+}
+
+/* Internal helper function to resolve a jid or jail name to a jid */
+static int
+jail_fromobject(PyObject *jail)
+{
+	int jid;
+
+	if (PyString_Check(jail)) {
+		jid = jail_getid(PyString_AS_STRING(jail));
+		if (jid == -1)
+			jailparam_error();
+		return jid;
+	}
+
+	jid = PyInt_AsLong(jail);
+	if (jid == -1 && !PyErr_Occurred())
+		PyErr_SetString(PyExc_ValueError, "invalid jid");
+	return jid;
+}
+
+static char PyFB_jail_attach__doc__[] =
+"jail_attach(jail):\n"
+"attaches the current process to the jail given by jid or name.";
+
+static PyObject *
+PyFB_jail_attach(PyObject *self, PyObject *args)
+{
+	PyObject *jail;
+	int jid;
+
+	if (!PyArg_ParseTuple(args, "O:jail_attach", &jail))
+		return NULL;
+
+	jid = jail_fromobject(jail);
+	if (jid == -1)
+		return NULL;
+	if (jail_attach(jid) == -1)
+		return OSERROR();
+
+	Py_RETURN_NONE;
+}
+
+static char PyFB_jail_remove__doc__[] =
+"jail_remove(jail):\n"
+"removes the jail given by jid or name, killing all its processes.";
+
+static PyObject *
+PyFB_jail_remove(PyObject *self, PyObject *args)
+{
+	PyObject *jail;
+	int jid, r;
+
+	if (!PyArg_ParseTuple(args, "O:jail_remove", &jail))
+		return NULL;
+
+	jid = jail_fromobject(jail);
+	if (jid == -1)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	r = jail_remove(jid);
+	Py_END_ALLOW_THREADS
+	if (r == -1)
+		return OSERROR();
+
+	Py_RETURN_NONE;
+}
+
+/* Clears the persist flag of a jail jail_exec() created, so that it
+ * goes away with its last process. */
+static int
+jail_nopersist(int jid)
+{
+	struct jailparam jp[2];
+	char buf[16];
+	int r = -1;
+
+	snprintf(buf, sizeof(buf), "%d", jid);
+	if (jailparam_init(&jp[0], "jid") == -1)
+		return -1;
+	if (jailparam_init(&jp[1], "persist") == -1) {
+		jailparam_free(jp, 1);
+		return -1;
+	}
+	if (jailparam_import(&jp[0], buf) != -1 &&
+	    jailparam_import(&jp[1], "false") != -1)
+		r = jailparam_set(jp, 2, JAIL_UPDATE);
+	jailparam_free(jp, 2);
+	return r;
+}
+
+/* Builds a NULL-terminated char * vector borrowing from the strings in
+ * `seq', which must be kept alive by the caller. */
+static char **
+jail_strvec(PyObject *seq)
+{
+	Py_ssize_t i, n;
+	char **v;
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	v = PyMem_New(char *, n + 1);
+	if (v == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		v[i] = PyString_AsString(PySequence_Fast_GET_ITEM(seq, i));
+		if (v[i] == NULL) {
+			PyMem_Free(v);
+			return NULL;
+		}
+	}
+	v[n] = NULL;
+	return v;
+}
+
+extern char **environ;
+
+static char PyFB_jail_exec__doc__[] =
+"jail_exec(jail, argv[, env, cwd='/']):\n"
+"runs the program argv[0] with arguments `argv` inside a jail without\n"
+"an intermediate shell.  `jail` is the jid or name of an existing jail,\n"
+"or a dict of parameters to create a new one which goes away when its\n"
+"last process exits unless `persist` is given.  `env` is a dict that\n"
+"replaces the environment.  returns (jid, pid); the caller must reap\n"
+"the child with os.waitpid().";
+
+static PyObject *
+PyFB_jail_exec(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = {"jail", "argv", "env", "cwd", NULL};
+	PyObject *jail, *argvobj, *envobj = Py_None;
+	PyObject *argseq = NULL, *envlist = NULL;
+	char **argv = NULL, **envp = NULL, *cwd = "/";
+	struct jailparam *jp;
+	int jid = -1, n, created = 0, nopersist = 0;
+	int fds[2] = {-1, -1}, err = 0, status;
+	ssize_t r;
+	pid_t pid = -1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|Os:jail_exec",
+					 kwlist, &jail, &argvobj, &envobj,
+					 &cwd))
+		return NULL;
+
+	argseq = PySequence_Fast(argvobj, "argv must be a sequence");
+	if (argseq == NULL)
+		return NULL;
+	if (PySequence_Fast_GET_SIZE(argseq) == 0) {
+		PyErr_SetString(PyExc_ValueError, "argv must not be empty");
+		goto out;
+	}
+	if ((argv = jail_strvec(argseq)) == NULL)
+		goto out;
+
+	if (envobj != Py_None) {
+		PyObject *key, *value;
+		Py_ssize_t pos = 0;
+
+		if (!PyDict_Check(envobj)) {
+			PyErr_SetString(PyExc_TypeError,
+					"env must be a dict or None");
+			goto out;
+		}
+		envlist = PyList_New(0);
+		while (envlist != NULL &&
+		       PyDict_Next(envobj, &pos, &key, &value)) {
+			if (!PyString_Check(key) || !PyString_Check(value)) {
+				PyErr_SetString(PyExc_TypeError,
+					"env keys and values must be strings");
+				goto out;
+			}
+			if (PyList_Append_StealRef(envlist,
+				PyString_FromFormat("%s=%s",
+					PyString_AS_STRING(key),
+					PyString_AS_STRING(value))) == -1)
+				goto out;
+		}
+		if (envlist == NULL || (envp = jail_strvec(envlist)) == NULL)
+			goto out;
+	}
+
+	if (PyDict_Check(jail)) {
+		/* hold the new jail with persist until the child is in */
+		n = jailparam_fromdict(jail, 1, &jp);
+		if (n == -1)
+			goto out;
+		if (PyDict_GetItemString(jail, "persist") == NULL) {
+			if (jailparam_init(&jp[n], "persist") == -1) {
+				jailparam_error();
+				jailparam_release(jp, n);
+				goto out;
+			}
+			n++;
+			if (jailparam_import(&jp[n - 1], "true") == -1) {
+				jailparam_error();
+				jailparam_release(jp, n);
+				goto out;
+			}
+			nopersist = 1;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		jid = jailparam_set(jp, n, JAIL_CREATE);
+		Py_END_ALLOW_THREADS
+		if (jid == -1)
+			jailparam_error();
+		jailparam_release(jp, n);
+		if (jid == -1)
+			goto out;
+		created = 1;
+	}
+	else if ((jid = jail_fromobject(jail)) == -1)
+		goto out;
+
+	/* the child reports a failed attach or exec through a close-on-exec
+	 * pipe, so the parent sees EOF once the program is running. */
+	if (pipe(fds) == -1 || fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1) {
+		err = errno;
+		goto fail;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		if (jail_attach(jid) == 0 && chdir(cwd) == 0) {
+			if (envp != NULL)
+				environ = envp;
+			execvp(argv[0], argv);
+		}
+		err = errno;
+		(void)write(fds[1], &err, sizeof(err));
+		_exit(127);
+	}
+	if (pid == -1) {
+		err = errno;
+		goto fail;
+	}
+
+	close(fds[1]);
+	fds[1] = -1;
+	Py_BEGIN_ALLOW_THREADS
+	do
+		r = read(fds[0], &err, sizeof(err));
+	while (r == -1 && errno == EINTR);
+	if (r != sizeof(err))
+		err = 0;
+	else
+		while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+			;
+	Py_END_ALLOW_THREADS
+	if (err != 0)
+		goto fail;
+
+	/* the child is already running, so a jail that cannot drop its
+	 * persist flag is left behind rather than losing the pid. */
+	if (nopersist)
+		jail_nopersist(jid);
+	goto out;
+
+fail:
+	if (created)
+		jail_remove(jid);
+	errno = err;
+	OSERROR();
+
+out:
+	if (fds[0] != -1)
+		close(fds[0]);
+	if (fds[1] != -1)
+		close(fds[1]);
+	PyMem_Free(argv);
+	PyMem_Free(envp);
+	Py_DECREF(argseq);
+	Py_XDECREF(envlist);
+	if (PyErr_Occurred())
+		return NULL;
+	return Py_BuildValue("(ii)", jid, (int)pid);
+}
+
+static char PyFB_jail_params__doc__[] =
+"jail_params():\n"
+"returns the names of all jail parameters known to the kernel.";
+
+static PyObject *
+PyFB_jail_params(PyObject *self)
+{
+	struct jailparam *jp;
+	PyObject *r;
+	int n, i;
+
+	n = jailparam_all(&jp);
+	if (n == -1)
+		return jailparam_error();
+
+	r = PyList_New(0);
+	for (i = 0; r != NULL && i < n; i++)
+		if (PyList_Append_StealRef(r,
+			PyString_FromString(jp[i].jp_name)) == -1) {
+			Py_DECREF(r);
+			r = NULL;
+		}
+
+	jailparam_free(jp, n);
+	free(jp);
+	return r;
+}
+
+#endif
+
+#endif
@@ -27,6 +27,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <sys/event.h>
 
 #define MAX_KEVENTS 512
@@ -562,3 +564,5 @@ static PyTypeObject KQueueType = {
 	tp_new:		kqueue_new,
 	tp_doc:		kqueue_doc,
 };
+
+#endif
@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <sys/ktrace.h>
 
 EXPCONST(int KTROP_SET)
@@ -68,3 +70,5 @@ PyFB_ktrace(PyObject *self, PyObject *args)
 
 	Py_RETURN_NONE;
 }
+
+#endif
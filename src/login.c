@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 static char PyFB_getlogin__doc__[] =
 "getlogin():\n"
 "returns the login name of the user associated with the current\n"
@@ -68,3 +70,5 @@ PyFB_setlogin(PyObject *self, PyObject *args)
 		return OSERROR();
 	Py_RETURN_NONE;
 }
+
+#endif
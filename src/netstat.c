@@ -26,11 +26,16 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <sys/sysctl.h>
+#include <sys/socketvar.h>
 #include <net/if.h>
 #include <net/if_mib.h>
+#include <netinet/in_pcb.h>
 #include <netinet/ip_var.h>
 #include <netinet/tcp.h>
+#include <netinet/tcp_fsm.h>
 #include <netinet/tcp_var.h>
 #include <netinet/udp.h>
 #include <netinet/udp_var.h>
@@ -53,95 +58,283 @@ EXPCONST(int IFF_LINK2)
 EXPCONST(int IFF_ALTPHYS)
 EXPCONST(int IFF_MULTICAST)
 
-static char PyFB_ipstats__doc__[] =
-"ipstats():\n"
-"dumps IP statistics structure";
+EXPCONST(int TCPS_CLOSED)
+EXPCONST(int TCPS_LISTEN)
+EXPCONST(int TCPS_SYN_SENT)
+EXPCONST(int TCPS_SYN_RECEIVED)
+EXPCONST(int TCPS_ESTABLISHED)
+EXPCONST(int TCPS_CLOSE_WAIT)
+EXPCONST(int TCPS_FIN_WAIT_1)
+EXPCONST(int TCPS_CLOSING)
+EXPCONST(int TCPS_LAST_ACK)
+EXPCONST(int TCPS_FIN_WAIT_2)
+EXPCONST(int TCPS_TIME_WAIT)
+
+/*
+ * Protocol statistics are described by tables of (name, offset) pairs
+ * so that the same field list serves the plain sysctl dump, the per-CPU
+ * counter(9) dump and the metrics exposition writer.
+ */
+#if __FreeBSD_version >= 1000000
+typedef uint64_t statcounter_t;	/* counter(9) backed statistics */
+#else
+typedef u_long statcounter_t;
+#endif
+
+struct StatField {
+	const char *name;
+	size_t offset;
+};
+
+#define STATFIELD(proto, f)						\
+	{ #f, offsetof(struct proto##stat, proto##s_##f) },
+#define STATVALUE(st, field)						\
+	(*(const statcounter_t *)((const char *)(st) + (field)->offset))
+
+#define p(f) STATFIELD(ip, f)
+static const struct StatField ipstat_fields[] = {
+	p(total)           p(badsum)
+	p(toosmall)        p(tooshort)
+	p(toolong)         p(badhlen)
+	p(badlen)          p(badoptions)
+	p(badvers)         p(fragments)
+	p(fragdropped)     p(fragtimeout)
+	p(reassembled)     p(delivered)
+	p(noproto)         p(forward)
+	p(fastforward)     p(cantforward)
+	p(notmember)       p(redirectsent)
+	p(localout)        p(rawout)
+	p(odropped)        p(noroute)
+	p(fragmented)      p(ofragments)
+	p(cantfrag)        p(nogif)
+	p(badaddr)
+	{ NULL, 0 }
+};
+#undef p
+
+#define p(f) STATFIELD(tcp, f)
+static const struct StatField tcpstat_fields[] = {
+	p(sndtotal)        p(sndpack)         p(sndbyte)
+	p(sndrexmitpack)   p(sndrexmitbyte)   p(mturesent)
+	p(sndacks)         p(delack)          p(sndurg)
+	p(sndprobe)        p(sndwinup)        p(sndctrl)
+	p(rcvtotal)        p(rcvackpack)      p(rcvackbyte)
+	p(rcvdupack)       p(rcvacktoomuch)   p(rcvpack)
+	p(rcvbyte)         p(rcvduppack)      p(rcvdupbyte)
+	p(pawsdrop)        p(rcvpartduppack)  p(rcvpartdupbyte)
+	p(rcvoopack)       p(rcvoobyte)       p(rcvpackafterwin)
+	p(rcvbyteafterwin) p(rcvwinprobe)     p(rcvwinupd)
+	p(rcvafterclose)   p(rcvbadsum)       p(rcvbadoff)
+	p(rcvshort)        p(connattempt)     p(accepts)
+	p(badsyn)          p(listendrop)      p(connects)
+	p(closed)          p(drops)           p(cachedrtt)
+	p(cachedrttvar)    p(cachedssthresh)  p(conndrops)
+	p(rttupdated)      p(segstimed)       p(rexmttimeo)
+	p(timeoutdrop)     p(persisttimeo)    p(persistdrop)
+	p(keeptimeo)       p(keepprobe)       p(keepdrops)
+	p(predack)         p(preddat)         p(sc_added)
+	p(sc_retransmitted) p(sc_dupsyn)      p(sc_dropped)
+	p(sc_completed)    p(sc_bucketoverflow)
+	p(sc_cacheoverflow) p(sc_reset)       p(sc_stale)
+	p(sc_aborted)      p(sc_badack)       p(sc_unreach)
+	p(sc_zonefail)     p(sc_sendcookie)   p(sc_recvcookie)
+	{ NULL, 0 }
+};
+#undef p
 
+#define p(f) STATFIELD(udp, f)
+static const struct StatField udpstat_fields[] = {
+	p(ipackets)        p(hdrops)          p(badlen)
+	p(badsum)          p(nosum)           p(noport)
+	p(noportbcast)     p(fullsock)
+	{ "pcbhashmiss", offsetof(struct udpstat, udpps_pcbhashmiss) },
+	p(opackets)
+	{ NULL, 0 }
+};
+#undef p
+
+/* Internal helper function to convert a statistics structure to dict */
 static PyObject *
-PyFB_ipstats(PyObject *self)
+statfields_todict(const void *st, const struct StatField *fields)
 {
-	struct ipstat ipstat;
-	size_t len = sizeof ipstat; 
-	PyObject *r, *t;
-
-	if (sysctlbyname("net.inet.ip.stats", &ipstat, &len, NULL, 0) < 0)
-		return OSERROR();
+	PyObject *r;
 
 	r = PyDict_New();
+	if (r == NULL)
+		return NULL;
 
-#define p(f) \
-	t = PyLong_FromUnsignedLong((unsigned long)ipstat.ips_##f); \
-	PyDict_SetItemString(r, #f, t); \
-	Py_DECREF(t);
-	p(total);           p(badsum);
-	p(toosmall);        p(tooshort);
-	p(toolong);         p(badhlen);
-	p(badlen);          p(badoptions);
-	p(badvers);         p(fragments);
-	p(fragdropped);     p(fragtimeout);
-	p(reassembled);     p(delivered);
-	p(noproto);         p(forward);
-	p(forward);         p(fastforward);
-	p(cantforward);     p(notmember);
-	p(redirectsent);    p(localout);
-	p(rawout);          p(odropped);
-	p(noroute);         p(fragmented);
-	p(ofragments);      p(cantfrag);
-	p(nogif);           p(badaddr);
-#undef p
+	for (; fields->name != NULL; fields++)
+		PyDict_SetItemString_StealRef(r, (char *)fields->name,
+			PyLong_FromUnsignedLongLong(
+				(unsigned PY_LONG_LONG)STATVALUE(st, fields)));
 
+	if (PyErr_Occurred()) {
+		Py_DECREF(r);
+		return NULL;
+	}
 	return r;
 }
 
+#if __FreeBSD_version >= 1100000
+LIB_DEPENDS(kvm)
+#include <kvm.h>
+#include <limits.h>
+#include <nlist.h>
+
+/*
+ * Internal helper function to fetch the un-aggregated counter(9) values
+ * of a VNET_PCPUSTAT structure.  The kernel only exports the sums over
+ * sysctl, so the per-CPU slots are read from the running kernel through
+ * libkvm the same way as netstat(1) does for core files.  Returns a dict
+ * mapping each field name to a list of per-CPU values.
+ */
+static PyObject *
+pcpustats(const char *symbol, const struct StatField *fields)
+{
+	char errbuf[_POSIX2_LINE_MAX];
+	struct nlist nl[2];
+	const struct StatField *f;
+	u_long counter;
+	uint64_t value;
+	kvm_t *kd;
+	int ncpus, cpu;
+	PyObject *r, *l;
+
+	kd = kvm_openfiles(NULL, NULL, NULL, O_RDONLY, errbuf);
+	if (kd == NULL) {
+		PyErr_SetString(PyExc_OSError, errbuf);
+		return NULL;
+	}
 
-static char PyFB_tcpstats__doc__[] =
-"tcpstats():\n"
-"dumps TCP statistics structure";
+	memset(nl, 0, sizeof nl);
+	nl[0].n_name = (char *)symbol;
+	if (kvm_nlist(kd, nl) != 0 || nl[0].n_value == 0) {
+		PyErr_Format(PyExc_OSError, "%s: symbol not found", symbol);
+		kvm_close(kd);
+		return NULL;
+	}
+
+	ncpus = kvm_getncpus(kd);
+	if (ncpus <= 0) {
+		PyErr_SetString(PyExc_OSError, kvm_geterr(kd));
+		kvm_close(kd);
+		return NULL;
+	}
 
+	r = PyDict_New();
+	if (r == NULL) {
+		kvm_close(kd);
+		return NULL;
+	}
+
+	for (f = fields; f->name != NULL; f++) {
+		/* the structure is an array of counter_u64_t pointers with
+		 * one slot for every uint64_t field. */
+		if (kvm_read(kd, nl[0].n_value + (f->offset /
+		    sizeof(uint64_t)) * sizeof(counter), &counter,
+		    sizeof counter) != sizeof counter)
+			goto kvmerror;
+
+		l = PyList_New(ncpus);
+		if (l == NULL)
+			goto error;
+		PyDict_SetItemString_StealRef(r, (char *)f->name, l);
+
+		for (cpu = 0; cpu < ncpus; cpu++) {
+			if (kvm_read_zpcpu(kd, counter, &value, sizeof value,
+			    cpu) != sizeof value)
+				goto kvmerror;
+			PyList_SET_ITEM(l, cpu, PyLong_FromUnsignedLongLong(
+				(unsigned PY_LONG_LONG)value));
+		}
+	}
+
+	kvm_close(kd);
+	if (PyErr_Occurred()) {
+		Py_DECREF(r);
+		return NULL;
+	}
+	return r;
+
+kvmerror:
+	PyErr_SetString(PyExc_OSError, kvm_geterr(kd));
+error:
+	kvm_close(kd);
+	Py_DECREF(r);
+	return NULL;
+}
+#endif
+
+/* Internal helper function shared by ipstats() and tcpstats() */
 static PyObject *
-PyFB_tcpstats(PyObject *self)
+protostats(const char *mibname, const char *symbol, void *st, size_t size,
+	   const struct StatField *fields, int percpu)
 {
-	struct tcpstat tcpstat;
-	size_t len = sizeof tcpstat; 
-	PyObject *r, *t;
+	PyObject *totals, *r;
+	size_t len = size;
 
-	if (sysctlbyname("net.inet.tcp.stats", &tcpstat, &len, NULL, 0) < 0)
+	if (sysctlbyname(mibname, st, &len, NULL, 0) < 0)
 		return OSERROR();
 
-	r = PyDict_New();
+	totals = statfields_todict(st, fields);
+	if (totals == NULL || !percpu)
+		return totals;
 
-#define p(f) \
-	t = PyLong_FromUnsignedLong((unsigned long)tcpstat.tcps_##f); \
-	PyDict_SetItemString(r, #f, t); \
-	Py_DECREF(t);
+#if __FreeBSD_version >= 1100000
+	r = pcpustats(symbol, fields);
+	if (r == NULL) {
+		Py_DECREF(totals);
+		return NULL;
+	}
+	return Py_BuildValue("(NN)", totals, r);
+#else
+	Py_DECREF(totals);
+	PyErr_SetString(PyExc_NotImplementedError,
+		"per-CPU statistics require FreeBSD 11.0 or later");
+	return NULL;
+#endif
+}
 
-	p(sndtotal);        p(sndpack);         p(sndbyte);
-	p(sndrexmitpack);   p(sndrexmitbyte);   p(mturesent);
-	p(sndacks);         p(delack);          p(sndurg);
-	p(sndprobe);        p(sndwinup);        p(sndctrl);
-	p(rcvtotal);        p(rcvackpack);      p(rcvackbyte);
-	p(rcvdupack);       p(rcvacktoomuch);   p(rcvpack);
-	p(rcvbyte);         p(rcvduppack);      p(rcvdupbyte);
-	p(pawsdrop);        p(rcvpartduppack);  p(rcvpartdupbyte);
-	p(rcvoopack);       p(rcvoobyte);       p(rcvpackafterwin);
-	p(rcvbyteafterwin); p(rcvwinprobe);     p(rcvwinupd);
-	p(rcvafterclose);   p(rcvbadsum);       p(rcvbadoff);
-	p(rcvshort);        p(connattempt);     p(accepts);
-	p(badsyn);          p(listendrop);      p(connects);
-	p(closed);          p(drops);           p(cachedrtt);
-	p(cachedrttvar);    p(cachedssthresh);  p(conndrops);
-	p(rttupdated);      p(segstimed);       p(rexmttimeo);
-	p(timeoutdrop);     p(persisttimeo);    p(persistdrop);
-	p(keeptimeo);       p(keepprobe);       p(keepdrops);
-	p(predack);         p(preddat);         p(sc_added);
-	p(sc_retransmitted); p(sc_dupsyn);      p(sc_dropped);
-	p(sc_completed);    p(sc_bucketoverflow);
-	p(sc_cacheoverflow); p(sc_reset);       p(sc_stale);
-	p(sc_aborted);      p(sc_badack);       p(sc_unreach);
-	p(sc_zonefail);     p(sc_sendcookie);   p(sc_recvcookie);
-#undef p
 
-	return r;
+static char PyFB_ipstats__doc__[] =
+"ipstats([percpu]):\n"
+"dumps IP statistics structure.  If `percpu` is true, returns a tuple\n"
+"of the totals and a dict mapping each counter to a list of its\n"
+"per-CPU values, which are read through kvm(3) and need access to\n"
+"/dev/mem.";
+
+static PyObject *
+PyFB_ipstats(PyObject *self, PyObject *args)
+{
+	struct ipstat ipstat;
+	int percpu = 0;
+
+	if (!PyArg_ParseTuple(args, "|i:ipstats", &percpu))
+		return NULL;
+
+	return protostats("net.inet.ip.stats", "_ipstat", &ipstat,
+			  sizeof ipstat, ipstat_fields, percpu);
+}
+
+
+static char PyFB_tcpstats__doc__[] =
+"tcpstats([percpu]):\n"
+"dumps TCP statistics structure.  If `percpu` is true, returns a tuple\n"
+"of the totals and a dict mapping each counter to a list of its\n"
+"per-CPU values, which are read through kvm(3) and need access to\n"
+"/dev/mem.";
+
+static PyObject *
+PyFB_tcpstats(PyObject *self, PyObject *args)
+{
+	struct tcpstat tcpstat;
+	int percpu = 0;
+
+	if (!PyArg_ParseTuple(args, "|i:tcpstats", &percpu))
+		return NULL;
+
+	return protostats("net.inet.tcp.stats", "_tcpstat", &tcpstat,
+			  sizeof tcpstat, tcpstat_fields, percpu);
 }
 
 
@@ -159,22 +352,11 @@ PyFB_udpstats(PyObject *self)
 	if (sysctlbyname("net.inet.udp.stats", &udpstat, &len, NULL, 0) < 0)
 		return OSERROR();
 
-	r = PyDict_New();
-
-#define p(f) \
-	t = PyLong_FromUnsignedLong((unsigned long)udpstat.udps_##f); \
-	PyDict_SetItemString(r, #f, t); \
-	Py_DECREF(t);
+	r = statfields_todict(&udpstat, udpstat_fields);
+	if (r == NULL)
+		return NULL;
 
-	p(ipackets);       p(hdrops);         p(badlen);
-	p(badsum);         p(nosum);          p(noport);
-	p(noportbcast);    p(fullsock);       
-
-	t = PyLong_FromUnsignedLong((unsigned long)udpstat.udpps_pcbhashmiss);
-	PyDict_SetItemString(r, "pcbhashmiss", t);
-	Py_DECREF(t);
-
-	t = PyLong_FromUnsignedLong((unsigned long)(
+	t = PyLong_FromUnsignedLongLong((unsigned PY_LONG_LONG)(
 				udpstat.udps_ipackets -
 				udpstat.udps_hdrops -
 				udpstat.udps_badlen -
@@ -185,8 +367,6 @@ PyFB_udpstats(PyObject *self)
 				));
 	PyDict_SetItemString(r, "delivered", t);
 	Py_DECREF(t);
-	p(opackets);
-#undef p
 
 	return r;
 }
@@ -260,3 +440,147 @@ PyFB_ifstats(PyObject *self)
 
 	return r;
 }
+
+
+#if __FreeBSD_version >= 1200000
+static char *tcpconnkwlist[] = { "state", "port", NULL };
+
+static char PyFB_tcp_connections__doc__[] =
+"tcp_connections([state, port]):\n"
+"returns the TCP connection table read from net.inet.tcp.pcblist as a\n"
+"dict of parallel lists: laddr, lport, faddr, fport, state, sendq and\n"
+"recvq.  If `state` (one of const.TCPS_*) or `port` is given, only\n"
+"connections in that state or with that local or foreign port are\n"
+"returned.";
+
+static PyObject *
+PyFB_tcp_connections(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static const char *columns[] = {
+		"laddr", "lport", "faddr", "fport", "state", "sendq", "recvq",
+	};
+#define NCOLUMNS (sizeof(columns) / sizeof(columns[0]))
+	PyObject *r, *cols[NCOLUMNS];
+	struct xinpgen *xig, *oxig;
+	struct xtcpcb *xtp;
+	struct xinpcb *xip;
+	char laddr[INET6_ADDRSTRLEN], faddr[INET6_ADDRSTRLEN];
+	char *buf;
+	size_t len;
+	int state = -1, port = 0, res, i;
+	u_short lport, fport;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|ii:tcp_connections",
+			tcpconnkwlist, &state, &port))
+		return NULL;
+
+	/* The table may grow between the size probe and the actual read,
+	 * so leave some room and retry on ENOMEM. */
+	buf = NULL;
+	len = 0;
+	for (;;) {
+		Py_BEGIN_ALLOW_THREADS
+		res = sysctlbyname("net.inet.tcp.pcblist", NULL, &len,
+				   NULL, 0);
+		if (res == 0) {
+			len += len / 8;
+			buf = malloc(len);
+			if (buf != NULL)
+				res = sysctlbyname("net.inet.tcp.pcblist",
+						   buf, &len, NULL, 0);
+		}
+		Py_END_ALLOW_THREADS
+
+		if (res == 0 && buf == NULL)
+			return PyErr_NoMemory();
+		else if (res == 0)
+			break;
+
+		res = errno;
+		free(buf);
+		buf = NULL;
+		if (res != ENOMEM) {
+			errno = res;
+			return OSERROR();
+		}
+	}
+
+	r = PyDict_New();
+	if (r == NULL) {
+		free(buf);
+		return NULL;
+	}
+	for (i = 0; i < NCOLUMNS; i++) {
+		cols[i] = PyList_New(0);
+		if (cols[i] == NULL)
+			goto error;
+		PyDict_SetItemString_StealRef(r, (char *)columns[i], cols[i]);
+	}
+
+	/* Walk the records within the bytes the kernel returned: stop at
+	 * the trailing xinpgen, or at a record whose length is zero, too
+	 * short for an xtcpcb or runs past the end of the buffer. */
+	oxig = (struct xinpgen *)buf;
+	if (len < sizeof(struct xinpgen) ||
+	    oxig->xig_len < sizeof(struct xinpgen) || oxig->xig_len > len)
+		goto out;
+
+	for (xig = (struct xinpgen *)((char *)oxig + oxig->xig_len);
+	     (char *)xig + sizeof(struct xinpgen) <= buf + len &&
+	     xig->xig_len >= sizeof(struct xtcpcb) &&
+	     xig->xig_len <= (size_t)(buf + len - (char *)xig);
+	     xig = (struct xinpgen *)((char *)xig + xig->xig_len)) {
+		xtp = (struct xtcpcb *)xig;
+		xip = &xtp->xt_inp;
+
+		if (state != -1 && xtp->t_state != state)
+			continue;
+
+		lport = ntohs(xip->inp_inc.inc_lport);
+		fport = ntohs(xip->inp_inc.inc_fport);
+		if (port != 0 && lport != port && fport != port)
+			continue;
+
+		if (xip->inp_vflag & INP_IPV6) {
+			inet_ntop(AF_INET6, &xip->inp_inc.inc6_laddr,
+				  laddr, sizeof laddr);
+			inet_ntop(AF_INET6, &xip->inp_inc.inc6_faddr,
+				  faddr, sizeof faddr);
+		}
+		else {
+			inet_ntop(AF_INET, &xip->inp_inc.inc_laddr,
+				  laddr, sizeof laddr);
+			inet_ntop(AF_INET, &xip->inp_inc.inc_faddr,
+				  faddr, sizeof faddr);
+		}
+
+		if (PyList_Append_StealRef(cols[0],
+				PyString_FromString(laddr)) == -1 ||
+		    PyList_Append_StealRef(cols[1],
+				PyInt_FromLong(lport)) == -1 ||
+		    PyList_Append_StealRef(cols[2],
+				PyString_FromString(faddr)) == -1 ||
+		    PyList_Append_StealRef(cols[3],
+				PyInt_FromLong(fport)) == -1 ||
+		    PyList_Append_StealRef(cols[4],
+				PyInt_FromLong(xtp->t_state)) == -1 ||
+		    PyList_Append_StealRef(cols[5], PyInt_FromLong(
+				xip->xi_socket.so_snd.sb_cc)) == -1 ||
+		    PyList_Append_StealRef(cols[6], PyInt_FromLong(
+				xip->xi_socket.so_rcv.sb_cc)) == -1)
+			goto error;
+	}
+
+out:
+	free(buf);
+	return r;
+
+error:
+	free(buf);
+	Py_DECREF(r);
+	return NULL;
+#undef NCOLUMNS
+}
+#endif
+
+#endif
@@ -0,0 +1,337 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifdef __FreeBSD__
+
+/*
+ * OpenMetrics text exposition of the netstat counters.  The output is
+ * composed into a buffer of each call, sized after the previous output,
+ * and the "# TYPE" line and sample name of each statistics field are
+ * formatted only once.
+ */
+
+#if __FreeBSD_version >= 1100000
+typedef uint64_t ifcounter_t;
+#else
+typedef u_long ifcounter_t;
+#endif
+
+#define OM_PREFIX "freebsd_"
+
+struct om_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static size_t om_lastsize;	/* initial size for the next call */
+
+struct OMFamily {
+	const char *proto;
+	const struct StatField *fields;
+	char **heads;		/* "# TYPE ...\nname_total" for each field */
+};
+
+static struct OMFamily om_families[] = {
+	{ "ip", ipstat_fields, NULL },
+	{ "tcp", tcpstat_fields, NULL },
+	{ "udp", udpstat_fields, NULL },
+};
+#define OM_IP	0
+#define OM_TCP	1
+#define OM_UDP	2
+
+#define IFFIELD(f)	{ #f, offsetof(struct if_data, ifi_##f) },
+static const struct StatField om_if_fields[] = {
+	IFFIELD(ipackets)	IFFIELD(ierrors)
+	IFFIELD(opackets)	IFFIELD(oerrors)
+	IFFIELD(collisions)	IFFIELD(ibytes)
+	IFFIELD(obytes)		IFFIELD(imcasts)
+	IFFIELD(omcasts)	IFFIELD(iqdrops)
+	IFFIELD(noproto)
+	{ NULL, 0 }
+};
+#undef IFFIELD
+
+static int
+om_reserve(struct om_buf *out, size_t n)
+{
+	char *nbuf;
+	size_t nsize;
+
+	if (out->len + n <= out->size)
+		return 0;
+
+	nsize = out->size ? out->size :
+		(om_lastsize > 16384 ? om_lastsize : 16384);
+	while (nsize < out->len + n)
+		nsize *= 2;
+
+	nbuf = PyMem_Realloc(out->buf, nsize);
+	if (nbuf == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	out->buf = nbuf;
+	out->size = nsize;
+	return 0;
+}
+
+static int
+om_write(struct om_buf *out, const char *s, size_t n)
+{
+	if (om_reserve(out, n) == -1)
+		return -1;
+	memcpy(out->buf + out->len, s, n);
+	out->len += n;
+	return 0;
+}
+
+#define om_puts(out, s)	om_write((out), (s), strlen(s))
+
+static int
+om_putu64(struct om_buf *out, uint64_t v)
+{
+	char digits[24], *p;
+
+	p = digits + sizeof digits;
+	do {
+		*--p = '0' + (v % 10);
+		v /= 10;
+	} while (v != 0);
+
+	return om_write(out, p, digits + sizeof digits - p);
+}
+
+/* Internal helper function to format the per-field heads of a family */
+static int
+om_init_family(struct OMFamily *fam)
+{
+	const struct StatField *f;
+	char **heads;
+	int nfields, i;
+
+	for (nfields = 0; fam->fields[nfields].name != NULL; nfields++)
+		;
+
+	heads = PyMem_New(char *, nfields);
+	if (heads == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	for (i = 0, f = fam->fields; i < nfields; i++, f++) {
+		if (asprintf(&heads[i], "# TYPE " OM_PREFIX "%s_%s counter\n"
+			     OM_PREFIX "%s_%s_total", fam->proto, f->name,
+			     fam->proto, f->name) == -1) {
+			while (--i >= 0)
+				free(heads[i]);
+			PyMem_Del(heads);
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+
+	fam->heads = heads;
+	return 0;
+}
+
+static int
+om_put_family(struct om_buf *out, struct OMFamily *fam, const void *st)
+{
+	const struct StatField *f;
+	int i;
+
+	if (fam->heads == NULL && om_init_family(fam) == -1)
+		return -1;
+
+	for (i = 0, f = fam->fields; f->name != NULL; i++, f++)
+		if (om_puts(out, fam->heads[i]) == -1 ||
+		    om_write(out, " ", 1) == -1 ||
+		    om_putu64(out, (uint64_t)STATVALUE(st, f)) == -1 ||
+		    om_write(out, "\n", 1) == -1)
+			return -1;
+	return 0;
+}
+
+static int
+om_put_ifstats(struct om_buf *out)
+{
+	int mib_ifdata[6] = { CTL_NET, PF_LINK, NETLINK_GENERIC,
+			      IFMIB_IFDATA, 0, IFDATA_GENERAL};
+	struct ifmibdata *ifmd;
+	const struct StatField *f;
+	size_t len;
+	int count, nifs, i, r = -1;
+
+	len = sizeof count;
+	if (sysctlbyname("net.link.generic.system.ifcount", &count,
+			 &len, NULL, 0) < 0) {
+		OSERROR();
+		return -1;
+	}
+
+	ifmd = PyMem_New(struct ifmibdata, count);
+	if (ifmd == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	/* Interface indexes may have holes; skip the vanished ones. */
+	for (i = 1, nifs = 0; i <= count; i++) {
+		len = sizeof(struct ifmibdata);
+		mib_ifdata[4] = i;
+		if (sysctl(mib_ifdata, 6, &ifmd[nifs], &len, NULL, 0) < 0) {
+			if (errno == ENOENT)
+				continue;
+			OSERROR();
+			goto out;
+		}
+		nifs++;
+	}
+
+	/* Samples of a family must be contiguous, so go field by field. */
+	for (f = om_if_fields; f->name != NULL; f++) {
+		if (om_puts(out, "# TYPE " OM_PREFIX "if_") == -1 ||
+		    om_puts(out, f->name) == -1 ||
+		    om_puts(out, " counter\n") == -1)
+			goto out;
+		for (i = 0; i < nifs; i++)
+			if (om_puts(out, OM_PREFIX "if_") == -1 ||
+			    om_puts(out, f->name) == -1 ||
+			    om_puts(out, "_total{interface=\"") == -1 ||
+			    om_puts(out, ifmd[i].ifmd_name) == -1 ||
+			    om_puts(out, "\"} ") == -1 ||
+			    om_putu64(out, (uint64_t)*(const ifcounter_t *)(
+				(const char *)&ifmd[i].ifmd_data +
+				f->offset)) == -1 ||
+			    om_write(out, "\n", 1) == -1)
+				goto out;
+	}
+	r = 0;
+
+out:
+	PyMem_Del(ifmd);
+	return r;
+}
+
+static int
+om_put_loadavg(struct om_buf *out)
+{
+	static const char *names[3] = {
+		OM_PREFIX "load1", OM_PREFIX "load5", OM_PREFIX "load15",
+	};
+	double loadavg[3];
+	char num[32];
+	int i;
+
+	if (getloadavg(loadavg, 3) != 3) {
+		PyErr_SetString(PyExc_OSError, "getloadavg failed");
+		return -1;
+	}
+
+	for (i = 0; i < 3; i++) {
+		snprintf(num, sizeof num, " %.2f\n", loadavg[i]);
+		if (om_puts(out, "# TYPE ") == -1 ||
+		    om_puts(out, names[i]) == -1 ||
+		    om_puts(out, " gauge\n") == -1 ||
+		    om_puts(out, names[i]) == -1 || om_puts(out, num) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+
+static char PyFB_openmetrics__doc__[] =
+"openmetrics([fd]):\n"
+"formats the values of ipstats(), tcpstats(), udpstats(), ifstats()\n"
+"and getloadavg() in the OpenMetrics text exposition format.  Returns\n"
+"the text as a string, or writes it out to file descriptor `fd` and\n"
+"returns the number of bytes written.";
+
+static PyObject *
+PyFB_openmetrics(PyObject *self, PyObject *args)
+{
+	struct ipstat ipstat;
+	struct tcpstat tcpstat;
+	struct udpstat udpstat;
+	struct om_buf out = { NULL, 0, 0 };
+	PyObject *r;
+	size_t len, off;
+	ssize_t n;
+	int fd = -1;
+
+	if (!PyArg_ParseTuple(args, "|i:openmetrics", &fd))
+		return NULL;
+
+	len = sizeof ipstat;
+	if (sysctlbyname("net.inet.ip.stats", &ipstat, &len, NULL, 0) < 0)
+		return OSERROR();
+	len = sizeof tcpstat;
+	if (sysctlbyname("net.inet.tcp.stats", &tcpstat, &len, NULL, 0) < 0)
+		return OSERROR();
+	len = sizeof udpstat;
+	if (sysctlbyname("net.inet.udp.stats", &udpstat, &len, NULL, 0) < 0)
+		return OSERROR();
+
+	if (om_put_family(&out, &om_families[OM_IP], &ipstat) == -1 ||
+	    om_put_family(&out, &om_families[OM_TCP], &tcpstat) == -1 ||
+	    om_put_family(&out, &om_families[OM_UDP], &udpstat) == -1 ||
+	    om_put_ifstats(&out) == -1 || om_put_loadavg(&out) == -1 ||
+	    om_puts(&out, "# EOF\n") == -1) {
+		PyMem_Free(out.buf);
+		return NULL;
+	}
+	om_lastsize = out.size;
+
+	if (fd == -1) {
+		r = PyString_FromStringAndSize(out.buf, out.len);
+		PyMem_Free(out.buf);
+		return r;
+	}
+
+	/* the buffer belongs to this call, so it stays valid while other
+	 * threads run */
+	n = 0;
+	Py_BEGIN_ALLOW_THREADS
+	for (off = 0; off < out.len; off += n) {
+		n = write(fd, out.buf + off, out.len - off);
+		if (n == -1 && errno != EINTR)
+			break;
+		else if (n == -1)
+			n = 0;
+	}
+	Py_END_ALLOW_THREADS
+
+	PyMem_Free(out.buf);
+	if (n == -1)
+		return OSERROR();
+	return PyInt_FromSize_t(out.len);
+}
+
+#endif
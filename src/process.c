@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 static char PyFB_getprogname__doc__[] =
 "getprogname():\n"
 "The getprogname() function returns the name of the program.  If the\n"
@@ -77,3 +79,5 @@ PyFB_setproctitle(PyObject *self, PyObject *args)
 	setproctitle(newtitle);
 	Py_RETURN_NONE;
 }
+
+#endif
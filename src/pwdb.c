@@ -26,7 +26,41 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
+#include <sys/stat.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Types */
+DECLSTRUCTSEQ(PasswdType, passwd_desc)
+DECLTYPE(PasswdCacheType, passwdcacheobject)
+
+static PyStructSequence_Field passwd_fields[] = {
+	{"name",	"user name"},
+	{"passwd",	"encrypted password"},
+	{"uid",		"user id"},
+	{"gid",		"group id"},
+	{"change",	"password change time"},
+	{"class",	"user access class"},
+	{"gecos",	"honorable name"},
+	{"dir",		"home directory"},
+	{"shell",	"default shell"},
+	{"expire",	"account expiration"},
+	{"fields",	"internal: fields filled in"},
+	{0}
+};
+
+static PyStructSequence_Desc passwd_desc = {
+	"freebsd.passwd",
+	"passwd: An entry of the password database.",
+	passwd_fields,
+	11,
+};
+
+static PyTypeObject PasswdType;
 
 static PyObject *
 PyObject_FromPasswd(struct passwd *pwd)
@@ -50,31 +84,124 @@ PyObject_FromPasswd(struct passwd *pwd)
 }
 
 
+/*
+ * getpwuid() and getpwnam() use the reentrant functions with a buffer
+ * kept per thread, so that slow nsswitch sources (LDAP and the like)
+ * are queried without holding the GIL.
+ */
+struct pwdb_buf {
+	char	*buf;
+	size_t	size;
+};
+
+static pthread_key_t pwdb_buf_key;
+static pthread_once_t pwdb_buf_once = PTHREAD_ONCE_INIT;
+
+static void
+pwdb_buf_destroy(void *p)
+{
+	struct pwdb_buf *b = p;
+
+	free(b->buf);
+	free(b);
+}
+
+static void
+pwdb_buf_init(void)
+{
+	pthread_key_create(&pwdb_buf_key, pwdb_buf_destroy);
+}
+
+static struct pwdb_buf *
+pwdb_buf_get(void)
+{
+	struct pwdb_buf *b;
+	long size;
+
+	pthread_once(&pwdb_buf_once, pwdb_buf_init);
+	b = pthread_getspecific(pwdb_buf_key);
+	if (b != NULL)
+		return b;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		return NULL;
+	size = sysconf(_SC_GETPW_R_SIZE_MAX);
+	b->size = (size > 0) ? (size_t)size : 1024;
+	b->buf = malloc(b->size);
+	if (b->buf == NULL || pthread_setspecific(pwdb_buf_key, b) != 0) {
+		free(b->buf);
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+/*
+ * Looks up login `name', or `uid' if name is NULL, growing the thread's
+ * buffer on ERANGE.  Called without the GIL.  returns an errno value;
+ * *result is NULL if there is no such user.
+ */
+static int
+pwdb_lookup(const char *name, uid_t uid, struct passwd *pwd,
+	    struct passwd **result)
+{
+	struct pwdb_buf *b;
+	char *buf;
+	int err;
+
+	if ((b = pwdb_buf_get()) == NULL)
+		return ENOMEM;
+
+	for (;;) {
+		if (name != NULL)
+			err = getpwnam_r(name, pwd, b->buf, b->size, result);
+		else
+			err = getpwuid_r(uid, pwd, b->buf, b->size, result);
+		if (err != ERANGE)
+			break;
+		buf = realloc(b->buf, b->size * 2);
+		if (buf == NULL)
+			return ENOMEM;
+		b->buf = buf;
+		b->size *= 2;
+	}
+
+	if (err == ENOENT) {
+		*result = NULL;
+		err = 0;
+	}
+	return err;
+}
+
 static char PyFB_getpwuid__doc__[] =
 "getpwuid(uid):\n"
 "search the password database for the given user `uid`, respectively,\n"
-"always returning the first one encountered.";
+"always returning the first one encountered.  other threads keep\n"
+"running during the lookup.";
 
 static PyObject *
 PyFB_getpwuid(PyObject *self, PyObject *args)
 {
-	struct passwd *pwd;
-	int uid;
+	struct passwd pw, *pwd;
+	int uid, err;
 
 	if (!PyArg_ParseTuple(args, "i:getpwuid", &uid))
 		return NULL;
 
-	errno = 0;
-	pwd = getpwuid((uid_t)uid);
+	Py_BEGIN_ALLOW_THREADS
+	err = pwdb_lookup(NULL, (uid_t)uid, &pw, &pwd);
+	Py_END_ALLOW_THREADS
+
+	if (err != 0) {
+		errno = err;
+		return OSERROR();
+	}
 	if (pwd == NULL) {
-		if (errno == 0) {
-			PyObject *uidn = PyInt_FromLong(uid);
-			PyErr_SetObject(PyExc_KeyError, uidn);
-			Py_DECREF(uidn);
-			return NULL;
-		}
-		else
-			return OSERROR();
+		PyObject *uidn = PyInt_FromLong(uid);
+		PyErr_SetObject(PyExc_KeyError, uidn);
+		Py_DECREF(uidn);
+		return NULL;
 	}
 	return PyObject_FromPasswd(pwd);
 }
@@ -82,28 +209,31 @@ PyFB_getpwuid(PyObject *self, PyObject *args)
 static char PyFB_getpwnam__doc__[] =
 "getpwnam(name):\n"
 "search the password database for the given login name, always\n"
-"returning the first one encountered.";
+"returning the first one encountered.  other threads keep running\n"
+"during the lookup.";
 
 static PyObject *
 PyFB_getpwnam(PyObject *self, PyObject *args)
 {
-	struct passwd *pwd;
+	struct passwd pw, *pwd;
 	char *name;
+	int err;
 
 	if (!PyArg_ParseTuple(args, "s:getpwnam", &name))
 		return NULL;
 
-	errno = 0;
-	pwd = getpwnam(name);
+	Py_BEGIN_ALLOW_THREADS
+	err = pwdb_lookup(name, 0, &pw, &pwd);
+	Py_END_ALLOW_THREADS
+
+	if (err != 0) {
+		errno = err;
+		return OSERROR();
+	}
 	if (pwd == NULL) {
-		if (errno == 0) {
-			PyErr_SetString(PyExc_KeyError, name);
-			return NULL;
-		}
-		else
-			return OSERROR();
+		PyErr_SetString(PyExc_KeyError, name);
+		return NULL;
 	}
-
 	return PyObject_FromPasswd(pwd);
 }
 
@@ -130,3 +260,481 @@ PyFB_getpwent(PyObject *self)
 
 	return r;
 }
+
+/* ---------------------------------------------------------------------- */
+/*			      passwdcacheobject				  */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * passwdcache keeps a copy of the whole password database: the fixed
+ * fields in an entry array, all strings in one arena and two open
+ * addressing hash tables (uid and name) of entry indexes.  The copy is
+ * reloaded when the modification time of pwd.db changes, checked at
+ * most once per `interval' seconds.
+ */
+
+enum {
+	PWC_NAME, PWC_PASSWD, PWC_CLASS, PWC_GECOS, PWC_DIR, PWC_SHELL,
+	PWC_NSTR
+};
+
+struct pwcache_entry {
+	uid_t	uid;
+	gid_t	gid;
+	time_t	change;
+	time_t	expire;
+	int	fields;
+	size_t	str[PWC_NSTR];	/* offsets into the arena */
+};
+
+struct pwcache {
+	struct pwcache_entry *ents;
+	int	nents, entsize;
+	char	*arena;
+	size_t	arenalen, arenasize;
+	int	*byuid, *byname;
+	unsigned int mask;
+};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *path;
+	double interval;
+	struct timespec checked;	/* monotonic time of the last stat */
+	struct timespec mtime;		/* pwd.db mtime of the loaded copy */
+	struct pwcache c;
+} passwdcacheobject;
+
+static PyTypeObject PasswdCacheType;
+
+#define PWC_EMPTY	(-1)
+
+__inline__ unsigned int
+pwcache_hashuid(uid_t uid)
+{
+	return (unsigned int)uid * 2654435761U;
+}
+
+__inline__ unsigned int
+pwcache_hashname(const char *s)
+{
+	unsigned int h = 2166136261U;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return h;
+}
+
+#define PWC_STR(c, e, k)	((c)->arena + (e)->str[k])
+
+static void
+pwcache_free(struct pwcache *c)
+{
+	free(c->ents);
+	free(c->arena);
+	free(c->byuid);
+	free(c->byname);
+	memset(c, 0, sizeof(*c));
+}
+
+static int
+pwcache_addstr(struct pwcache *c, const char *s, size_t *off)
+{
+	size_t len;
+	char *arena;
+
+	if (s == NULL)
+		s = "";
+	len = strlen(s) + 1;
+	if (c->arenalen + len > c->arenasize) {
+		size_t size = c->arenasize ? c->arenasize : 16384;
+
+		while (c->arenalen + len > size)
+			size *= 2;
+		arena = realloc(c->arena, size);
+		if (arena == NULL)
+			return -1;
+		c->arena = arena;
+		c->arenasize = size;
+	}
+	memcpy(c->arena + c->arenalen, s, len);
+	*off = c->arenalen;
+	c->arenalen += len;
+	return 0;
+}
+
+static int
+pwcache_finduid(struct pwcache *c, uid_t uid)
+{
+	unsigned int h;
+	int i;
+
+	if (c->byuid == NULL)
+		return PWC_EMPTY;
+	for (h = pwcache_hashuid(uid) & c->mask;
+	     (i = c->byuid[h]) != PWC_EMPTY; h = (h + 1) & c->mask)
+		if (c->ents[i].uid == uid)
+			return i;
+	return PWC_EMPTY;
+}
+
+static int
+pwcache_findname(struct pwcache *c, const char *name)
+{
+	unsigned int h;
+	int i;
+
+	if (c->byname == NULL)
+		return PWC_EMPTY;
+	for (h = pwcache_hashname(name) & c->mask;
+	     (i = c->byname[h]) != PWC_EMPTY; h = (h + 1) & c->mask)
+		if (strcmp(PWC_STR(c, &c->ents[i], PWC_NAME), name) == 0)
+			return i;
+	return PWC_EMPTY;
+}
+
+/* Builds both indexes; the first entry of a duplicated uid or name wins
+ * as with getpwuid(3) and getpwnam(3). */
+static int
+pwcache_index(struct pwcache *c)
+{
+	unsigned int size, h;
+	int i;
+
+	for (size = 16; size < (unsigned int)c->nents * 2; size *= 2)
+		;
+	c->byuid = malloc(sizeof(int) * size);
+	c->byname = malloc(sizeof(int) * size);
+	if (c->byuid == NULL || c->byname == NULL)
+		return -1;
+	memset(c->byuid, 0xff, sizeof(int) * size);
+	memset(c->byname, 0xff, sizeof(int) * size);
+	c->mask = size - 1;
+
+	for (i = 0; i < c->nents; i++) {
+		struct pwcache_entry *e = &c->ents[i];
+
+		if (pwcache_finduid(c, e->uid) == PWC_EMPTY) {
+			for (h = pwcache_hashuid(e->uid) & c->mask;
+			     c->byuid[h] != PWC_EMPTY; h = (h + 1) & c->mask)
+				;
+			c->byuid[h] = i;
+		}
+		if (pwcache_findname(c, PWC_STR(c, e, PWC_NAME)) ==
+		    PWC_EMPTY) {
+			for (h = pwcache_hashname(PWC_STR(c, e, PWC_NAME)) &
+			     c->mask; c->byname[h] != PWC_EMPTY;
+			     h = (h + 1) & c->mask)
+				;
+			c->byname[h] = i;
+		}
+	}
+	return 0;
+}
+
+/* Reads the whole database into `c'.  Called without the GIL. */
+static int
+pwcache_load(struct pwcache *c)
+{
+	struct pwcache_entry *e;
+	struct passwd *pwd;
+	int r = 0;
+
+	memset(c, 0, sizeof(*c));
+	setpwent();
+	while ((pwd = getpwent()) != NULL) {
+		if (c->nents == c->entsize) {
+			int size = c->entsize ? c->entsize * 2 : 256;
+
+			e = realloc(c->ents, sizeof(*e) * size);
+			if (e == NULL) {
+				r = -1;
+				break;
+			}
+			c->ents = e;
+			c->entsize = size;
+		}
+		e = &c->ents[c->nents];
+		e->uid = pwd->pw_uid;
+		e->gid = pwd->pw_gid;
+		e->change = pwd->pw_change;
+		e->expire = pwd->pw_expire;
+		e->fields = pwd->pw_fields;
+		if (pwcache_addstr(c, pwd->pw_name, &e->str[PWC_NAME]) ||
+		    pwcache_addstr(c, pwd->pw_passwd, &e->str[PWC_PASSWD]) ||
+		    pwcache_addstr(c, pwd->pw_class, &e->str[PWC_CLASS]) ||
+		    pwcache_addstr(c, pwd->pw_gecos, &e->str[PWC_GECOS]) ||
+		    pwcache_addstr(c, pwd->pw_dir, &e->str[PWC_DIR]) ||
+		    pwcache_addstr(c, pwd->pw_shell, &e->str[PWC_SHELL])) {
+			r = -1;
+			break;
+		}
+		c->nents++;
+	}
+	endpwent();
+
+	if (r == 0)
+		r = pwcache_index(c);
+	if (r == -1)
+		pwcache_free(c);
+	return r;
+}
+
+static PyObject *
+pwcache_record(struct pwcache *c, struct pwcache_entry *e)
+{
+	PyObject *r;
+
+	r = PyStructSequence_New(&PasswdType);
+	if (r == NULL)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(r, 0,
+		PyString_FromString(PWC_STR(c, e, PWC_NAME)));
+	PyStructSequence_SET_ITEM(r, 1,
+		PyString_FromString(PWC_STR(c, e, PWC_PASSWD)));
+	PyStructSequence_SET_ITEM(r, 2, PyInt_FromLong(e->uid));
+	PyStructSequence_SET_ITEM(r, 3, PyInt_FromLong(e->gid));
+	PyStructSequence_SET_ITEM(r, 4, PyInt_FromLong(e->change));
+	PyStructSequence_SET_ITEM(r, 5,
+		PyString_FromString(PWC_STR(c, e, PWC_CLASS)));
+	PyStructSequence_SET_ITEM(r, 6,
+		PyString_FromString(PWC_STR(c, e, PWC_GECOS)));
+	PyStructSequence_SET_ITEM(r, 7,
+		PyString_FromString(PWC_STR(c, e, PWC_DIR)));
+	PyStructSequence_SET_ITEM(r, 8,
+		PyString_FromString(PWC_STR(c, e, PWC_SHELL)));
+	PyStructSequence_SET_ITEM(r, 9, PyInt_FromLong(e->expire));
+	PyStructSequence_SET_ITEM(r, 10, PyInt_FromLong(e->fields));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(r);
+		return NULL;
+	}
+	return r;
+}
+
+/* Reloads the database, replacing the cached copy on success. */
+static int
+passwdcache_reload(passwdcacheobject *self)
+{
+	struct pwcache c;
+	struct stat st;
+	int r, sr;
+
+	/*
+	 * Stat before loading: if pwd.db is replaced while we read it, the
+	 * next check sees a newer mtime than the one recorded and reloads.
+	 */
+	Py_BEGIN_ALLOW_THREADS
+	sr = stat(PyString_AS_STRING(self->path), &st);
+	r = pwcache_load(&c);
+	Py_END_ALLOW_THREADS
+	if (r == -1) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	if (sr == 0)
+		self->mtime = st.st_mtimespec;
+	else
+		memset(&self->mtime, 0, sizeof(self->mtime));
+	clock_gettime(CLOCK_MONOTONIC, &self->checked);
+
+	pwcache_free(&self->c);
+	self->c = c;
+	return 0;
+}
+
+/* Reloads the database if pwd.db changed since it was loaded. */
+static int
+passwdcache_check(passwdcacheobject *self)
+{
+	struct timespec now;
+	struct stat st;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - self->checked.tv_sec) +
+	    (now.tv_nsec - self->checked.tv_nsec) / 1e9 < self->interval)
+		return 0;
+	self->checked = now;
+
+	if (stat(PyString_AS_STRING(self->path), &st) == -1 ||
+	    (st.st_mtimespec.tv_sec == self->mtime.tv_sec &&
+	     st.st_mtimespec.tv_nsec == self->mtime.tv_nsec))
+		return 0;
+	return passwdcache_reload(self);
+}
+
+static PyObject *
+passwdcache_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"path", "interval", NULL};
+	passwdcacheobject *self;
+	char *path = _PATH_MP_DB;
+	double interval = 1.0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sd:passwdcache",
+					 kwlist, &path, &interval))
+		return NULL;
+
+	self = (passwdcacheobject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	memset(&self->c, 0, sizeof(self->c));
+	self->interval = interval;
+	self->path = PyString_FromString(path);
+	if (self->path == NULL || passwdcache_reload(self) == -1) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+static void
+passwdcache_dealloc(passwdcacheobject *self)
+{
+	pwcache_free(&self->c);
+	Py_XDECREF(self->path);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static char passwdcache_getpwuid_doc[] =
+"getpwuid(uid):\n"
+"returns the passwd record of `uid` or raises KeyError.";
+
+static PyObject *
+passwdcache_getpwuid(passwdcacheobject *self, PyObject *args)
+{
+	int uid, i;
+
+	if (!PyArg_ParseTuple(args, "i:getpwuid", &uid))
+		return NULL;
+	if (passwdcache_check(self) == -1)
+		return NULL;
+
+	i = pwcache_finduid(&self->c, (uid_t)uid);
+	if (i == PWC_EMPTY) {
+		PyObject *uidn = PyInt_FromLong(uid);
+		PyErr_SetObject(PyExc_KeyError, uidn);
+		Py_DECREF(uidn);
+		return NULL;
+	}
+	return pwcache_record(&self->c, &self->c.ents[i]);
+}
+
+static char passwdcache_getpwnam_doc[] =
+"getpwnam(name):\n"
+"returns the passwd record of login `name` or raises KeyError.";
+
+static PyObject *
+passwdcache_getpwnam(passwdcacheobject *self, PyObject *args)
+{
+	char *name;
+	int i;
+
+	if (!PyArg_ParseTuple(args, "s:getpwnam", &name))
+		return NULL;
+	if (passwdcache_check(self) == -1)
+		return NULL;
+
+	i = pwcache_findname(&self->c, name);
+	if (i == PWC_EMPTY) {
+		PyErr_SetString(PyExc_KeyError, name);
+		return NULL;
+	}
+	return pwcache_record(&self->c, &self->c.ents[i]);
+}
+
+static char passwdcache_getpwent_doc[] =
+"getpwent():\n"
+"returns a list of all passwd records in database order.";
+
+static PyObject *
+passwdcache_getpwent(passwdcacheobject *self)
+{
+	PyObject *r;
+	int i;
+
+	if (passwdcache_check(self) == -1)
+		return NULL;
+
+	r = PyList_New(self->c.nents);
+	for (i = 0; r != NULL && i < self->c.nents; i++) {
+		PyObject *rec = pwcache_record(&self->c, &self->c.ents[i]);
+
+		if (rec == NULL) {
+			Py_DECREF(r);
+			return NULL;
+		}
+		PyList_SET_ITEM(r, i, rec);
+	}
+	return r;
+}
+
+static char passwdcache_refresh_doc[] =
+"refresh():\n"
+"reloads the password database unconditionally.";
+
+static PyObject *
+passwdcache_refresh(passwdcacheobject *self)
+{
+	if (passwdcache_reload(self) == -1)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+passwdcache_length(passwdcacheobject *self)
+{
+	return self->c.nents;
+}
+
+static PyMethodDef passwdcache_methods[] = {
+	{"getpwuid", (PyCFunction)passwdcache_getpwuid, METH_VARARGS,
+	 passwdcache_getpwuid_doc},
+	{"getpwnam", (PyCFunction)passwdcache_getpwnam, METH_VARARGS,
+	 passwdcache_getpwnam_doc},
+	{"getpwent", (PyCFunction)passwdcache_getpwent, METH_NOARGS,
+	 passwdcache_getpwent_doc},
+	{"refresh", (PyCFunction)passwdcache_refresh, METH_NOARGS,
+	 passwdcache_refresh_doc},
+	{NULL, NULL}
+};
+
+static PyMemberDef passwdcache_members[] = {
+	{"path", T_OBJECT, offsetof(passwdcacheobject, path), READONLY,
+	 "database file whose mtime triggers a reload"},
+	{"interval", T_DOUBLE, offsetof(passwdcacheobject, interval), 0,
+	 "minimum seconds between two mtime checks"},
+	{NULL}
+};
+
+static PySequenceMethods passwdcache_as_sequence = {
+	sq_length:	(lenfunc)passwdcache_length,
+};
+
+static char passwdcache_doc[] =
+"passwdcache([path, interval=1.0]):\n"
+"loads the whole password database once and answers getpwuid(),\n"
+"getpwnam() and getpwent() from hash indexes in C, returning passwd\n"
+"records.  The database is reloaded when the mtime of `path`\n"
+"(pwd.db by default) changes, checked at most every `interval` seconds.";
+
+static PyTypeObject PasswdCacheType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"passwdcache",
+	tp_basicsize:	sizeof(passwdcacheobject),
+	tp_dealloc:	(destructor)passwdcache_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_as_sequence:	&passwdcache_as_sequence,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	passwdcache_methods,
+	tp_members:	passwdcache_members,
+	tp_new:		passwdcache_new,
+	tp_doc:		passwdcache_doc,
+};
+
+#endif
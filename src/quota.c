@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <ufs/ufs/quota.h>
 
 EXPCONST(int USRQUOTA)
@@ -175,3 +177,5 @@ PyFB_quotasync(PyObject *self, PyObject *args)
 
 	Py_RETURN_NONE;
 }
+
+#endif
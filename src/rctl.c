@@ -0,0 +1,498 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifdef __FreeBSD__
+#if __FreeBSD_version >= 900000
+#include <sys/rctl.h>
+#include <math.h>
+#endif
+#endif
+
+/*
+ * racct(2) usage is reported by the kernel as "resource=value,..."
+ * text.  The parser below is platform independent so that it can be
+ * tested anywhere; the system calls are FreeBSD 9.0 and later only.
+ */
+
+/* resources reported by racct_collect() by default */
+static const char *racct_resources[] = {
+	"cputime", "datasize", "stacksize", "coredumpsize", "memoryuse",
+	"memorylocked", "maxproc", "openfiles", "vmemoryuse",
+	"pseudoterminals", "swapuse", "nthr", "msgqqueued", "msgqsize",
+	"nmsgq", "nsem", "nsemop", "nshm", "shmsize", "wallclock", "pcpu",
+	"readbps", "writebps", "readiops", "writeiops", NULL,
+};
+
+/*
+ * Scans the next "key=value" pair of racct text at *sp.  Values are
+ * unsigned decimal integers.  returns 1 for a pair, 0 at the end of the
+ * text or -1 if it is malformed.
+ */
+static int
+racct_next(const char **sp, const char **key, size_t *klen,
+	   unsigned long long *value)
+{
+	const char *s = *sp, *eq;
+	char *end;
+
+	if (*s == '\0' || *s == '\n')
+		return 0;
+	eq = strchr(s, '=');
+	if (eq == NULL || eq == s || !isdigit((unsigned char)eq[1]))
+		return -1;
+	errno = 0;
+	*value = strtoull(eq + 1, &end, 10);
+	if (errno != 0 || (*end != ',' && *end != '\0' && *end != '\n'))
+		return -1;
+
+	*key = s;
+	*klen = eq - s;
+	*sp = (*end == ',') ? end + 1 : end;
+	return 1;
+}
+
+/*
+ * Parses racct text into values[k * stride] for each keys[k].  Keys
+ * missing from the text are left untouched.  returns the number of
+ * pairs in the text or -1 if it is malformed.
+ */
+static int
+racct_parse_into(const char *s, const char **keys, int nkeys,
+		 double *values, int stride)
+{
+	unsigned long long v;
+	const char *key;
+	size_t klen;
+	int n = 0, k, r;
+
+	while ((r = racct_next(&s, &key, &klen, &v)) == 1) {
+		for (k = 0; k < nkeys; k++)
+			if (strlen(keys[k]) == klen &&
+			    memcmp(keys[k], key, klen) == 0) {
+				values[k * stride] = (double)v;
+				break;
+			}
+		n++;
+	}
+	return (r == -1) ? -1 : n;
+}
+
+/* Internal helper function to turn a sequence of names into a C array
+ * of borrowed strings, or the resource list if `seq' is NULL */
+static const char **
+racct_keys(PyObject *seq, int *nkeys)
+{
+	const char **keys;
+	int n, i;
+
+	if (seq == NULL) {
+		for (n = 0; racct_resources[n] != NULL; n++)
+			;
+		*nkeys = n;
+		return racct_resources;
+	}
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	keys = PyMem_New(const char *, n > 0 ? n : 1);
+	if (keys == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		keys[i] = PyString_AsString(PySequence_Fast_GET_ITEM(seq, i));
+		if (keys[i] == NULL) {
+			PyMem_Free(keys);
+			return NULL;
+		}
+	}
+	*nkeys = n;
+	return keys;
+}
+
+static void
+racct_freekeys(const char **keys)
+{
+	if (keys != racct_resources)
+		PyMem_Free(keys);
+}
+
+static PyObject *
+racct_malformed(void)
+{
+	PyErr_SetString(PyExc_ValueError, "malformed racct string");
+	return NULL;
+}
+
+static char PyFB_racct_parse__doc__[] =
+"racct_parse(text[, keys]):\n"
+"parses racct \"resource=value,...\" text as returned by\n"
+"rctl_get_racct(2) into a dict of ints.  If a sequence of `keys` is\n"
+"given, returns an array('d') of their values instead, with zeroes\n"
+"for missing keys.";
+
+static PyObject *
+PyFB_racct_parse(PyObject *self, PyObject *args)
+{
+	PyObject *keyobj = NULL, *seq, *r;
+	const char *text, *p, *kp;
+	const char **keys;
+	double *values;
+	int nkeys, n;
+
+	if (!PyArg_ParseTuple(args, "s|O:racct_parse", &text, &keyobj))
+		return NULL;
+
+	if (keyobj == NULL) {
+		unsigned long long value;
+		PyObject *key, *v;
+		size_t klen;
+		int res;
+
+		r = PyDict_New();
+		p = text;
+		while (r != NULL &&
+		       (res = racct_next(&p, &kp, &klen, &value)) != 0) {
+			if (res == -1) {
+				Py_DECREF(r);
+				return racct_malformed();
+			}
+			v = (value <= LONG_MAX) ? PyInt_FromLong((long)value) :
+			    PyLong_FromUnsignedLongLong(value);
+			key = PyString_FromStringAndSize(kp, klen);
+			if (v == NULL || key == NULL ||
+			    PyDict_SetItem(r, key, v) == -1) {
+				Py_XDECREF(key);
+				Py_XDECREF(v);
+				Py_DECREF(r);
+				return NULL;
+			}
+			Py_DECREF(key);
+			Py_DECREF(v);
+		}
+		return r;
+	}
+
+	seq = PySequence_Fast(keyobj, "keys must be a sequence");
+	if (seq == NULL)
+		return NULL;
+	keys = racct_keys(seq, &nkeys);
+	if (keys == NULL) {
+		Py_DECREF(seq);
+		return NULL;
+	}
+
+	values = PyMem_New(double, nkeys > 0 ? nkeys : 1);
+	if (values == NULL) {
+		r = PyErr_NoMemory();
+		goto out;
+	}
+	memset(values, 0, sizeof(double) * nkeys);
+
+	n = racct_parse_into(text, keys, nkeys, values, 1);
+	r = (n == -1) ? racct_malformed() : array_fromdoubles(values, nkeys);
+
+out:
+	PyMem_Free(values);
+	racct_freekeys(keys);
+	Py_DECREF(seq);
+	return r;
+}
+
+#ifdef __FreeBSD__
+#if __FreeBSD_version >= 900000
+
+#define RCTL_BUFSIZE	4096
+
+/*
+ * Calls one of the rctl(2) query system calls, growing `*bufp' while
+ * the kernel reports ERANGE.  Called without the GIL.
+ */
+static int
+rctl_query(int (*call)(const char *, size_t, char *, size_t),
+	   const char *filter, char **bufp, size_t *sizep)
+{
+	char *nbuf;
+
+	for (;;) {
+		if (*bufp == NULL) {
+			*sizep = RCTL_BUFSIZE;
+			*bufp = malloc(*sizep);
+			if (*bufp == NULL)
+				return -1;
+		}
+		if (call(filter, strlen(filter) + 1, *bufp, *sizep) == 0)
+			return 0;
+		if (errno != ERANGE)
+			return -1;
+		nbuf = realloc(*bufp, *sizep * 2);
+		if (nbuf == NULL)
+			return -1;
+		*bufp = nbuf;
+		*sizep *= 2;
+	}
+}
+
+static char PyFB_rctl_get_racct__doc__[] =
+"rctl_get_racct(filter):\n"
+"returns the resource usage of the subject given by `filter`, such as\n"
+"\"jail:www\" or \"process:1234\", as a dict of ints.";
+
+static PyObject *
+PyFB_rctl_get_racct(PyObject *self, PyObject *args)
+{
+	const char *filter;
+	char *buf = NULL;
+	size_t size;
+	PyObject *text, *r;
+	int res;
+
+	if (!PyArg_ParseTuple(args, "s:rctl_get_racct", &filter))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	res = rctl_query(rctl_get_racct, filter, &buf, &size);
+	Py_END_ALLOW_THREADS
+	if (res == -1) {
+		free(buf);
+		return OSERROR();
+	}
+
+	text = Py_BuildValue("(s)", buf);
+	free(buf);
+	if (text == NULL)
+		return NULL;
+	r = PyFB_racct_parse(self, text);
+	Py_DECREF(text);
+	return r;
+}
+
+static char PyFB_rctl_get_rules__doc__[] =
+"rctl_get_rules([filter]):\n"
+"returns a list of the rctl rules matching `filter` (all rules by\n"
+"default).";
+
+static PyObject *
+PyFB_rctl_get_rules(PyObject *self, PyObject *args)
+{
+	const char *filter = "::";
+	char *buf = NULL, *p, *comma;
+	size_t size;
+	PyObject *r;
+	int res;
+
+	if (!PyArg_ParseTuple(args, "|s:rctl_get_rules", &filter))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	res = rctl_query(rctl_get_rules, filter, &buf, &size);
+	Py_END_ALLOW_THREADS
+	if (res == -1) {
+		free(buf);
+		return OSERROR();
+	}
+
+	/* rules are separated by commas */
+	r = PyList_New(0);
+	for (p = buf; r != NULL && *p != '\0'; p = comma + 1) {
+		comma = strchr(p, ',');
+		if (PyList_Append_StealRef(r, PyString_FromStringAndSize(p,
+		    comma != NULL ? comma - p : strlen(p))) == -1) {
+			Py_DECREF(r);
+			r = NULL;
+		}
+		if (comma == NULL)
+			break;
+	}
+
+	free(buf);
+	return r;
+}
+
+static char PyFB_rctl_add_rule__doc__[] =
+"rctl_add_rule(rule):\n"
+"adds an rctl rule such as \"jail:www:memoryuse:deny=1g\".";
+
+static PyObject *
+PyFB_rctl_add_rule(PyObject *self, PyObject *args)
+{
+	const char *rule;
+
+	if (!PyArg_ParseTuple(args, "s:rctl_add_rule", &rule))
+		return NULL;
+
+	if (rctl_add_rule(rule, strlen(rule) + 1, NULL, 0) == -1)
+		return OSERROR();
+
+	Py_RETURN_NONE;
+}
+
+static char PyFB_rctl_remove_rule__doc__[] =
+"rctl_remove_rule(filter):\n"
+"removes the rctl rules matching `filter`.";
+
+static PyObject *
+PyFB_rctl_remove_rule(PyObject *self, PyObject *args)
+{
+	const char *filter;
+
+	if (!PyArg_ParseTuple(args, "s:rctl_remove_rule", &filter))
+		return NULL;
+
+	if (rctl_remove_rule(filter, strlen(filter) + 1, NULL, 0) == -1)
+		return OSERROR();
+
+	Py_RETURN_NONE;
+}
+
+static char PyFB_racct_collect__doc__[] =
+"racct_collect([resources]):\n"
+"queries the racct usage of every jail and returns a dict of columns:\n"
+"`jid` and `name` lists and one array('d') per resource, aligned with\n"
+"the jail list.  `resources` defaults to all known racct resources.\n"
+"The values of a jail that vanished during the walk, or whose usage\n"
+"could not be parsed, are NaN.";
+
+static PyObject *
+PyFB_racct_collect(PyObject *self, PyObject *args)
+{
+	PyObject *resobj = NULL, *seq = NULL, *params, *r = NULL;
+	PyObject *jids = NULL, *names = NULL, *arr;
+	struct jailparam *jp;
+	const char **keys = NULL;
+	double *values = NULL;
+	int *jidv = NULL;
+	char *buf = NULL, filter[64];
+	size_t size;
+	int nkeys, njp, n, i, k, jid, failed = 0;
+
+	if (!PyArg_ParseTuple(args, "|O:racct_collect", &resobj))
+		return NULL;
+
+	if (resobj != NULL) {
+		seq = PySequence_Fast(resobj, "resources must be a sequence");
+		if (seq == NULL)
+			return NULL;
+	}
+	keys = racct_keys(seq, &nkeys);
+	if (keys == NULL)
+		goto out;
+
+	/* enumerate the jails with the jail_get() parameter engine */
+	params = Py_BuildValue("(ss)", "jid", "name");
+	if (params == NULL)
+		goto out;
+	njp = jailparam_setup(&jp, "lastjid", params);
+	Py_DECREF(params);
+	if (njp == -1)
+		goto out;
+
+	jids = PyList_New(0);
+	names = PyList_New(0);
+	for (jid = 0; jids != NULL && names != NULL;) {
+		if (jailparam_import_raw(&jp[0], &jid, sizeof(jid)) == -1) {
+			jailparam_error();
+			break;
+		}
+		jid = jailparam_fetch(jp, njp);
+		if (jid <= 0)
+			break;
+		if (PyList_Append_StealRef(jids, PyInt_FromLong(jid)) == -1 ||
+		    PyList_Append_StealRef(names,
+				PyString_FromString(jp[2].jp_value)) == -1)
+			break;
+	}
+	jailparam_release(jp, njp);
+	if (PyErr_Occurred())
+		goto out;
+
+	n = PyList_GET_SIZE(jids);
+	values = PyMem_New(double, nkeys * n > 0 ? nkeys * n : 1);
+	jidv = PyMem_New(int, n > 0 ? n : 1);
+	if (values == NULL || jidv == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	memset(values, 0, sizeof(double) * nkeys * n);
+	for (i = 0; i < n; i++)
+		jidv[i] = PyInt_AS_LONG(PyList_GET_ITEM(jids, i));
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < n; i++) {
+		snprintf(filter, sizeof(filter), "jail:%d", jidv[i]);
+		if (rctl_query(rctl_get_racct, filter, &buf, &size) == -1) {
+			failed = errno;
+			/* the jail went away in the meantime */
+			if (failed != ESRCH && failed != ENOENT)
+				break;
+			failed = 0;
+		}
+		else if (racct_parse_into(buf, keys, nkeys, &values[i],
+					  n) != -1)
+			continue;
+		/* no usage for this jail; don't pass it off as zeroes */
+		for (k = 0; k < nkeys; k++)
+			values[k * n + i] = NAN;
+	}
+	Py_END_ALLOW_THREADS
+	free(buf);
+
+	if (failed) {
+		errno = failed;
+		OSERROR();
+		goto out;
+	}
+
+	r = PyDict_New();
+	if (r == NULL)
+		goto out;
+	PyDict_SetItemString(r, "jid", jids);
+	PyDict_SetItemString(r, "name", names);
+	for (k = 0; k < nkeys; k++) {
+		arr = array_fromdoubles(&values[k * n], n);
+		if (arr == NULL) {
+			Py_DECREF(r);
+			r = NULL;
+			goto out;
+		}
+		PyDict_SetItemString_StealRef(r, (char *)keys[k], arr);
+	}
+
+out:
+	Py_XDECREF(jids);
+	Py_XDECREF(names);
+	PyMem_Free(values);
+	PyMem_Free(jidv);
+	if (keys != NULL)
+		racct_freekeys(keys);
+	Py_XDECREF(seq);
+	return r;
+}
+
+#endif
+
+#endif
@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <sys/reboot.h>
 
 EXPCONST(int RB_AUTOBOOT)
@@ -61,3 +63,5 @@ PyFB_reboot(PyObject *self, PyObject *args)
 	/* will never reach */
 	return NULL;
 }
+
+#endif
@@ -26,7 +26,12 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <sys/resource.h>
+#include <sys/rtprio.h>
+#include <pthread.h>
+#include <time.h>
 
 /* constants */
 EXPCONST(int RLIMIT_CPU)
@@ -46,8 +51,56 @@ EXPCONST(int PRIO_PROCESS)
 EXPCONST(int PRIO_PGRP)
 EXPCONST(int PRIO_USER)
 
+EXPCONST(int RTP_LOOKUP)
+EXPCONST(int RTP_SET)
+EXPCONST(int RTP_PRIO_REALTIME)
+EXPCONST(int RTP_PRIO_NORMAL)
+EXPCONST(int RTP_PRIO_IDLE)
+EXPCONST_IFAVAIL(int RTP_PRIO_FIFO)
+EXPCONST(int RTP_PRIO_MIN)
+EXPCONST(int RTP_PRIO_MAX)
+
 EXPCONST(int RUSAGE_SELF)
 EXPCONST(int RUSAGE_CHILDREN)
+EXPCONST_IFAVAIL(int RUSAGE_THREAD)
+
+/* Types */
+DECLSTRUCTSEQ(RusageResultType, rusage_result_desc)
+DECLTYPE(ThreadClocksType, threadclocksobject)
+DECLTYPE(ResourceSpanType, resourcespanobject)
+
+static PyStructSequence_Field rusage_result_fields[] = {
+	{"utime",	"user time used"},
+	{"stime",	"system time used"},
+	{"maxrss",	"max resident set size"},
+	{"ixrss",	"integral shared text memory size"},
+	{"idrss",	"integral unshared data size"},
+	{"isrss",	"integral unshared stack size"},
+	{"minflt",	"page reclaims"},
+	{"majflt",	"page faults"},
+	{"nswap",	"swaps"},
+	{"inblock",	"block input operations"},
+	{"oublock",	"block output operations"},
+	{"msgsnd",	"messages sent"},
+	{"msgrcv",	"messages received"},
+	{"nsignals",	"signals received"},
+	{"nvcsw",	"voluntary context switches"},
+	{"nivcsw",	"involuntary context switches"},
+	{0}
+};
+
+static PyStructSequence_Desc rusage_result_desc = {
+	"freebsd.rusage_result",
+	"rusage_result: Result from rusage() and rusage_delta().",
+	rusage_result_fields,
+	16,
+};
+
+static PyTypeObject RusageResultType;
+
+#define RUSAGE_NTIMES		2
+#define RUSAGE_NCOUNTERS	14
+#define RUSAGE_MAXRSS		0	/* the only counter which isn't a sum */
 
 
 /* implementation */
@@ -124,8 +177,9 @@ PyFB_getpriority(PyObject *self, PyObject *args)
 	if (!PyArg_ParseTuple(args,"ii:getpriority", &which, &who))
 		return NULL;
 
+	errno = 0;
 	r = getpriority(which, who);
-	if (errno == -1) /* getpriority can return -1 legitimately */
+	if (r == -1 && errno != 0) /* getpriority can return -1 legitimately */
 		return OSERROR();
 	else
 		return PyInt_FromLong((long) r);
@@ -151,11 +205,223 @@ PyFB_setpriority(PyObject *self, PyObject *args)
 }
 
 
+/* Internal helper function to copy a sequence of ids into a C array */
+static int
+ids_fromsequence(PyObject *o, int **idsp)
+{
+	PyObject *seq;
+	int *ids, n, i;
+
+	seq = PySequence_Fast(o, "ids must be a sequence");
+	if (seq == NULL)
+		return -1;
+	n = PySequence_Fast_GET_SIZE(seq);
+
+	ids = PyMem_New(int, n > 0 ? n : 1);
+	if (ids == NULL) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		ids[i] = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+		if (ids[i] == -1 && PyErr_Occurred()) {
+			PyMem_Del(ids);
+			Py_DECREF(seq);
+			return -1;
+		}
+	}
+	Py_DECREF(seq);
+
+	*idsp = ids;
+	return n;
+}
+
+/* Internal helper function to build per-id results: `values[i]` as int
+ * (or None if `values` is NULL) on success, an OSError otherwise. */
+static PyObject *
+ids_results(int n, const int *errors, const int *values)
+{
+	PyObject *r, *v;
+	int i;
+
+	r = PyList_New(n);
+	for (i = 0; r != NULL && i < n; i++) {
+		if (errors[i] != 0)
+			v = oserror_fromerrno(errors[i]);
+		else if (values != NULL)
+			v = PyInt_FromLong(values[i]);
+		else {
+			Py_INCREF(Py_None);
+			v = Py_None;
+		}
+		if (v == NULL) {
+			Py_DECREF(r);
+			return NULL;
+		}
+		PyList_SET_ITEM(r, i, v);
+	}
+	return r;
+}
+
+
+static char PyFB_getpriority_many__doc__[] =
+"getpriority_many(which, ids):\n"
+"calls getpriority() for every id in `ids` with the GIL released and\n"
+"returns a list with the priority of each id, or an OSError instance\n"
+"if it failed.";
+
+static PyObject *
+PyFB_getpriority_many(PyObject *self, PyObject *args)
+{
+	PyObject *o, *r;
+	int which, n, i, *ids, *errors, *prios;
+
+	if (!PyArg_ParseTuple(args, "iO:getpriority_many", &which, &o))
+		return NULL;
+
+	n = ids_fromsequence(o, &ids);
+	if (n == -1)
+		return NULL;
+
+	errors = PyMem_New(int, n > 0 ? n : 1);
+	prios = PyMem_New(int, n > 0 ? n : 1);
+	if (errors == NULL || prios == NULL) {
+		PyMem_Del(ids);
+		PyMem_Del(errors);
+		PyMem_Del(prios);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < n; i++) {
+		errno = 0;
+		prios[i] = getpriority(which, ids[i]);
+		errors[i] = (prios[i] == -1) ? errno : 0;
+	}
+	Py_END_ALLOW_THREADS
+
+	r = ids_results(n, errors, prios);
+	PyMem_Del(ids);
+	PyMem_Del(errors);
+	PyMem_Del(prios);
+	return r;
+}
+
+
+static char PyFB_setpriority_many__doc__[] =
+"setpriority_many(which, ids, prio):\n"
+"calls setpriority() for every id in `ids` with the GIL released and\n"
+"returns a list with None for each id that succeeded or an OSError\n"
+"instance for each one that failed.";
+
+static PyObject *
+PyFB_setpriority_many(PyObject *self, PyObject *args)
+{
+	PyObject *o, *r;
+	int which, prio, n, i, *ids, *errors;
+
+	if (!PyArg_ParseTuple(args, "iOi:setpriority_many", &which, &o, &prio))
+		return NULL;
+
+	n = ids_fromsequence(o, &ids);
+	if (n == -1)
+		return NULL;
+
+	errors = PyMem_New(int, n > 0 ? n : 1);
+	if (errors == NULL) {
+		PyMem_Del(ids);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < n; i++)
+		errors[i] = (setpriority(which, ids[i], prio) == -1) ?
+				errno : 0;
+	Py_END_ALLOW_THREADS
+
+	r = ids_results(n, errors, NULL);
+	PyMem_Del(ids);
+	PyMem_Del(errors);
+	return r;
+}
+
+
+static char PyFB_rtprio__doc__[] =
+"rtprio(function, pid[, type, prio]):\n"
+"looks up (const.RTP_LOOKUP) or changes (const.RTP_SET) the realtime or\n"
+"idle priority of process `pid`, or of the current process if `pid` is\n"
+"0.  `type` is one of const.RTP_PRIO_* and `prio` ranges from\n"
+"const.RTP_PRIO_MIN to const.RTP_PRIO_MAX.  Returns the (type, prio)\n"
+"pair.";
+
+static PyObject *
+PyFB_rtprio(PyObject *self, PyObject *args)
+{
+	struct rtprio rtp;
+	int function, pid, type = RTP_PRIO_NORMAL, prio = 0;
+
+	if (!PyArg_ParseTuple(args, "ii|ii:rtprio", &function, &pid,
+			      &type, &prio))
+		return NULL;
+
+	rtp.type = type;
+	rtp.prio = prio;
+	if (rtprio(function, pid, &rtp) == -1)
+		return OSERROR();
+
+	return Py_BuildValue("(ii)", (int)rtp.type, (int)rtp.prio);
+}
+
+
+static char PyFB_rtprio_many__doc__[] =
+"rtprio_many(pids, type, prio):\n"
+"sets the realtime or idle priority of every process in `pids` with\n"
+"the GIL released and returns a list with None for each pid that\n"
+"succeeded or an OSError instance for each one that failed.";
+
+static PyObject *
+PyFB_rtprio_many(PyObject *self, PyObject *args)
+{
+	struct rtprio rtp;
+	PyObject *o, *r;
+	int type, prio, n, i, *pids, *errors;
+
+	if (!PyArg_ParseTuple(args, "Oii:rtprio_many", &o, &type, &prio))
+		return NULL;
+
+	n = ids_fromsequence(o, &pids);
+	if (n == -1)
+		return NULL;
+
+	errors = PyMem_New(int, n > 0 ? n : 1);
+	if (errors == NULL) {
+		PyMem_Del(pids);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < n; i++) {
+		rtp.type = type;
+		rtp.prio = prio;
+		errors[i] = (rtprio(RTP_SET, pids[i], &rtp) == -1) ? errno : 0;
+	}
+	Py_END_ALLOW_THREADS
+
+	r = ids_results(n, errors, NULL);
+	PyMem_Del(pids);
+	PyMem_Del(errors);
+	return r;
+}
+
+
 static char PyFB_getrusage__doc__[] =
 "getrusage(who):\n"
 "returns information describing the resources utilized by the current\n"
 "process, or all its terminated child processes.  The `who` argument\n"
-"is either const.RUSAGE_SELF or const.RUSAGE_CHILDREN.";
+"is either const.RUSAGE_SELF or const.RUSAGE_CHILDREN, or\n"
+"const.RUSAGE_THREAD for the calling thread only where available.";
 
 static PyObject *
 PyFB_getrusage(PyObject *self, PyObject *args)
@@ -195,3 +461,682 @@ PyFB_getrusage(PyObject *self, PyObject *args)
 
 	return r;
 }
+
+
+/* Internal helper function to flatten struct rusage into C arrays */
+static void
+rusage_unpack(const struct rusage *rup, double *times, long *counters)
+{
+	times[0] = (double)rup->ru_utime.tv_sec +
+		   (double)rup->ru_utime.tv_usec / 1000000.0;
+	times[1] = (double)rup->ru_stime.tv_sec +
+		   (double)rup->ru_stime.tv_usec / 1000000.0;
+	counters[0] = rup->ru_maxrss;
+	counters[1] = rup->ru_ixrss;
+	counters[2] = rup->ru_idrss;
+	counters[3] = rup->ru_isrss;
+	counters[4] = rup->ru_minflt;
+	counters[5] = rup->ru_majflt;
+	counters[6] = rup->ru_nswap;
+	counters[7] = rup->ru_inblock;
+	counters[8] = rup->ru_oublock;
+	counters[9] = rup->ru_msgsnd;
+	counters[10] = rup->ru_msgrcv;
+	counters[11] = rup->ru_nsignals;
+	counters[12] = rup->ru_nvcsw;
+	counters[13] = rup->ru_nivcsw;
+}
+
+static PyObject *
+rusage_result_new(const double *times, const long *counters)
+{
+	PyObject *r;
+	int i;
+
+	r = PyStructSequence_New(&RusageResultType);
+	if (r == NULL)
+		return NULL;
+
+	for (i = 0; i < RUSAGE_NTIMES; i++)
+		PyStructSequence_SET_ITEM(r, i, PyFloat_FromDouble(times[i]));
+	for (i = 0; i < RUSAGE_NCOUNTERS; i++)
+		PyStructSequence_SET_ITEM(r, RUSAGE_NTIMES + i,
+					  PyInt_FromLong(counters[i]));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(r);
+		return NULL;
+	}
+	return r;
+}
+
+
+static char PyFB_rusage__doc__[] =
+"rusage(who):\n"
+"works like getrusage() but returns a rusage_result struct sequence\n"
+"instead of a dict.";
+
+static PyObject *
+PyFB_rusage(PyObject *self, PyObject *args)
+{
+	struct rusage rup;
+	double times[RUSAGE_NTIMES];
+	long counters[RUSAGE_NCOUNTERS];
+	int who;
+
+	if (!PyArg_ParseTuple(args, "i:rusage", &who))
+		return NULL;
+
+	if (getrusage(who, &rup) == -1)
+		return OSERROR();
+
+	rusage_unpack(&rup, times, counters);
+	return rusage_result_new(times, counters);
+}
+
+
+static char PyFB_rusage_delta__doc__[] =
+"rusage_delta(prev[, who]):\n"
+"returns a rusage_result holding the resources used since `prev`, a\n"
+"rusage_result from an earlier rusage() call with the same `who`\n"
+"(const.RUSAGE_SELF by default).  maxrss is the current value as it\n"
+"is not accumulated.";
+
+static PyObject *
+PyFB_rusage_delta(PyObject *self, PyObject *args)
+{
+	struct rusage rup;
+	double times[RUSAGE_NTIMES];
+	long counters[RUSAGE_NCOUNTERS];
+	PyObject *prev;
+	int who = RUSAGE_SELF, i;
+
+	if (!PyArg_ParseTuple(args, "O!|i:rusage_delta", &RusageResultType,
+			      &prev, &who))
+		return NULL;
+
+	if (getrusage(who, &rup) == -1)
+		return OSERROR();
+
+	rusage_unpack(&rup, times, counters);
+	for (i = 0; i < RUSAGE_NTIMES; i++)
+		times[i] -= PyFloat_AsDouble(
+				PyStructSequence_GET_ITEM(prev, i));
+	for (i = 0; i < RUSAGE_NCOUNTERS; i++)
+		if (i != RUSAGE_MAXRSS)
+			counters[i] -= PyInt_AsLong(PyStructSequence_GET_ITEM(
+						prev, RUSAGE_NTIMES + i));
+	if (PyErr_Occurred())
+		return NULL;
+
+	return rusage_result_new(times, counters);
+}
+
+
+static char PyFB_rlimits__doc__[] =
+"rlimits():\n"
+"returns the limits of all resources at once as a tuple indexed by\n"
+"the const.RLIMIT_* values.  Each item is a (rlim_cur, rlim_max) pair\n"
+"like the return value of getrlimit().";
+
+static PyObject *
+PyFB_rlimits(PyObject *self)
+{
+	struct rlimit rlp;
+	PyObject *r, *t;
+	int resource;
+
+	r = PyTuple_New(RLIM_NLIMITS);
+	if (r == NULL)
+		return NULL;
+
+	for (resource = 0; resource < RLIM_NLIMITS; resource++) {
+		if (getrlimit(resource, &rlp) == -1) {
+			Py_DECREF(r);
+			return OSERROR();
+		}
+
+		t = Py_BuildValue("(NN)",
+			rlp.rlim_cur == RLIM_INFINITY ?
+				(Py_INCREF(Py_None), Py_None) :
+				PyLong_FromLongLong(rlp.rlim_cur),
+			rlp.rlim_max == RLIM_INFINITY ?
+				(Py_INCREF(Py_None), Py_None) :
+				PyLong_FromLongLong(rlp.rlim_max));
+		if (t == NULL) {
+			Py_DECREF(r);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(r, resource, t);
+	}
+
+	return r;
+}
+
+
+/*
+ * Internal helper function to get the CPU clock of the calling thread.
+ * `ident`, if given, must be its thread.get_ident() value: the
+ * pthread_t of any other thread may be stale and pthread_getcpuclockid()
+ * dereferences it, so other threads have to look up their own clock.
+ * The clock id itself can then be read from anywhere (threadclocks).
+ */
+static int
+thread_cpuclock(PyObject *ident, clockid_t *clock)
+{
+	unsigned long key;
+	int err;
+
+	if (ident != NULL && ident != Py_None) {
+		key = PyLong_AsUnsignedLongMask(ident);
+		if (PyErr_Occurred())
+			return -1;
+		if (key != (unsigned long)pthread_self()) {
+			PyErr_SetString(PyExc_ValueError,
+				"only the calling thread's clock is available");
+			return -1;
+		}
+	}
+
+	err = pthread_getcpuclockid(pthread_self(), clock);
+	if (err != 0) {
+		errno = err;
+		OSERROR();
+		return -1;
+	}
+	return 0;
+}
+
+static double
+timespec_todouble(const struct timespec *ts)
+{
+	return (double)ts->tv_sec + (double)ts->tv_nsec / 1e9;
+}
+
+
+static char PyFB_thread_cputime__doc__[] =
+"thread_cputime([ident]):\n"
+"returns the CPU time consumed by the calling thread in seconds.\n"
+"`ident`, if given, must be the thread.get_ident() of the calling\n"
+"thread; use threadclocks to read the clocks of other threads.";
+
+static PyObject *
+PyFB_thread_cputime(PyObject *self, PyObject *args)
+{
+	PyObject *ident = NULL;
+	struct timespec ts;
+	clockid_t clock;
+
+	if (!PyArg_ParseTuple(args, "|O:thread_cputime", &ident))
+		return NULL;
+
+	if (thread_cpuclock(ident, &clock) == -1)
+		return NULL;
+	if (clock_gettime(clock, &ts) == -1)
+		return OSERROR();
+
+	return PyFloat_FromDouble(timespec_todouble(&ts));
+}
+
+
+/* ---------------------------------------------------------------------- */
+/*			    threadclocksobject				  */
+/* ---------------------------------------------------------------------- */
+
+struct threadclock {
+	unsigned long ident;
+	clockid_t clock;
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct threadclock *clocks;
+	int nclocks;
+	int size;
+} threadclocksobject;
+
+static PyTypeObject ThreadClocksType;
+
+static PyObject *
+threadclocks_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	threadclocksobject *self;
+
+	if (!PyArg_ParseTuple(args, ":threadclocks"))
+		return NULL;
+
+	self = (threadclocksobject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	self->clocks = NULL;
+	self->nclocks = self->size = 0;
+	return (PyObject *)self;
+}
+
+static void
+threadclocks_dealloc(threadclocksobject *self)
+{
+	PyMem_Del(self->clocks);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static int
+threadclocks_find(threadclocksobject *self, unsigned long ident)
+{
+	int i;
+
+	for (i = 0; i < self->nclocks; i++)
+		if (self->clocks[i].ident == ident)
+			return i;
+	return -1;
+}
+
+static char threadclocks_register_doc[] =
+"register([ident]):\n"
+"adds the CPU clock of the calling thread to the table, keyed by its\n"
+"thread.get_ident() (which `ident` must match if given).  Each thread\n"
+"registers itself; the table can then be sampled from any thread.";
+
+static PyObject *
+threadclocks_register(threadclocksobject *self, PyObject *args)
+{
+	PyObject *ident = NULL;
+	struct threadclock *tc;
+	clockid_t clock;
+	unsigned long key;
+
+	if (!PyArg_ParseTuple(args, "|O:register", &ident))
+		return NULL;
+
+	if (thread_cpuclock(ident, &clock) == -1)
+		return NULL;
+	key = (unsigned long)pthread_self();
+
+	if (threadclocks_find(self, key) != -1)
+		Py_RETURN_NONE;
+
+	if (self->nclocks == self->size) {
+		int nsize = self->size ? self->size * 2 : 16;
+
+		tc = PyMem_Resize(self->clocks, struct threadclock, nsize);
+		if (tc == NULL)
+			return PyErr_NoMemory();
+		self->clocks = tc;
+		self->size = nsize;
+	}
+
+	tc = &self->clocks[self->nclocks++];
+	tc->ident = key;
+	tc->clock = clock;
+
+	Py_RETURN_NONE;
+}
+
+static char threadclocks_unregister_doc[] =
+"unregister(ident):\n"
+"removes a thread from the table.";
+
+static PyObject *
+threadclocks_unregister(threadclocksobject *self, PyObject *args)
+{
+	PyObject *ident;
+	int i;
+
+	if (!PyArg_ParseTuple(args, "O:unregister", &ident))
+		return NULL;
+
+	i = threadclocks_find(self, PyLong_AsUnsignedLongMask(ident));
+	if (PyErr_Occurred())
+		return NULL;
+	if (i == -1) {
+		PyErr_SetObject(PyExc_KeyError, ident);
+		return NULL;
+	}
+
+	self->clocks[i] = self->clocks[--self->nclocks];
+	Py_RETURN_NONE;
+}
+
+static char threadclocks_sample_doc[] =
+"sample():\n"
+"reads the CPU clocks of all registered threads and returns a list of\n"
+"(ident, cputime) tuples.  Threads that have exited are dropped from\n"
+"the table.";
+
+static PyObject *
+threadclocks_sample(threadclocksobject *self)
+{
+	struct timespec ts;
+	PyObject *r;
+	int i;
+
+	r = PyList_New(0);
+	if (r == NULL)
+		return NULL;
+
+	for (i = 0; i < self->nclocks;) {
+		if (clock_gettime(self->clocks[i].clock, &ts) == -1) {
+			/* the clock id dies with its thread */
+			self->clocks[i] = self->clocks[--self->nclocks];
+			continue;
+		}
+		if (PyList_Append_StealRef(r, Py_BuildValue("(kd)",
+				self->clocks[i].ident,
+				timespec_todouble(&ts))) == -1) {
+			Py_DECREF(r);
+			return NULL;
+		}
+		i++;
+	}
+
+	return r;
+}
+
+static Py_ssize_t
+threadclocks_length(threadclocksobject *self)
+{
+	return self->nclocks;
+}
+
+static PySequenceMethods threadclocks_as_sequence = {
+	sq_length:	(lenfunc)threadclocks_length,
+};
+
+static PyMethodDef threadclocks_methods[] = {
+	{"register", (PyCFunction)threadclocks_register, METH_VARARGS,
+	 threadclocks_register_doc},
+	{"unregister", (PyCFunction)threadclocks_unregister, METH_VARARGS,
+	 threadclocks_unregister_doc},
+	{"sample", (PyCFunction)threadclocks_sample, METH_NOARGS,
+	 threadclocks_sample_doc},
+	{NULL, NULL}
+};
+
+static char threadclocks_doc[] =
+"threadclocks():\n"
+"a table of per-thread CPU clocks (clock_gettime(2) with the clock of\n"
+"pthread_getcpuclockid(3)) keyed by thread.get_ident() values, which\n"
+"can be read in bulk with sample().";
+
+static PyTypeObject ThreadClocksType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"threadclocks",
+	tp_basicsize:	sizeof(threadclocksobject),
+	tp_dealloc:	(destructor)threadclocks_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_as_sequence:	&threadclocks_as_sequence,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	threadclocks_methods,
+	tp_new:		threadclocks_new,
+	tp_doc:		threadclocks_doc,
+};
+
+
+/* ---------------------------------------------------------------------- */
+/*			    resourcespanobject				  */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Named span counters live in a module-level hash table and are never
+ * freed, so a resourcespan can keep a pointer to its counter and does
+ * no lookup on enter and exit.  Thread usage is sampled where
+ * RUSAGE_THREAD exists so that concurrent spans don't see each other.
+ */
+#ifdef RUSAGE_THREAD
+#define SPAN_RUSAGE_WHO RUSAGE_THREAD
+#else
+#define SPAN_RUSAGE_WHO RUSAGE_SELF
+#endif
+
+#define SPAN_NBUCKETS 256
+
+struct span_counter {
+	struct span_counter *next;
+	long hash;
+	char *name;
+	long count;
+	double wall;
+	double times[RUSAGE_NTIMES];
+	long counters[RUSAGE_NCOUNTERS];
+};
+
+static struct span_counter *span_buckets[SPAN_NBUCKETS];
+
+static struct span_counter *
+span_counter_get(PyObject *name)
+{
+	struct span_counter *c;
+	long hash;
+
+	hash = PyObject_Hash(name);
+	if (hash == -1)
+		return NULL;
+
+	for (c = span_buckets[(unsigned long)hash % SPAN_NBUCKETS];
+	     c != NULL; c = c->next)
+		if (c->hash == hash &&
+		    strcmp(c->name, PyString_AS_STRING(name)) == 0)
+			return c;
+
+	c = PyMem_New(struct span_counter, 1);
+	if (c == NULL)
+		return (struct span_counter *)PyErr_NoMemory();
+	memset(c, 0, sizeof(*c));
+	c->name = strdup(PyString_AS_STRING(name));
+	if (c->name == NULL) {
+		PyMem_Del(c);
+		return (struct span_counter *)PyErr_NoMemory();
+	}
+	c->hash = hash;
+	c->next = span_buckets[(unsigned long)hash % SPAN_NBUCKETS];
+	span_buckets[(unsigned long)hash % SPAN_NBUCKETS] = c;
+
+	return c;
+}
+
+/* The start sample of one entry.  Entries are kept on a stack per span
+ * and matched to their exit by thread, so a span can be shared between
+ * threads and nested. */
+struct span_entry {
+	struct span_entry *next;
+	pthread_t thread;
+	struct timespec start;
+	struct rusage rustart;
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct span_counter *counter;
+	struct span_entry *entries;	/* innermost first */
+} resourcespanobject;
+
+static PyTypeObject ResourceSpanType;
+
+static PyObject *
+resourcespan_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	resourcespanobject *self;
+	struct span_counter *counter;
+	PyObject *name;
+
+	if (!PyArg_ParseTuple(args, "S:resourcespan", &name))
+		return NULL;
+
+	counter = span_counter_get(name);
+	if (counter == NULL)
+		return NULL;
+
+	self = (resourcespanobject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	self->counter = counter;
+	self->entries = NULL;
+	return (PyObject *)self;
+}
+
+static void
+resourcespan_dealloc(resourcespanobject *self)
+{
+	struct span_entry *e;
+
+	while ((e = self->entries) != NULL) {
+		self->entries = e->next;
+		PyMem_Del(e);
+	}
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyObject *
+resourcespan_enter(resourcespanobject *self)
+{
+	struct span_entry *e;
+
+	e = PyMem_New(struct span_entry, 1);
+	if (e == NULL)
+		return PyErr_NoMemory();
+
+	if (getrusage(SPAN_RUSAGE_WHO, &e->rustart) == -1 ||
+	    clock_gettime(CLOCK_MONOTONIC, &e->start) == -1) {
+		PyMem_Del(e);
+		return OSERROR();
+	}
+	e->thread = pthread_self();
+	e->next = self->entries;
+	self->entries = e;
+
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+static PyObject *
+resourcespan_exit(resourcespanobject *self, PyObject *args)
+{
+	struct span_counter *c = self->counter;
+	double times0[RUSAGE_NTIMES], times1[RUSAGE_NTIMES];
+	long counters0[RUSAGE_NCOUNTERS], counters1[RUSAGE_NCOUNTERS];
+	struct span_entry *e, **ep;
+	struct timespec now;
+	struct rusage ru;
+	int i;
+
+	if (getrusage(SPAN_RUSAGE_WHO, &ru) == -1 ||
+	    clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		return OSERROR();
+
+	/* the innermost entry of the calling thread */
+	for (ep = &self->entries; *ep != NULL; ep = &(*ep)->next)
+		if (pthread_equal((*ep)->thread, pthread_self()))
+			break;
+	if ((e = *ep) == NULL) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"resourcespan is not entered by this thread");
+		return NULL;
+	}
+	*ep = e->next;
+
+	rusage_unpack(&e->rustart, times0, counters0);
+	rusage_unpack(&ru, times1, counters1);
+
+	c->count++;
+	c->wall += (double)(now.tv_sec - e->start.tv_sec) +
+		   (double)(now.tv_nsec - e->start.tv_nsec) / 1e9;
+	for (i = 0; i < RUSAGE_NTIMES; i++)
+		c->times[i] += times1[i] - times0[i];
+	for (i = 0; i < RUSAGE_NCOUNTERS; i++)
+		if (i != RUSAGE_MAXRSS)
+			c->counters[i] += counters1[i] - counters0[i];
+		else if (counters1[i] > c->counters[i])
+			c->counters[i] = counters1[i];
+	PyMem_Del(e);
+
+	Py_INCREF(Py_False);
+	return Py_False;
+}
+
+static PyMethodDef resourcespan_methods[] = {
+	{"__enter__", (PyCFunction)resourcespan_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)resourcespan_exit, METH_VARARGS, NULL},
+	{NULL, NULL}
+};
+
+static char resourcespan_doc[] =
+"resourcespan(name):\n"
+"a context manager which samples getrusage() and a monotonic clock on\n"
+"enter and exit and adds the differences to the counter named `name`.\n"
+"Span objects are cheap to reuse; create one per code path and enter\n"
+"it as often as needed, also from several threads or nested.  See\n"
+"resourcespan_report().";
+
+static PyTypeObject ResourceSpanType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"resourcespan",
+	tp_basicsize:	sizeof(resourcespanobject),
+	tp_dealloc:	(destructor)resourcespan_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	resourcespan_methods,
+	tp_new:		resourcespan_new,
+	tp_doc:		resourcespan_doc,
+};
+
+
+static char PyFB_resourcespan_report__doc__[] =
+"resourcespan_report([reset]):\n"
+"returns a dict mapping each resourcespan name to a dict of its\n"
+"accumulated count, wall, utime, stime and rusage counters (maxrss is\n"
+"the peak seen).  If `reset` is true, the counters are zeroed.";
+
+static PyObject *
+PyFB_resourcespan_report(PyObject *self, PyObject *args)
+{
+	static const char *names[RUSAGE_NCOUNTERS] = {
+		"maxrss", "ixrss", "idrss", "isrss", "minflt", "majflt",
+		"nswap", "inblock", "oublock", "msgsnd", "msgrcv",
+		"nsignals", "nvcsw", "nivcsw",
+	};
+	struct span_counter *c;
+	PyObject *r, *d;
+	int reset = 0, i, j;
+
+	if (!PyArg_ParseTuple(args, "|i:resourcespan_report", &reset))
+		return NULL;
+
+	r = PyDict_New();
+	if (r == NULL)
+		return NULL;
+
+	for (i = 0; i < SPAN_NBUCKETS; i++)
+		for (c = span_buckets[i]; c != NULL; c = c->next) {
+			d = PyDict_New();
+			if (d == NULL) {
+				Py_DECREF(r);
+				return NULL;
+			}
+			PyDict_SetItemString_StealRef(r, c->name, d);
+
+			SETDICT_INT(d, "count", c->count);
+			SETDICT_DOUBLE(d, "wall", c->wall);
+			SETDICT_DOUBLE(d, "utime", c->times[0]);
+			SETDICT_DOUBLE(d, "stime", c->times[1]);
+			for (j = 0; j < RUSAGE_NCOUNTERS; j++)
+				SETDICT_INT(d, (char *)names[j],
+					    c->counters[j]);
+
+			if (reset) {
+				c->count = 0;
+				c->wall = 0.0;
+				memset(c->times, 0, sizeof(c->times));
+				memset(c->counters, 0, sizeof(c->counters));
+			}
+		}
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(r);
+		return NULL;
+	}
+	return r;
+}
+
+#endif
@@ -27,28 +27,269 @@
  */
 
 #include <sys/uio.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#ifndef IOV_MAX
+#define IOV_MAX UIO_MAXIOV
+#endif
+#endif
+
+EXPCONST_IFAVAIL(int SF_NODISKIO)
+EXPCONST_IFAVAIL(int SF_NOCACHE)
+EXPCONST_IFAVAIL(int SF_SYNC)
+
+/*
+ * A header or trailer vector built from a sequence of buffer-protocol
+ * objects.  The buffers stay acquired, so the iovecs point straight into
+ * the objects' memory without any copying or concatenation.
+ */
+struct sf_iovecs {
+	struct iovec	*iov;
+	Py_buffer	*views;
+	int		 cnt;
+};
+
+static void
+sf_iovecs_release(struct sf_iovecs *v)
+{
+	int i;
+
+	for (i = 0; i < v->cnt; i++)
+		PyBuffer_Release(&v->views[i]);
+	PyMem_Free(v->views);
+	PyMem_Free(v->iov);
+	v->iov = NULL;
+	v->views = NULL;
+	v->cnt = 0;
+}
+
+static int
+sf_iovecs_fill(struct sf_iovecs *v, PyObject *obj, const char *what)
+{
+	PyObject *seq;
+	Py_ssize_t n, i;
+
+	v->iov = NULL;
+	v->views = NULL;
+	v->cnt = 0;
+	if (obj == NULL || obj == Py_None)
+		return 0;
+
+	seq = PySequence_Fast(obj, what);
+	if (seq == NULL)
+		return -1;
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	if (n > IOV_MAX) {
+		PyErr_Format(PyExc_ValueError, "too many %s (max %d)",
+			     what, IOV_MAX);
+		goto error;
+	}
+	if (n == 0) {
+		Py_DECREF(seq);
+		return 0;
+	}
+
+	v->iov = PyMem_New(struct iovec, n);
+	v->views = PyMem_New(Py_buffer, n);
+	if (v->iov == NULL || v->views == NULL) {
+		PyErr_NoMemory();
+		goto error;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i),
+				       &v->views[i], PyBUF_SIMPLE) == -1)
+			goto error;
+		v->cnt++;
+		v->iov[i].iov_base = v->views[i].buf;
+		v->iov[i].iov_len = v->views[i].len;
+	}
+
+	Py_DECREF(seq);
+	return 0;
+
+error:
+	Py_DECREF(seq);
+	sf_iovecs_release(v);
+	return -1;
+}
+
+#ifdef __linux__
+/* Linux has no sf_hdtr; headers and trailers are written with writev(2)
+ * around the file data instead. */
+struct sf_hdtr {
+	struct iovec	*headers;
+	int		 hdr_cnt;
+	struct iovec	*trailers;
+	int		 trl_cnt;
+};
+
+/* Writes out a whole iovec array, adding the bytes written to `sbytes'.
+ * Called without the GIL. */
+static int
+sendfile_writev(int s, const struct iovec *iov, int cnt, off_t *sbytes)
+{
+	struct iovec *v;
+	ssize_t r;
+	int i = 0, res = 0;
+
+	if (cnt == 0)
+		return 0;
+
+	v = malloc(sizeof(struct iovec) * cnt);
+	if (v == NULL)
+		return -1;
+	memcpy(v, iov, sizeof(struct iovec) * cnt);
+
+	while (i < cnt) {
+		r = writev(s, v + i, cnt - i);
+		if (r == -1) {
+			res = -1;
+			break;
+		}
+		*sbytes += r;
+		for (; i < cnt && (size_t)r >= v[i].iov_len; i++)
+			r -= v[i].iov_len;
+		if (i < cnt) {
+			v[i].iov_base = (char *)v[i].iov_base + r;
+			v[i].iov_len -= r;
+		}
+	}
+
+	free(v);
+	return res;
+}
+
+/*
+ * Emulates the FreeBSD sendfile(2) interface on top of the Linux one:
+ * headers, file data up to `nbytes' (or EOF if 0) and trailers are sent
+ * in order, -1 is returned with errno set if it stops early, and
+ * `sbytes' always holds the number of bytes that went out.
+ */
+static int
+sendfile_linux(int fd, int s, off_t offset, size_t nbytes,
+	       struct sf_hdtr *hdtr, off_t *sbytes)
+{
+	struct stat st;
+	ssize_t r;
+
+	if (hdtr != NULL &&
+	    sendfile_writev(s, hdtr->headers, hdtr->hdr_cnt, sbytes) == -1)
+		return -1;
+
+	if (nbytes == 0) {
+		if (fstat(fd, &st) == -1)
+			return -1;
+		nbytes = st.st_size > offset ? st.st_size - offset : 0;
+	}
+
+	while (nbytes > 0) {
+		r = sendfile(s, fd, &offset, nbytes);
+		if (r == -1)
+			return -1;
+		if (r == 0)	/* end of file */
+			break;
+		*sbytes += r;
+		nbytes -= r;
+	}
+
+	if (hdtr != NULL &&
+	    sendfile_writev(s, hdtr->trailers, hdtr->trl_cnt, sbytes) == -1)
+		return -1;
+
+	return 0;
+}
+#endif
+
+/*
+ * Calls sendfile(2) with the GIL released.  Returns 0 when the whole
+ * request went out, 1 when the call stopped early but can be resumed
+ * (EAGAIN on a non-blocking socket, EINTR after some data was sent,
+ * or EBUSY with SF_NODISKIO, even when nothing was sent because the
+ * first page still has to come from disk), and -1 with errno set on
+ * failure.  The number of bytes sent, headers included, is stored in
+ * `sbytes'.
+ */
+static int
+sendfile_once(int fd, int s, off_t offset, size_t nbytes,
+	      struct sf_hdtr *hdtr, int flags, off_t *sbytes)
+{
+	int res;
+
+	*sbytes = 0;
+	Py_BEGIN_ALLOW_THREADS
+#ifdef __linux__
+	res = sendfile_linux(fd, s, offset, nbytes, hdtr, sbytes);
+#else
+	res = sendfile(fd, s, offset, nbytes, hdtr, sbytes, flags);
+#endif
+	Py_END_ALLOW_THREADS
+
+	if (res == 0)
+		return 0;
+	if (errno == EAGAIN || errno == EBUSY ||
+	    (errno == EINTR && *sbytes > 0))
+		return 1;
+	return -1;
+}
 
-/* TODO: headers and trailers are not supported yet. */
 static char PyFB_sendfile__doc__[] =
-"sendfile(fd, s, offset, nbytes[, headers, tailers]):\n"
+"sendfile(fd, s, offset, nbytes[, headers, trailers, flags]):\n"
 "sends a regular file specified by descriptor `fd` out a stream\n"
-"socket specified by descriptor `s`.";
+"socket specified by descriptor `s`, starting at `offset`.  An\n"
+"`nbytes` of 0 sends up to the end of the file.  `headers` and\n"
+"`trailers` are sequences of buffer objects written before and after\n"
+"the file data, and `flags` is a combination of const.SF_*\n"
+"(ignored on Linux, where headers and trailers are sent with writev).\n"
+"returns a (sent, eagain) tuple; `sent` counts header bytes too and\n"
+"`eagain` is True when the call stopped early and should be resumed,\n"
+"which with const.SF_NODISKIO includes (0, True) when the file data\n"
+"is not in memory yet.";
 
 static PyObject *
 PyFB_sendfile(PyObject *self, PyObject *args)
 {
-	int fd, s, res;
-	off_t offset, sbytes;
-	size_t nbytes;
-	PyObject *headers = NULL, *tailers = NULL;
+	int fd, s, flags = 0, res;
+	long long offset, nbytes;
+	off_t sbytes;
+	PyObject *headers = NULL, *trailers = NULL;
+	struct sf_iovecs hv, tv;
+	struct sf_hdtr hdtr;
+
+	if (!PyArg_ParseTuple(args, "iiLL|OOi:sendfile", &fd, &s, &offset,
+			      &nbytes, &headers, &trailers, &flags))
+		return NULL;
 
-	if (!PyArg_ParseTuple(args, "iill|OO:sendfile", &fd, &s, &offset,
-			      &nbytes, &headers, &tailers))
+	if (offset < 0 || nbytes < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"offset and nbytes must not be negative");
 		return NULL;
+	}
+
+	if (sf_iovecs_fill(&hv, headers, "headers") == -1)
+		return NULL;
+	if (sf_iovecs_fill(&tv, trailers, "trailers") == -1) {
+		sf_iovecs_release(&hv);
+		return NULL;
+	}
+
+	hdtr.headers = hv.iov;
+	hdtr.hdr_cnt = hv.cnt;
+	hdtr.trailers = tv.iov;
+	hdtr.trl_cnt = tv.cnt;
+
+	res = sendfile_once(fd, s, (off_t)offset, (size_t)nbytes,
+			    (hv.cnt || tv.cnt) ? &hdtr : NULL, flags,
+			    &sbytes);
+
+	sf_iovecs_release(&hv);
+	sf_iovecs_release(&tv);
 
-	res = sendfile(fd, s, offset, nbytes, NULL, &sbytes, 0);
-	if (res == -1 && errno != EAGAIN)
+	if (res == -1)
 		return OSERROR();
 
-	return PyInt_FromLong(sbytes);
+	return Py_BuildValue("(LN)", (long long)sbytes, PyBool_FromLong(res));
 }
@@ -0,0 +1,542 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifdef __FreeBSD__
+
+#include <pthread.h>
+
+#if __FreeBSD_version >= 900000
+/* Types */
+DECLTYPE(FileStreamerType, filestreamerobject)
+
+#define FSTREAM_READAHEAD	(256 * 1024)
+#define FSTREAM_MAXEVENTS	64
+
+/* ---------------------------------------------------------------------- */
+/*			      filestreamerobject			  */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * A job stays on the streamer's job list until it is finished or
+ * cancelled.  While `busy' is set it also sits on the readahead queue
+ * and its socket is disabled in the kqueue; only the readahead thread
+ * may touch it then, and only the main thread ever frees it.
+ */
+struct fstream_job {
+	struct fstream_job *next;	/* job list */
+	struct fstream_job *qnext;	/* readahead queue / done list */
+	int fd, s;
+	off_t offset;
+	off_t remaining;		/* -1 to send up to EOF */
+	Py_buffer header;
+	int hasheader;
+	size_t hdrsent;
+	long long sent;
+	int busy;
+	int cancelled;
+};
+
+typedef struct {
+	PyObject_HEAD
+	kqueueobject *kq;
+	struct fstream_job *jobs;
+	int njobs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t ra_thread;
+	int ra_running;
+	int ra_quit;
+	struct fstream_job *ra_queue;	/* protected by lock */
+	struct fstream_job *ra_done;	/* protected by lock */
+} filestreamerobject;
+
+static PyTypeObject FileStreamerType;
+
+/* Pages the next chunk of each queued job into the buffer cache, then
+ * hands the job back and wakes up the kqueue with EVFILT_USER. */
+static void *
+filestreamer_readahead(void *arg)
+{
+	filestreamerobject *fs = arg;
+	struct fstream_job *job;
+	struct kevent ev;
+	off_t len;
+	ssize_t r;
+	char *buf;
+
+	buf = malloc(FSTREAM_READAHEAD);
+
+	pthread_mutex_lock(&fs->lock);
+	for (;;) {
+		while (fs->ra_queue == NULL && !fs->ra_quit)
+			pthread_cond_wait(&fs->cond, &fs->lock);
+		if (fs->ra_quit)
+			break;
+
+		job = fs->ra_queue;
+		fs->ra_queue = job->qnext;
+		pthread_mutex_unlock(&fs->lock);
+
+		len = FSTREAM_READAHEAD;
+		if (job->remaining >= 0 && job->remaining < len)
+			len = job->remaining;
+		if (buf != NULL)
+			do
+				r = pread(job->fd, buf, len, job->offset);
+			while (r == -1 && errno == EINTR);
+
+		pthread_mutex_lock(&fs->lock);
+		job->qnext = fs->ra_done;
+		fs->ra_done = job;
+		EV_SET(&ev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+		kevent(fs->kq->fd, &ev, 1, NULL, 0, NULL);
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	free(buf);
+	return NULL;
+}
+
+static PyObject *
+filestreamer_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	filestreamerobject *fs;
+	struct kevent ev;
+
+	if (!PyArg_ParseTuple(args, ":filestreamer"))
+		return NULL;
+
+	fs = (filestreamerobject *)type->tp_alloc(type, 0);
+	if (fs == NULL)
+		return NULL;
+
+	fs->jobs = NULL;
+	fs->njobs = 0;
+	fs->ra_running = 0;
+	fs->ra_quit = 0;
+	fs->ra_queue = fs->ra_done = NULL;
+	pthread_mutex_init(&fs->lock, NULL);
+	pthread_cond_init(&fs->cond, NULL);
+
+	fs->kq = (kqueueobject *)PyObject_CallObject(
+			(PyObject *)&KQueueType, NULL);
+	if (fs->kq == NULL) {
+		Py_DECREF(fs);
+		return NULL;
+	}
+
+	EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(fs->kq->fd, &ev, 1, NULL, 0, NULL) == -1) {
+		Py_DECREF(fs);
+		return OSERROR();
+	}
+
+	return (PyObject *)fs;
+}
+
+static void
+filestreamer_freejob(struct fstream_job *job)
+{
+	if (job->hasheader)
+		PyBuffer_Release(&job->header);
+	PyMem_Free(job);
+}
+
+/* Drops a job's kevent registration and unlinks and frees it, unless
+ * the readahead thread still owns it; filestreamer_reap() frees it then. */
+static void
+filestreamer_dropjob(filestreamerobject *self, struct fstream_job *job)
+{
+	struct fstream_job **p;
+	struct kevent ev;
+
+	EV_SET(&ev, job->s, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	kevent(self->kq->fd, &ev, 1, NULL, 0, NULL);
+
+	if (!job->cancelled) {
+		job->cancelled = 1;
+		self->njobs--;
+	}
+	if (job->busy)
+		return;
+
+	for (p = &self->jobs; *p != NULL; p = &(*p)->next)
+		if (*p == job) {
+			*p = job->next;
+			break;
+		}
+	filestreamer_freejob(job);
+}
+
+static void
+filestreamer_dealloc(filestreamerobject *self)
+{
+	struct fstream_job *job, *next;
+
+	if (self->ra_running) {
+		pthread_mutex_lock(&self->lock);
+		self->ra_quit = 1;
+		pthread_cond_signal(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+		Py_BEGIN_ALLOW_THREADS
+		pthread_join(self->ra_thread, NULL);
+		Py_END_ALLOW_THREADS
+	}
+
+	for (job = self->jobs; job != NULL; job = next) {
+		next = job->next;
+		filestreamer_freejob(job);
+	}
+
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	Py_XDECREF(self->kq);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static char filestreamer_add_doc[] =
+"add(fd, s, offset, length[, header]):\n"
+"queues `length` bytes of file descriptor `fd` starting at `offset`\n"
+"to be sent out socket `s`, preceded by the buffer object `header`.\n"
+"A `length` of 0 sends up to the end of the file.  `s` should be\n"
+"non-blocking and may only have one job at a time.";
+
+static PyObject *
+filestreamer_add(filestreamerobject *self, PyObject *args)
+{
+	struct fstream_job *job;
+	struct kevent ev;
+	PyObject *header = NULL;
+	long long offset, length;
+	int fd, s;
+
+	if (!PyArg_ParseTuple(args, "iiLL|O:add", &fd, &s, &offset, &length,
+			      &header))
+		return NULL;
+
+	if (offset < 0 || length < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"offset and length must not be negative");
+		return NULL;
+	}
+
+	for (job = self->jobs; job != NULL; job = job->next)
+		if (job->s == s && !job->cancelled) {
+			PyErr_Format(PyExc_ValueError,
+				     "socket %d already has a job", s);
+			return NULL;
+		}
+
+	job = PyMem_New(struct fstream_job, 1);
+	if (job == NULL)
+		return PyErr_NoMemory();
+
+	memset(job, 0, sizeof(*job));
+	job->fd = fd;
+	job->s = s;
+	job->offset = (off_t)offset;
+	job->remaining = length > 0 ? (off_t)length : -1;
+	if (header != NULL && header != Py_None) {
+		if (PyObject_GetBuffer(header, &job->header,
+				       PyBUF_SIMPLE) == -1) {
+			PyMem_Free(job);
+			return NULL;
+		}
+		job->hasheader = 1;
+	}
+
+	EV_SET(&ev, s, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, job);
+	if (kevent(self->kq->fd, &ev, 1, NULL, 0, NULL) == -1) {
+		filestreamer_freejob(job);
+		return OSERROR();
+	}
+
+	job->next = self->jobs;
+	self->jobs = job;
+	self->njobs++;
+
+	Py_RETURN_NONE;
+}
+
+static char filestreamer_cancel_doc[] =
+"cancel(s):\n"
+"drops the job of socket `s`.  returns False if there was none.";
+
+static PyObject *
+filestreamer_cancel(filestreamerobject *self, PyObject *args)
+{
+	struct fstream_job *job;
+	int s;
+
+	if (!PyArg_ParseTuple(args, "i:cancel", &s))
+		return NULL;
+
+	for (job = self->jobs; job != NULL; job = job->next)
+		if (job->s == s && !job->cancelled) {
+			filestreamer_dropjob(self, job);
+			Py_RETURN_TRUE;
+		}
+
+	Py_RETURN_FALSE;
+}
+
+/* Hands a job whose data is not resident to the readahead thread. */
+static int
+filestreamer_readahead_job(filestreamerobject *self, struct fstream_job *job)
+{
+	struct fstream_job **p;
+	struct kevent ev;
+	int err;
+
+	if (!self->ra_running) {
+		err = pthread_create(&self->ra_thread, NULL,
+				     filestreamer_readahead, self);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+		self->ra_running = 1;
+	}
+
+	EV_SET(&ev, job->s, EVFILT_WRITE, EV_DISABLE, 0, 0, job);
+	if (kevent(self->kq->fd, &ev, 1, NULL, 0, NULL) == -1)
+		return -1;
+
+	job->busy = 1;
+	job->qnext = NULL;
+	pthread_mutex_lock(&self->lock);
+	for (p = &self->ra_queue; *p != NULL; p = &(*p)->qnext)
+		;
+	*p = job;
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	return 0;
+}
+
+/* Takes back the jobs the readahead thread is done with. */
+static void
+filestreamer_reap(filestreamerobject *self)
+{
+	struct fstream_job *job, *next;
+	struct kevent ev;
+
+	pthread_mutex_lock(&self->lock);
+	job = self->ra_done;
+	self->ra_done = NULL;
+	pthread_mutex_unlock(&self->lock);
+
+	for (; job != NULL; job = next) {
+		next = job->qnext;
+		job->busy = 0;
+		if (job->cancelled) {
+			filestreamer_dropjob(self, job);
+			continue;
+		}
+		EV_SET(&ev, job->s, EVFILT_WRITE, EV_ENABLE, 0, 0, job);
+		kevent(self->kq->fd, &ev, 1, NULL, 0, NULL);
+	}
+}
+
+/* Pushes as much of a job as the socket takes.  returns 1 when the job
+ * is finished, 0 when it should be resumed later and -1 on failure. */
+static int
+filestreamer_push(filestreamerobject *self, struct fstream_job *job)
+{
+	struct sf_hdtr hdtr;
+	struct iovec hiov;
+	off_t sbytes, fbytes;
+	size_t hleft = 0;
+	int r;
+
+	if (job->hasheader) {
+		hleft = job->header.len - job->hdrsent;
+		hiov.iov_base = (char *)job->header.buf + job->hdrsent;
+		hiov.iov_len = hleft;
+		hdtr.headers = &hiov;
+		hdtr.hdr_cnt = 1;
+		hdtr.trailers = NULL;
+		hdtr.trl_cnt = 0;
+	}
+
+	/* A resumed partial send can leave nothing to go; an nbytes of 0
+	 * would make sendfile(2) run on to EOF, so it means -1 only. */
+	if (job->remaining == 0 && hleft == 0)
+		return 1;
+
+	r = sendfile_once(job->fd, job->s, job->offset,
+			  job->remaining == -1 ? 0 : (size_t)job->remaining,
+			  hleft > 0 ? &hdtr : NULL, SF_NODISKIO, &sbytes);
+
+	job->sent += sbytes;
+	if ((size_t)sbytes >= hleft) {
+		job->hdrsent += hleft;
+		fbytes = sbytes - hleft;
+	}
+	else {
+		job->hdrsent += sbytes;
+		fbytes = 0;
+	}
+	job->offset += fbytes;
+	if (job->remaining > 0)
+		job->remaining -= fbytes;
+
+	if (r == 0)
+		return 1;
+	if (errno == EBUSY)
+		return filestreamer_readahead_job(self, job);
+	if (r == 1)
+		return 0;
+	return -1;
+}
+
+static char filestreamer_poll_doc[] =
+"poll([timeout, nevents]):\n"
+"waits up to `timeout` seconds (forever if negative) for sockets to\n"
+"become writable and pushes file data out of them with sendfile(2)\n"
+"and SF_NODISKIO, reading ahead in a helper thread when the data is\n"
+"not cached.  returns a list of (s, sent, error) tuples for the jobs\n"
+"that finished, where `error` is None or an OSError instance.";
+
+static PyObject *
+filestreamer_poll(filestreamerobject *self, PyObject *args)
+{
+	struct kevent events[FSTREAM_MAXEVENTS];
+	struct timespec ts, *tsp;
+	struct fstream_job *job;
+	PyObject *r, *err;
+	double timeout = -1.0;
+	int nevents = FSTREAM_MAXEVENTS, n, i, res;
+
+	if (!PyArg_ParseTuple(args, "|di:poll", &timeout, &nevents))
+		return NULL;
+
+	if (nevents < 1 || nevents > FSTREAM_MAXEVENTS)
+		nevents = FSTREAM_MAXEVENTS;
+
+	r = PyList_New(0);
+	if (r == NULL || self->jobs == NULL)
+		return r;
+
+	if (timeout >= 0) {
+		ts.tv_sec = (time_t)timeout;
+		ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1e9);
+		tsp = &ts;
+	}
+	else
+		tsp = NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	n = kevent(self->kq->fd, NULL, 0, events, nevents, tsp);
+	Py_END_ALLOW_THREADS
+
+	if (n == -1) {
+		Py_DECREF(r);
+		return OSERROR();
+	}
+
+	for (i = 0; i < n; i++) {
+		if (events[i].filter == EVFILT_USER) {
+			filestreamer_reap(self);
+			continue;
+		}
+
+		job = (struct fstream_job *)events[i].udata;
+		if (job->busy || job->cancelled)
+			continue;
+
+		res = filestreamer_push(self, job);
+		if (res == 0)
+			continue;
+
+		if (res == -1)
+			err = oserror_fromerrno(errno);
+		else {
+			Py_INCREF(Py_None);
+			err = Py_None;
+		}
+		if (PyList_Append_StealRef(r, Py_BuildValue("(iLN)",
+				job->s, job->sent, err)) == -1) {
+			Py_DECREF(r);
+			return NULL;
+		}
+		filestreamer_dropjob(self, job);
+	}
+
+	return r;
+}
+
+static Py_ssize_t
+filestreamer_length(filestreamerobject *self)
+{
+	return self->njobs;
+}
+
+static PySequenceMethods filestreamer_as_sequence = {
+	sq_length:	(lenfunc)filestreamer_length,
+};
+
+static PyMemberDef filestreamer_members[] = {
+	{"kqueue", T_OBJECT, offsetof(filestreamerobject, kq), READONLY,
+	 "internal kqueue; its descriptor becomes readable when poll()\n"
+	 "has work to do."},
+	{NULL}
+};
+
+static PyMethodDef filestreamer_methods[] = {
+	{"add", (PyCFunction)filestreamer_add, METH_VARARGS,
+	 filestreamer_add_doc},
+	{"cancel", (PyCFunction)filestreamer_cancel, METH_VARARGS,
+	 filestreamer_cancel_doc},
+	{"poll", (PyCFunction)filestreamer_poll, METH_VARARGS,
+	 filestreamer_poll_doc},
+	{NULL, NULL}
+};
+
+static char filestreamer_doc[] =
+"filestreamer():\n"
+"streams files out of sockets with sendfile(2) without returning to\n"
+"Python for partial writes.  Jobs are added with add() and driven by\n"
+"poll(), which reports finished jobs in batches.";
+
+static PyTypeObject FileStreamerType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"filestreamer",
+	tp_basicsize:	sizeof(filestreamerobject),
+	tp_dealloc:	(destructor)filestreamer_dealloc,
+	tp_as_sequence:	&filestreamer_as_sequence,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	filestreamer_methods,
+	tp_members:	filestreamer_members,
+	tp_new:		filestreamer_new,
+	tp_doc:		filestreamer_doc,
+};
+#endif
+
+#endif
@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <sys/mount.h>
 
 EXPCONST(int MNT_RDONLY)
@@ -54,7 +56,13 @@ PyObject_FromStatfs(struct statfs *buf)
 	PyObject *r, *fsid;
 
 	r = PyDict_New();
+	if (r == NULL)
+		return NULL;
 	fsid = PyTuple_New(2);
+	if (fsid == NULL) {
+		Py_DECREF(r);
+		return NULL;
+	}
 
 	SETDICT_INT(r, "bsize", buf->f_bsize);
 	SETDICT_INT(r, "iosize", buf->f_iosize);
@@ -92,11 +100,16 @@ PyFB_statfs(PyObject *self, PyObject *args)
 {
 	struct statfs buf;
 	char *path;
+	int r;
 
 	if (!PyArg_ParseTuple(args, "s:statfs", &path))
 		return NULL;
 
-	if (statfs(path, &buf) == -1)
+	Py_BEGIN_ALLOW_THREADS
+	r = statfs(path, &buf);
+	Py_END_ALLOW_THREADS
+
+	if (r == -1)
 		return OSERROR();
 	return PyObject_FromStatfs(&buf);
 }
@@ -111,17 +124,98 @@ static PyObject *
 PyFB_fstatfs(PyObject *self, PyObject *args)
 {
 	struct statfs buf;
-	int fd;
+	int fd, r;
 
 	if (!PyArg_ParseTuple(args, "i:fstatfs", &fd))
 		return NULL;
 
-	if (fstatfs(fd, &buf) == -1)
+	Py_BEGIN_ALLOW_THREADS
+	r = fstatfs(fd, &buf);
+	Py_END_ALLOW_THREADS
+
+	if (r == -1)
 		return OSERROR();
 	return PyObject_FromStatfs(&buf);
 }
 
 
+/*
+ * The getfsstat(2) buffer is kept around between calls and is only grown
+ * when the number of mounted file systems grows.  An fsstatiter borrows
+ * the buffer while it is alive and hands it back when it is deallocated.
+ */
+#define FSID_EQ(a, b)							\
+	((a).val[0] == (b).val[0] && (a).val[1] == (b).val[1])
+
+static struct statfs *fsstat_cache = NULL;
+static int fsstat_cachesize = 0;
+
+static void
+fsstat_releasebuf(struct statfs *buf, int size)
+{
+	if (fsstat_cache != NULL && fsstat_cachesize >= size)
+		PyMem_Del(buf);
+	else {
+		PyMem_Del(fsstat_cache);
+		fsstat_cache = buf;
+		fsstat_cachesize = size;
+	}
+}
+
+/* Internal helper function to fill the (borrowed) statfs buffer */
+static int
+fsstat_fill(int flags, struct statfs **bufp, int *sizep)
+{
+	struct statfs *buf;
+	int size, nsize, n;
+
+	buf = fsstat_cache;
+	size = fsstat_cachesize;
+	fsstat_cache = NULL;
+	fsstat_cachesize = 0;
+
+	for (;;) {
+		if (size > 0) {
+			Py_BEGIN_ALLOW_THREADS
+			n = getfsstat(buf, (long)size * sizeof(struct statfs),
+				      flags);
+			Py_END_ALLOW_THREADS
+			if (n == -1)
+				goto error;
+			/* a full buffer may have been truncated */
+			if (n < size)
+				break;
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+		n = getfsstat(NULL, 0, flags);
+		Py_END_ALLOW_THREADS
+		if (n == -1)
+			goto error;
+
+		nsize = n + n / 4 + 4;
+		if (nsize <= size)
+			nsize = size * 2;
+		PyMem_Del(buf);
+		buf = PyMem_New(struct statfs, nsize);
+		if (buf == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		size = nsize;
+	}
+
+	*bufp = buf;
+	*sizep = size;
+	return n;
+
+error:
+	OSERROR();
+	fsstat_releasebuf(buf, size);
+	return -1;
+}
+
+
 static char PyFB_getfsstat__doc__[] =
 "getfsstat(flags):\n"
 "returns information about all mounted file systems.";
@@ -131,30 +225,222 @@ static PyObject *
 PyFB_getfsstat(PyObject *self, PyObject *args)
 {
 	struct statfs *buf;
-	int flags, nbufs, i;
-	PyObject *r;
+	int flags, nbufs, size, i;
+	PyObject *r, *m;
 
 	if (!PyArg_ParseTuple(args, "i:getfsstat", &flags))
 		return NULL;
 
-	nbufs = getfsstat(NULL, 0, flags);
+	nbufs = fsstat_fill(flags, &buf, &size);
 	if (nbufs == -1)
-		return OSERROR();
-	else if (nbufs == 0)
-		return PyList_New(0);
-
-	buf = PyMem_New(struct statfs, nbufs);
-
-	nbufs = getfsstat(buf, nbufs * sizeof(struct statfs), flags);
-	if (nbufs == -1) {
-		PyMem_Del(buf);
-		return OSERROR();
-	}
+		return NULL;
 
 	r = PyList_New(nbufs);
-	for (i = 0; i < nbufs; i++)
-		PyList_SET_ITEM(r, i, PyObject_FromStatfs(&buf[i]));
-	PyMem_Del(buf);
+	for (i = 0; r != NULL && i < nbufs; i++) {
+		m = PyObject_FromStatfs(&buf[i]);
+		if (m == NULL) {
+			Py_DECREF(r);
+			r = NULL;
+		}
+		else
+			PyList_SET_ITEM(r, i, m);
+	}
+	fsstat_releasebuf(buf, size);
 
 	return r;
 }
+
+
+#if __FreeBSD_version >= 600000
+/* Types */
+DECLTYPE(StatfsEntryType, statfsobject)
+DECLTYPE(FSStatIterType, fsstatiterobject)
+
+/* ---------------------------------------------------------------------- */
+/*				statfsobject				  */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * A statfsentry wraps a copy of one struct statfs and converts fields to
+ * Python objects only when they are accessed.
+ */
+typedef struct {
+	PyObject_HEAD
+	struct statfs f;
+} statfsobject;
+
+static PyTypeObject StatfsEntryType;
+
+static PyObject *
+statfsentry_get_fsid(statfsobject *self, void *closure)
+{
+	return Py_BuildValue("(ii)", (int)self->f.f_fsid.val[0],
+			     (int)self->f.f_fsid.val[1]);
+}
+
+static PyObject *
+statfsentry_repr(statfsobject *self)
+{
+	return PyString_FromFormat("<statfsentry mntonname=%s fstypename=%s>",
+				   self->f.f_mntonname, self->f.f_fstypename);
+}
+
+#define OFF(x) offsetof(statfsobject, f.f_##x)
+static struct PyMemberDef statfsentry_memberlist[] = {
+	{"bsize",	T_ULONGLONG,	OFF(bsize),	READONLY,
+	 "Filesystem fragment size."},
+	{"iosize",	T_ULONGLONG,	OFF(iosize),	READONLY,
+	 "Optimal transfer block size."},
+	{"blocks",	T_ULONGLONG,	OFF(blocks),	READONLY,
+	 "Total data blocks in filesystem."},
+	{"bfree",	T_ULONGLONG,	OFF(bfree),	READONLY,
+	 "Free blocks in filesystem."},
+	{"bavail",	T_LONGLONG,	OFF(bavail),	READONLY,
+	 "Free blocks avail to non-superuser."},
+	{"files",	T_ULONGLONG,	OFF(files),	READONLY,
+	 "Total file nodes in filesystem."},
+	{"ffree",	T_LONGLONG,	OFF(ffree),	READONLY,
+	 "Free nodes avail to non-superuser."},
+	{"owner",	T_UINT,		OFF(owner),	READONLY,
+	 "User that mounted the filesystem."},
+	{"type",	T_UINT,		OFF(type),	READONLY,
+	 "Type of filesystem."},
+	{"flags",	T_ULONGLONG,	OFF(flags),	READONLY,
+	 "Copy of mount exported flags."},
+	{"syncwrites",	T_ULONGLONG,	OFF(syncwrites), READONLY,
+	 "Count of sync writes since mount."},
+	{"asyncwrites",	T_ULONGLONG,	OFF(asyncwrites), READONLY,
+	 "Count of async writes since mount."},
+	{"syncreads",	T_ULONGLONG,	OFF(syncreads),	READONLY,
+	 "Count of sync reads since mount."},
+	{"asyncreads",	T_ULONGLONG,	OFF(asyncreads), READONLY,
+	 "Count of async reads since mount."},
+	{"fstypename",	T_STRING_INPLACE, OFF(fstypename), READONLY,
+	 "Filesystem type name."},
+	{"mntonname",	T_STRING_INPLACE, OFF(mntonname), READONLY,
+	 "Directory on which mounted."},
+	{"mntfromname",	T_STRING_INPLACE, OFF(mntfromname), READONLY,
+	 "Mounted filesystem."},
+	{NULL}	/* sentinel */
+};
+#undef OFF
+
+static PyGetSetDef statfsentry_getsetlist[] = {
+	{"fsid", (getter)statfsentry_get_fsid, NULL,
+	 "Filesystem id as a tuple of two integers."},
+	{NULL}	/* sentinel */
+};
+
+static char statfsentry_doc[] =
+"statfsentry:\n"
+"information about a mounted file system as returned by iterfsstat().";
+
+static PyTypeObject StatfsEntryType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"statfsentry",
+	tp_basicsize:	sizeof(statfsobject),
+	tp_dealloc:	(destructor)PyObject_Del,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_repr:	(reprfunc)statfsentry_repr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_members:	statfsentry_memberlist,
+	tp_getset:	statfsentry_getsetlist,
+	tp_doc:		statfsentry_doc,
+};
+
+
+/* ---------------------------------------------------------------------- */
+/*				fsstatiterobject			  */
+/* ---------------------------------------------------------------------- */
+
+typedef struct {
+	PyObject_HEAD
+	struct statfs *buf;
+	int size;
+	int count;
+	int pos;
+} fsstatiterobject;
+
+static PyTypeObject FSStatIterType;
+
+static void
+fsstatiter_dealloc(fsstatiterobject *self)
+{
+	if (self->buf != NULL)
+		fsstat_releasebuf(self->buf, self->size);
+	PyObject_Del(self);
+}
+
+static PyObject *
+fsstatiter_next(fsstatiterobject *self)
+{
+	statfsobject *entry;
+
+	if (self->pos >= self->count)
+		return NULL;
+
+	entry = PyObject_New(statfsobject, &StatfsEntryType);
+	if (entry == NULL)
+		return NULL;
+	memcpy(&entry->f, &self->buf[self->pos++], sizeof(struct statfs));
+
+	return (PyObject *)entry;
+}
+
+static PyObject *
+fsstatiter_len(fsstatiterobject *self)
+{
+	return PyInt_FromLong(self->count - self->pos);
+}
+
+static PyMethodDef fsstatiter_methods[] = {
+	{"__length_hint__", (PyCFunction)fsstatiter_len, METH_NOARGS, NULL},
+	{NULL, NULL}
+};
+
+static PyTypeObject FSStatIterType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"fsstatiter",
+	tp_basicsize:	sizeof(fsstatiterobject),
+	tp_dealloc:	(destructor)fsstatiter_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_iter:	PyObject_SelfIter,
+	tp_iternext:	(iternextfunc)fsstatiter_next,
+	tp_methods:	fsstatiter_methods,
+};
+
+
+static char PyFB_iterfsstat__doc__[] =
+"iterfsstat(flags):\n"
+"returns an iterator over all mounted file systems like getfsstat(),\n"
+"but yields statfsentry objects whose fields are only converted when\n"
+"they are accessed.  The statfs buffer is reused between calls.";
+
+static PyObject *
+PyFB_iterfsstat(PyObject *self, PyObject *args)
+{
+	fsstatiterobject *it;
+	int flags;
+
+	if (!PyArg_ParseTuple(args, "i:iterfsstat", &flags))
+		return NULL;
+
+	it = PyObject_New(fsstatiterobject, &FSStatIterType);
+	if (it == NULL)
+		return NULL;
+
+	it->buf = NULL;
+	it->pos = 0;
+	it->count = fsstat_fill(flags, &it->buf, &it->size);
+	if (it->count == -1) {
+		it->buf = NULL;
+		Py_DECREF(it);
+		return NULL;
+	}
+
+	return (PyObject *)it;
+}
+#endif
+
+#endif
@@ -0,0 +1,278 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifdef __FreeBSD__
+
+#if __FreeBSD_version >= 600000
+/* Types */
+DECLTYPE(FSMonitorType, fsmonitorobject)
+
+static char *fsmonitorkwlist[] = {
+	"minfree", "minfiles", "delta", "fdelta", NULL,
+};
+
+/* ---------------------------------------------------------------------- */
+/*				fsmonitorobject				  */
+/* ---------------------------------------------------------------------- */
+
+struct fsmon_entry {
+	struct statfs last;	/* last reported state */
+	int low_blocks;
+	int low_files;
+	int seen;
+};
+
+typedef struct {
+	PyObject_HEAD
+	double minfree;		/* percentage of blocks available */
+	double minfiles;	/* percentage of file nodes available */
+	long long delta;	/* bytes */
+	long long fdelta;	/* file nodes */
+	struct fsmon_entry *entries;
+	int nentries;
+	int sampled;
+} fsmonitorobject;
+
+static PyTypeObject FSMonitorType;
+
+static PyObject *
+fsmonitor_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	fsmonitorobject *mon;
+
+	mon = (fsmonitorobject *)type->tp_alloc(type, 0);
+	if (mon == NULL)
+		return NULL;
+
+	mon->minfree = 10.0;
+	mon->minfiles = 10.0;
+	mon->delta = 0;
+	mon->fdelta = 0;
+	mon->entries = NULL;
+	mon->nentries = 0;
+	mon->sampled = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|ddLL:fsmonitor",
+			fsmonitorkwlist, &mon->minfree, &mon->minfiles,
+			&mon->delta, &mon->fdelta)) {
+		Py_DECREF(mon);
+		return NULL;
+	}
+
+	return (PyObject *)mon;
+}
+
+static void
+fsmonitor_dealloc(fsmonitorobject *self)
+{
+	PyMem_Del(self->entries);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static int
+fsmonitor_below(int64_t avail, uint64_t total, double pct)
+{
+	if (total == 0)
+		return 0;
+	return ((double)avail * 100.0 / (double)total) < pct;
+}
+
+static int
+fsmonitor_report(PyObject *events, const char *event, struct statfs *sfs)
+{
+	PyObject *d;
+
+	d = PyObject_FromStatfs(sfs);
+	if (d == NULL)
+		return -1;
+	return PyList_Append_StealRef(events, Py_BuildValue("(sN)", event, d));
+}
+
+static char fsmonitor_sample_doc[] =
+"sample():\n"
+"samples all mounted file systems with const.MNT_NOWAIT and returns a\n"
+"list of (event, statfs) tuples for the mounts that need attention.\n"
+"`event` is one of 'mounted', 'unmounted', 'low' (free blocks or file\n"
+"nodes fell below the thresholds), 'recovered' or 'changed' (free space\n"
+"moved by more than the deltas since it was last reported).  The first\n"
+"sample only reports mounts that are already low.";
+
+static PyObject *
+fsmonitor_sample(fsmonitorobject *self)
+{
+	struct fsmon_entry *entries, *e, *prev;
+	struct statfs *buf, *sfs;
+	PyObject *events;
+	const char *event;
+	int n, size, i, j, hint, low_blocks, low_files;
+	int64_t dbytes, dfiles;
+
+	n = fsstat_fill(MNT_NOWAIT, &buf, &size);
+	if (n == -1)
+		return NULL;
+
+	entries = PyMem_New(struct fsmon_entry, n > 0 ? n : 1);
+	events = PyList_New(0);
+	if (entries == NULL || events == NULL) {
+		PyMem_Del(entries);
+		Py_XDECREF(events);
+		fsstat_releasebuf(buf, size);
+		return PyErr_NoMemory();
+	}
+
+	for (j = 0; j < self->nentries; j++)
+		self->entries[j].seen = 0;
+
+	/* Mount tables rarely get reordered, so try the same position
+	 * before scanning for the fsid. */
+	for (i = 0, hint = 0; i < n; i++) {
+		sfs = &buf[i];
+		e = &entries[i];
+
+		prev = NULL;
+		if (hint < self->nentries &&
+		    FSID_EQ(self->entries[hint].last.f_fsid, sfs->f_fsid))
+			prev = &self->entries[hint];
+		else
+			for (j = 0; j < self->nentries; j++)
+				if (FSID_EQ(self->entries[j].last.f_fsid,
+					    sfs->f_fsid)) {
+					prev = &self->entries[j];
+					hint = j;
+					break;
+				}
+		hint++;
+
+		low_blocks = fsmonitor_below(sfs->f_bavail, sfs->f_blocks,
+					     self->minfree);
+		low_files = fsmonitor_below(sfs->f_ffree, sfs->f_files,
+					    self->minfiles);
+
+		event = NULL;
+		if (prev == NULL) {
+			if (self->sampled)
+				event = "mounted";
+			else if (low_blocks || low_files)
+				event = "low";
+		}
+		else {
+			prev->seen = 1;
+			dbytes = ((int64_t)sfs->f_bavail -
+				  (int64_t)prev->last.f_bavail) *
+				 (int64_t)sfs->f_bsize;
+			dfiles = (int64_t)sfs->f_ffree -
+				 (int64_t)prev->last.f_ffree;
+
+			if ((low_blocks && !prev->low_blocks) ||
+			    (low_files && !prev->low_files))
+				event = "low";
+			else if ((!low_blocks && prev->low_blocks) ||
+				 (!low_files && prev->low_files))
+				event = "recovered";
+			else if ((self->delta > 0 &&
+				  llabs(dbytes) > self->delta) ||
+				 (self->fdelta > 0 &&
+				  llabs(dfiles) > self->fdelta))
+				event = "changed";
+		}
+
+		/* Unreported mounts keep their last reported state so
+		 * that slow drifts add up to the delta eventually. */
+		if (event != NULL || prev == NULL)
+			memcpy(&e->last, sfs, sizeof(struct statfs));
+		else
+			memcpy(&e->last, &prev->last, sizeof(struct statfs));
+		e->low_blocks = low_blocks;
+		e->low_files = low_files;
+
+		if (event != NULL && fsmonitor_report(events, event, sfs) == -1)
+			goto error;
+	}
+
+	for (j = 0; j < self->nentries; j++)
+		if (!self->entries[j].seen && fsmonitor_report(events,
+				"unmounted", &self->entries[j].last) == -1)
+			goto error;
+
+	fsstat_releasebuf(buf, size);
+	PyMem_Del(self->entries);
+	self->entries = entries;
+	self->nentries = n;
+	self->sampled = 1;
+	return events;
+
+error:
+	fsstat_releasebuf(buf, size);
+	PyMem_Del(entries);
+	Py_DECREF(events);
+	return NULL;
+}
+
+static PyMethodDef fsmonitor_methods[] = {
+	{"sample", (PyCFunction)fsmonitor_sample, METH_NOARGS,
+	 fsmonitor_sample_doc},
+	{NULL, NULL}
+};
+
+#define OFF(x) offsetof(fsmonitorobject, x)
+static struct PyMemberDef fsmonitor_memberlist[] = {
+	{"minfree",	T_DOUBLE,	OFF(minfree),	0,
+	 "Percentage of available blocks below which a mount is low."},
+	{"minfiles",	T_DOUBLE,	OFF(minfiles),	0,
+	 "Percentage of available file nodes below which a mount is low."},
+	{"delta",	T_LONGLONG,	OFF(delta),	0,
+	 "Change of available bytes that is reported, or 0."},
+	{"fdelta",	T_LONGLONG,	OFF(fdelta),	0,
+	 "Change of available file nodes that is reported, or 0."},
+	{NULL}	/* sentinel */
+};
+#undef OFF
+
+static char fsmonitor_doc[] =
+"fsmonitor([minfree, minfiles, delta, fdelta]):\n"
+"watches the capacity of all mounted file systems.  Each call of\n"
+"sample() compares the current statistics with the last reported ones\n"
+"in C and returns only the mounts that crossed the `minfree` or\n"
+"`minfiles` percentage thresholds or whose available bytes or file\n"
+"nodes changed by more than `delta` or `fdelta`.";
+
+static PyTypeObject FSMonitorType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"fsmonitor",
+	tp_basicsize:	sizeof(fsmonitorobject),
+	tp_dealloc:	(destructor)fsmonitor_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	fsmonitor_methods,
+	tp_members:	fsmonitor_memberlist,
+	tp_new:		fsmonitor_new,
+	tp_doc:		fsmonitor_doc,
+};
+#endif
+
+#endif
@@ -0,0 +1,349 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <pthread.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+/*
+ * statfs_many() runs statfs(2) for each path on detached threads so
+ * that a hung mount (e.g. an unresponsive NFS server) only stalls its
+ * own worker.  A job is shared by the caller and the worker and is
+ * freed by whichever drops the last reference, so the caller can give
+ * up on a stuck job and return.  At most STATFS_POOL_MAX workers are
+ * alive in the whole process, including the ones still stuck after
+ * their caller gave up, and those stuck jobs are kept on a list so
+ * that later calls report their paths as stale instead of sending
+ * another thread after them.
+ */
+#define STATFS_POOL_MAX 16
+
+struct statfs_job {
+	int refs;
+	int started;
+	int done;
+	int stuck;			/* abandoned while still running */
+	int error;
+	char *path;
+	struct statfs_job *stuck_next;
+	struct timespec deadline;
+	struct statfs buf;
+};
+
+static pthread_mutex_t statfs_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t statfs_pool_cond = PTHREAD_COND_INITIALIZER;
+static int statfs_pool_live;		/* workers alive, stuck or not */
+static struct statfs_job *statfs_pool_stuck;
+
+/* must be called with statfs_pool_lock held */
+static void
+statfs_job_unref(struct statfs_job *job)
+{
+	if (--job->refs == 0) {
+		free(job->path);
+		free(job);
+	}
+}
+
+/* must be called with statfs_pool_lock held */
+static int
+statfs_path_stuck(const char *path)
+{
+	struct statfs_job *job;
+
+	for (job = statfs_pool_stuck; job != NULL; job = job->stuck_next)
+		if (strcmp(job->path, path) == 0)
+			return 1;
+	return 0;
+}
+
+static void *
+statfs_worker(void *arg)
+{
+	struct statfs_job *job = arg, **jpp;
+	struct statfs buf;
+	int r, err;
+
+	r = statfs(job->path, &buf);
+	err = errno;
+
+	pthread_mutex_lock(&statfs_pool_lock);
+	if (r == -1)
+		job->error = err;
+	else
+		memcpy(&job->buf, &buf, sizeof buf);
+	job->done = 1;
+	if (job->stuck)
+		for (jpp = &statfs_pool_stuck; *jpp != NULL;
+		     jpp = &(*jpp)->stuck_next)
+			if (*jpp == job) {
+				*jpp = job->stuck_next;
+				break;
+			}
+	statfs_pool_live--;
+	pthread_cond_broadcast(&statfs_pool_cond);
+	statfs_job_unref(job);
+	pthread_mutex_unlock(&statfs_pool_lock);
+
+	return NULL;
+}
+
+static int
+timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void
+timespec_after(struct timespec *ts, const struct timespec *now,
+	       double timeout)
+{
+	*ts = *now;
+	ts->tv_sec += (time_t)timeout;
+	ts->tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Internal helper function to run the jobs until each one is done or
+ * has run for `timeout' seconds.  Jobs that time out are abandoned to
+ * their workers and put on the stuck list.  Jobs whose path is already
+ * on it, or that wait `timeout' seconds without a worker slot freeing
+ * up, are never started.
+ */
+static void
+statfs_pool_run(struct statfs_job **jobs, int njobs, double timeout)
+{
+	struct timespec now, queued, *wake;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int next, i, err, pending;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&statfs_pool_lock);
+	clock_gettime(CLOCK_REALTIME, &now);
+	timespec_after(&queued, &now, timeout);
+	for (next = 0;;) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		while (next < njobs && statfs_pool_live < STATFS_POOL_MAX) {
+			struct statfs_job *job = jobs[next++];
+
+			if (statfs_path_stuck(job->path))
+				continue;
+
+			/* each call gets the full timeout from its start */
+			timespec_after(&job->deadline, &now, timeout);
+			timespec_after(&queued, &now, timeout);
+			job->refs++;
+			err = pthread_create(&tid, &attr, statfs_worker, job);
+			if (err != 0) {
+				job->refs--;
+				job->error = err;
+				job->done = 1;
+			}
+			else {
+				job->started = 1;
+				statfs_pool_live++;
+			}
+		}
+
+		/* the pool stayed full for the whole timeout */
+		if (next < njobs && !timespec_before(&now, &queued))
+			next = njobs;
+
+		/* give up on the expired jobs */
+		wake = next < njobs ? &queued : NULL;
+		pending = 0;
+		for (i = 0; i < next; i++) {
+			if (!jobs[i]->started || jobs[i]->done ||
+			    jobs[i]->stuck)
+				continue;
+			if (!timespec_before(&now, &jobs[i]->deadline)) {
+				jobs[i]->stuck = 1;
+				jobs[i]->stuck_next = statfs_pool_stuck;
+				statfs_pool_stuck = jobs[i];
+				continue;
+			}
+			pending++;
+			if (wake == NULL ||
+			    timespec_before(&jobs[i]->deadline, wake))
+				wake = &jobs[i]->deadline;
+		}
+		if (pending == 0 && next == njobs)
+			break;
+		pthread_cond_timedwait(&statfs_pool_cond, &statfs_pool_lock,
+				       wake);
+	}
+	pthread_mutex_unlock(&statfs_pool_lock);
+
+	pthread_attr_destroy(&attr);
+}
+
+#ifdef __FreeBSD__
+#define statfs_many_result	PyObject_FromStatfs
+#else
+/* the fields statfs(2) has in common with FreeBSD's statfs() dicts */
+static PyObject *
+statfs_many_result(struct statfs *buf)
+{
+	PyObject *r;
+
+	r = PyDict_New();
+	if (r == NULL)
+		return NULL;
+	SETDICT_INT(r, "bsize", buf->f_bsize);
+	SETDICT_INT(r, "blocks", buf->f_blocks);
+	SETDICT_INT(r, "bfree", buf->f_bfree);
+	SETDICT_INT(r, "bavail", buf->f_bavail);
+	SETDICT_INT(r, "files", buf->f_files);
+	SETDICT_INT(r, "ffree", buf->f_ffree);
+	SETDICT_INT(r, "type", buf->f_type);
+	if (PyErr_Occurred()) {
+		Py_DECREF(r);
+		return NULL;
+	}
+	return r;
+}
+#endif
+
+
+static char PyFB_statfs_many__doc__[] =
+"statfs_many(paths[, timeout]):\n"
+"calls statfs() for every path in parallel on up to 16 worker threads\n"
+"shared by the whole process and waits at most `timeout` seconds (5.0\n"
+"by default) for each call.  Returns a list aligned with `paths`\n"
+"holding the statfs dict of each path, an OSError instance if the call\n"
+"failed, or None if the mount is stale: the call did not finish in\n"
+"time, an earlier call on the same path is still hung, or no worker\n"
+"became free within `timeout`.";
+
+static PyObject *
+PyFB_statfs_many(PyObject *self, PyObject *args)
+{
+	struct statfs_job **jobs;
+	PyObject *paths, *seq, *r, *v;
+	double timeout = 5.0;
+	int njobs, i;
+
+	if (!PyArg_ParseTuple(args, "O|d:statfs_many", &paths, &timeout))
+		return NULL;
+	if (timeout < 0) {
+		PyErr_SetString(PyExc_ValueError, "timeout must be positive");
+		return NULL;
+	}
+
+	seq = PySequence_Fast(paths, "argument 1 must be a sequence");
+	if (seq == NULL)
+		return NULL;
+	njobs = PySequence_Fast_GET_SIZE(seq);
+
+	jobs = PyMem_New(struct statfs_job *, njobs > 0 ? njobs : 1);
+	if (jobs == NULL) {
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+
+	for (i = 0; i < njobs; i++) {
+		v = PySequence_Fast_GET_ITEM(seq, i);
+		if (!PyString_Check(v)) {
+			PyErr_SetString(PyExc_TypeError,
+				"argument 1 must be a sequence of strings");
+			goto error;
+		}
+		jobs[i] = calloc(1, sizeof(struct statfs_job));
+		if (jobs[i] == NULL ||
+		    (jobs[i]->path = strdup(PyString_AS_STRING(v))) == NULL) {
+			free(jobs[i]);
+			PyErr_NoMemory();
+			goto error;
+		}
+		jobs[i]->refs = 1;
+	}
+	Py_DECREF(seq);
+
+	Py_BEGIN_ALLOW_THREADS
+	statfs_pool_run(jobs, njobs, timeout);
+	Py_END_ALLOW_THREADS
+
+	/* Drop the unfinished jobs to their workers, or free the ones that
+	 * never started.  The finished ones are only referenced from here,
+	 * so the lock is not needed while the results are converted. */
+	pthread_mutex_lock(&statfs_pool_lock);
+	for (i = 0; i < njobs; i++)
+		if (!jobs[i]->done) {
+			statfs_job_unref(jobs[i]);
+			jobs[i] = NULL;
+		}
+	pthread_mutex_unlock(&statfs_pool_lock);
+
+	r = PyList_New(njobs);
+	for (i = 0; i < njobs; i++) {
+		if (r == NULL)
+			;
+		else if (jobs[i] == NULL) {
+			Py_INCREF(Py_None);
+			PyList_SET_ITEM(r, i, Py_None);
+		}
+		else {
+			if (jobs[i]->error != 0)
+				v = oserror_fromerrno(jobs[i]->error);
+			else
+				v = statfs_many_result(&jobs[i]->buf);
+			if (v == NULL) {
+				Py_DECREF(r);
+				r = NULL;
+			}
+			else
+				PyList_SET_ITEM(r, i, v);
+		}
+		if (jobs[i] != NULL) {
+			free(jobs[i]->path);
+			free(jobs[i]);
+		}
+	}
+	PyMem_Del(jobs);
+
+	return r;
+
+error:
+	while (--i >= 0) {
+		free(jobs[i]->path);
+		free(jobs[i]);
+	}
+	PyMem_Del(jobs);
+	Py_DECREF(seq);
+	return NULL;
+}
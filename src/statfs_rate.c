@@ -0,0 +1,233 @@
+/*-
+ * Copyright (c) 2002-2005 Hye-Shik Chang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifdef __FreeBSD__
+
+#if __FreeBSD_version >= 600000
+/* Types */
+DECLTYPE(FSRateTrackerType, fsratetrackerobject)
+
+/* ---------------------------------------------------------------------- */
+/*			    fsratetrackerobject				  */
+/* ---------------------------------------------------------------------- */
+
+#define FSRATE_NCOUNTERS 4
+
+static const char *fsrate_columns[FSRATE_NCOUNTERS] = {
+	"syncreads", "asyncreads", "syncwrites", "asyncwrites",
+};
+
+struct fsrate_entry {
+	fsid_t fsid;
+	uint64_t counters[FSRATE_NCOUNTERS];
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct fsrate_entry *entries;
+	int nentries;
+	struct timespec stamp;
+	PyObject *names;	/* mntonname tuple of the last sample */
+} fsratetrackerobject;
+
+static PyTypeObject FSRateTrackerType;
+
+static PyObject *
+fsratetracker_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	fsratetrackerobject *self;
+
+	if (!PyArg_ParseTuple(args, ":fsratetracker"))
+		return NULL;
+
+	self = (fsratetrackerobject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	self->entries = NULL;
+	self->nentries = 0;
+	self->names = NULL;
+	return (PyObject *)self;
+}
+
+static void
+fsratetracker_dealloc(fsratetrackerobject *self)
+{
+	PyMem_Del(self->entries);
+	Py_XDECREF(self->names);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static char fsratetracker_sample_doc[] =
+"sample():\n"
+"samples all mounted file systems with const.MNT_NOWAIT and returns a\n"
+"dict of columns aligned with the mount list: `mntonname` (a tuple) and\n"
+"`syncreads`, `asyncreads`, `syncwrites` and `asyncwrites` as arrays of\n"
+"operations per second since the previous sample.  Mounts that were not\n"
+"present in the previous sample have rates of zero.";
+
+static PyObject *
+fsratetracker_sample(fsratetrackerobject *self)
+{
+	struct fsrate_entry *entries, *prev;
+	struct statfs *buf;
+	struct timespec now;
+	double elapsed, *rates;
+	PyObject *r, *names, *arr;
+	int n, size, i, j, k, hint, samelayout;
+
+	n = fsstat_fill(MNT_NOWAIT, &buf, &size);
+	if (n == -1)
+		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	entries = PyMem_New(struct fsrate_entry, n > 0 ? n : 1);
+	rates = PyMem_New(double, FSRATE_NCOUNTERS * (n > 0 ? n : 1));
+	if (entries == NULL || rates == NULL) {
+		PyMem_Del(entries);
+		PyMem_Del(rates);
+		fsstat_releasebuf(buf, size);
+		return PyErr_NoMemory();
+	}
+
+	elapsed = (double)(now.tv_sec - self->stamp.tv_sec) +
+		  (double)(now.tv_nsec - self->stamp.tv_nsec) / 1e9;
+	samelayout = (n == self->nentries);
+
+	for (i = 0, hint = 0; i < n; i++) {
+		entries[i].fsid = buf[i].f_fsid;
+		entries[i].counters[0] = buf[i].f_syncreads;
+		entries[i].counters[1] = buf[i].f_asyncreads;
+		entries[i].counters[2] = buf[i].f_syncwrites;
+		entries[i].counters[3] = buf[i].f_asyncwrites;
+
+		prev = NULL;
+		if (hint < self->nentries &&
+		    FSID_EQ(self->entries[hint].fsid, buf[i].f_fsid))
+			prev = &self->entries[hint];
+		else
+			for (j = 0; j < self->nentries; j++)
+				if (FSID_EQ(self->entries[j].fsid,
+					    buf[i].f_fsid)) {
+					prev = &self->entries[j];
+					hint = j;
+					break;
+				}
+		if (prev != &self->entries[i])
+			samelayout = 0;
+		hint++;
+
+		for (k = 0; k < FSRATE_NCOUNTERS; k++)
+			if (prev == NULL || elapsed <= 0 ||
+			    entries[i].counters[k] < prev->counters[k])
+				rates[k * n + i] = 0.0;
+			else
+				rates[k * n + i] = (double)(
+					entries[i].counters[k] -
+					prev->counters[k]) / elapsed;
+	}
+
+	/* Reuse the name tuple as long as the mount list did not change;
+	 * it is immutable, so callers cannot corrupt later samples. */
+	if (samelayout && self->names != NULL) {
+		names = self->names;
+		Py_INCREF(names);
+	}
+	else {
+		names = PyTuple_New(n);
+		for (i = 0; names != NULL && i < n; i++) {
+			PyObject *name;
+
+			name = PyString_FromString(buf[i].f_mntonname);
+			if (name == NULL) {
+				Py_DECREF(names);
+				names = NULL;
+			}
+			else
+				PyTuple_SET_ITEM(names, i, name);
+		}
+	}
+	fsstat_releasebuf(buf, size);
+
+	r = (names != NULL) ? PyDict_New() : NULL;
+	if (r == NULL)
+		goto error;
+	PyDict_SetItemString(r, "mntonname", names);
+
+	for (k = 0; k < FSRATE_NCOUNTERS; k++) {
+		arr = array_fromdoubles(&rates[k * n], n);
+		if (arr == NULL) {
+			Py_DECREF(r);
+			goto error;
+		}
+		PyDict_SetItemString_StealRef(r, (char *)fsrate_columns[k],
+					      arr);
+	}
+	PyMem_Del(rates);
+
+	PyMem_Del(self->entries);
+	self->entries = entries;
+	self->nentries = n;
+	self->stamp = now;
+	Py_XDECREF(self->names);
+	self->names = names;
+
+	return r;
+
+error:
+	Py_XDECREF(names);
+	PyMem_Del(entries);
+	PyMem_Del(rates);
+	return NULL;
+}
+
+static PyMethodDef fsratetracker_methods[] = {
+	{"sample", (PyCFunction)fsratetracker_sample, METH_NOARGS,
+	 fsratetracker_sample_doc},
+	{NULL, NULL}
+};
+
+static char fsratetracker_doc[] =
+"fsratetracker():\n"
+"tracks the sync/async read and write counters of all mounted file\n"
+"systems by fsid and computes per-filesystem I/O rates in C.";
+
+static PyTypeObject FSRateTrackerType = {
+	PyObject_HEAD_INIT(NULL)
+	tp_name:	"fsratetracker",
+	tp_basicsize:	sizeof(fsratetrackerobject),
+	tp_dealloc:	(destructor)fsratetracker_dealloc,
+	tp_getattro:	PyObject_GenericGetAttr,
+	tp_flags:	Py_TPFLAGS_DEFAULT,
+	tp_methods:	fsratetracker_methods,
+	tp_new:		fsratetracker_new,
+	tp_doc:		fsratetracker_doc,
+};
+#endif
+
+#endif
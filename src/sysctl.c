@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#ifdef __FreeBSD__
+
 #include <sys/sysctl.h>
 
 static char PyFB_getloadavg__doc__[] =
@@ -565,3 +567,5 @@ PyFB_sysctldescr(PyObject *self, PyObject *args)
 
 	return PyString_FromStringAndSize(descr, descrlen - 1);
 }
+
+#endif
@@ -0,0 +1,81 @@
+import unittest
+from test import test_support
+import sys, os, shutil, tempfile
+from freebsd import *
+
+FIXTURE = os.path.join(os.path.dirname(__file__), 'fstab.sample')
+
+class Test_fstab(unittest.TestCase):
+
+    def setUp(self):
+        self.tab = fstab(FIXTURE)
+
+    def test_entries(self):
+        ents = self.tab.getfsent()
+        self.assertEqual(len(self.tab), 10)
+        self.assertEqual(len(ents), 10)
+        self.assertEqual([e.file for e in ents][:3], ['none', '/', '/var'])
+        root = ents[1]
+        self.assertEqual(tuple(root)[:7],
+                         ('/dev/ada0p3', '/', 'ufs', 'rw', 'rw', 1, 1))
+
+    def test_defaults(self):
+        proc = self.tab.getfsfile('/proc')
+        self.assertEqual((proc.freq, proc.passno), (0, 0))
+        self.assertEqual(self.tab.getfsfile('/cdrom').type, 'ro')
+
+    def test_options(self):
+        var = self.tab.getfsfile('/var')
+        self.assertEqual(var.options,
+                         frozenset(['rw', 'noexec', 'nosuid']))
+        self.assertEqual(var.values, ())
+        tmp = self.tab.getfsspec('tmpfs')
+        self.failUnless('size' in tmp.options)
+        self.assertEqual(dict(tmp.values), {'mode': '1777', 'size': '2g'})
+        home = self.tab.getfsfile('/usr/home')
+        self.assertEqual(home.values, (('userquota', '/quota.user'),))
+        self.assertEqual(self.tab.getfsspec('/dev/ada0p2').type, 'sw')
+
+    def test_immutable(self):
+        tmp = self.tab.getfsspec('tmpfs')
+        self.failIf(hasattr(tmp.options, 'discard'))
+        self.failIf(hasattr(tmp.values, 'append'))
+        self.failUnless(self.tab.getfsspec('tmpfs').options is tmp.options)
+
+    def test_escapes(self):
+        nfs = self.tab.getfsspec('server:/export')
+        self.assertEqual(nfs.file, '/mnt/My Files')
+        self.assertEqual(nfs.type, 'ro')
+
+    def test_first_wins(self):
+        self.assertEqual(self.tab.getfsspec('/dev/ada0p3').file, '/')
+        self.assertEqual(self.tab.getfsfile('/altroot').type, 'xx')
+
+    def test_missing(self):
+        self.assertRaises(KeyError, self.tab.getfsspec, '/dev/nothere')
+        self.assertRaises(KeyError, self.tab.getfsfile, '/nothere')
+        self.assertRaises(OSError, fstab, FIXTURE + '.missing')
+
+    def test_refresh(self):
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'fstab')
+            shutil.copy(FIXTURE, path)
+            tab = fstab(path, interval=0)
+            self.assertEqual(len(tab), 10)
+            f = open(path, 'a')
+            f.write('/dev/da0s1\t/media\tmsdosfs\trw,noauto\t0\t0\n')
+            f.close()
+            st = os.stat(path)
+            os.utime(path, (st.st_atime, st.st_mtime + 10))
+            self.assertEqual(tab.getfsfile('/media').vfstype, 'msdosfs')
+            self.assertEqual(len(tab), 11)
+        finally:
+            shutil.rmtree(tmpdir)
+
+
+def test_main():
+    test_support.run_unittest(Test_fstab)
+
+if __name__ == "__main__":
+    test_main()
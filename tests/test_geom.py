@@ -0,0 +1,94 @@
+import unittest
+from test import test_support
+import sys, os
+from freebsd import *
+from freebsd.const import *
+
+FIXTURE = os.path.join(os.path.dirname(__file__), 'geom_confxml.xml')
+
+class Test_geomtree(unittest.TestCase):
+
+    def setUp(self):
+        self.tree = geomtree(open(FIXTURE).read())
+
+    def test_indexes(self):
+        t = self.tree
+        self.assertEqual(sorted(t.classes.keys()),
+                         ['DEV', 'DISK', 'FD', 'PART'])
+        self.assertEqual(sorted(t.providers.keys()),
+                         ['ada0', 'ada0p1', 'ada0p2', 'ada1'])
+        self.failUnless(('PART', 'ada0') in t.geoms)
+        self.failUnless(('DISK', 'ada0') in t.geoms)
+        self.assertEqual(len(t.ids), 4 + 5 + 4 + 3)
+        self.assertEqual(t.ids['0xfffff80003a1c400']['name'], 'ada0')
+
+    def test_fields(self):
+        p = self.tree.providers['ada0']
+        self.assertEqual(p['mediasize'], 500107862016L)
+        self.assertEqual(p['sectorsize'], 512)
+        self.assertEqual(p['mode'], 'r2w2e5')
+        self.assertEqual(p['config']['ident'], 'WD-WCC6Y0RJ&1234')
+        self.assertEqual(p['config']['rotationrate'], '7200')
+        self.assertEqual(self.tree.providers['ada1']['config']['ident'],
+                         '<none>')
+        part = self.tree.geoms[('PART', 'ada0')]
+        self.assertEqual(part['rank'], 2)
+        self.assertEqual(part['config']['state'], 'OK')
+
+    def test_references(self):
+        t = self.tree
+        disk = t.providers['ada0']
+        self.failUnless(disk['geom'] is t.geoms[('DISK', 'ada0')])
+        self.failUnless(disk['geom']['class'] is t.classes['DISK'])
+        part = t.geoms[('PART', 'ada0')]
+        self.assertEqual([c['provider']['name'] for c in part['consumers']],
+                         ['ada0'])
+        self.assertEqual([c['geom']['name'] for c in disk['consumers']],
+                         ['ada0'])
+        self.assertEqual([p['name'] for p in part['providers']],
+                         ['ada0p1', 'ada0p2'])
+        p2 = t.providers['ada0p2']
+        self.assertEqual([c['geom']['class']['name']
+                          for c in p2['consumers']], ['DEV'])
+        self.assertEqual(t.classes['FD']['geoms'], [])
+
+    def test_malformed(self):
+        self.assertRaises(ValueError, geomtree, '<mesh><class id="1">')
+        self.assertRaises(ValueError, geomtree, '<mesh></class>')
+
+class Test_geomsnapshot(unittest.TestCase):
+
+    def setUp(self):
+        self.xml = open(FIXTURE).read()
+
+    def test_unchanged(self):
+        snap = geomsnapshot(self.xml)
+        self.assertEqual(len(snap), 4)
+        self.assertEqual(snap.diff(self.xml),
+                         {'added': [], 'removed': [], 'changed': {}})
+
+    def test_changes(self):
+        snap = geomsnapshot(self.xml)
+        xml = self.xml.replace('<mediasize>1000204886016</mediasize>',
+                               '<mediasize>2000398934016</mediasize>')
+        xml = xml.replace('<name>ada0p1</name>', '<name>ada0p3</name>')
+        xml = xml.replace('<state>OK</state>', '<state>CORRUPT</state>')
+        xml = xml.replace('<mode>r1w1e1</mode>', '<mode>r0w0e0</mode>')
+        d = snap.diff(xml)
+        self.assertEqual(d['added'], ['ada0p3'])
+        self.assertEqual(d['removed'], ['ada0p1'])
+        self.assertEqual(d['changed'], {
+            'ada1': {'mediasize': (1000204886016L, 2000398934016L)},
+            'ada0p2': {'state': ('OK', 'CORRUPT'),
+                       'mode': ('r1w1e1', 'r0w0e0')},
+        })
+        # the snapshot moved on to the newer document
+        self.assertEqual(snap.diff(xml),
+                         {'added': [], 'removed': [], 'changed': {}})
+
+
+def test_main():
+    test_support.run_unittest(Test_geomtree, Test_geomsnapshot)
+
+if __name__ == "__main__":
+    test_main()
@@ -51,6 +51,9 @@ class Test_kqueue(unittest.TestCase):
 
 
 def test_main():
+    if not sys.platform.startswith('freebsd'):
+        print >> sys.stderr, "test_kqueue skipped: FreeBSD only"
+        return
     suite = unittest.TestSuite()
     suite.addTest(unittest.makeSuite(Test_kqueue))
     test_support.run_suite(suite)
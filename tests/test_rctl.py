@@ -0,0 +1,45 @@
+import unittest
+from test import test_support
+import sys, os
+from freebsd import *
+from freebsd.const import *
+
+SAMPLE = ('cputime=12,datasize=8192,stacksize=0,coredumpsize=0,'
+          'memoryuse=104857600,memorylocked=0,maxproc=7,openfiles=212,'
+          'vmemoryuse=536870912,pseudoterminals=1,swapuse=0,nthr=9,'
+          'msgqqueued=0,msgqsize=0,nmsgq=0,nsem=0,nsemop=0,nshm=0,'
+          'shmsize=0,wallclock=86400,pcpu=3,readbps=4096,writebps=0,'
+          'readiops=1,writeiops=0\n')
+
+class Test_racct_parse(unittest.TestCase):
+
+    def test_dict(self):
+        d = racct_parse(SAMPLE)
+        self.assertEqual(len(d), 25)
+        self.assertEqual(d['memoryuse'], 104857600)
+        self.assertEqual(d['openfiles'], 212)
+        self.assertEqual(d['pcpu'], 3)
+        self.assertEqual(racct_parse(''), {})
+
+    def test_keys(self):
+        a = racct_parse(SAMPLE, ['openfiles', 'cputime', 'nosuchkey'])
+        self.assertEqual(list(a), [212.0, 12.0, 0.0])
+        self.assertEqual(list(racct_parse('', ['cputime'])), [0.0])
+
+    def test_large_values(self):
+        d = racct_parse('vmemoryuse=18446744073709551615')
+        self.assertEqual(d['vmemoryuse'], 18446744073709551615L)
+
+    def test_malformed(self):
+        for text in ('cputime', '=1', 'cputime=', 'cputime=1x',
+                     'cputime=1;nthr=2', 'cputime=-1', 'cputime=nan',
+                     'cputime=0x10', 'cputime= 1', 'cputime=1.5'):
+            self.assertRaises(ValueError, racct_parse, text)
+            self.assertRaises(ValueError, racct_parse, text, ['cputime'])
+
+
+def test_main():
+    test_support.run_unittest(Test_racct_parse)
+
+if __name__ == "__main__":
+    test_main()
@@ -0,0 +1,96 @@
+import unittest
+from test import test_support
+import sys, os, socket, tempfile, errno
+from freebsd import *
+from freebsd.const import *
+
+def socketpair():
+    # sendfile(2) wants a stream socket on both platforms
+    lsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    lsock.bind(('127.0.0.1', 0))
+    lsock.listen(1)
+    client = socket.create_connection(lsock.getsockname())
+    server = lsock.accept()[0]
+    lsock.close()
+    return client, server
+
+def recvall(sock, size):
+    chunks = []
+    while size > 0:
+        data = sock.recv(min(size, 65536))
+        if not data:
+            break
+        chunks.append(data)
+        size -= len(data)
+    return ''.join(chunks)
+
+class Test_sendfile(unittest.TestCase):
+
+    def setUp(self):
+        self.data = ''.join([chr(i % 251) for i in range(100000)])
+        self.file = tempfile.TemporaryFile()
+        self.file.write(self.data)
+        self.file.flush()
+        self.sender, self.receiver = socketpair()
+
+    def tearDown(self):
+        self.file.close()
+        self.sender.close()
+        self.receiver.close()
+
+    def test_whole_file(self):
+        r = sendfile(self.file.fileno(), self.sender.fileno(), 0, 0)
+        self.assertEqual(r, (len(self.data), False))
+        self.assertEqual(recvall(self.receiver, len(self.data)), self.data)
+
+    def test_range(self):
+        r = sendfile(self.file.fileno(), self.sender.fileno(), 100, 1000)
+        self.assertEqual(r, (1000, False))
+        self.assertEqual(recvall(self.receiver, 1000), self.data[100:1100])
+
+    def test_headers_trailers(self):
+        headers = ['HTTP/1.0 200 OK\r\n', bytearray('\r\n')]
+        trailers = [buffer('--end--')]
+        r = sendfile(self.file.fileno(), self.sender.fileno(), 0, 500,
+                     headers, trailers)
+        expected = 'HTTP/1.0 200 OK\r\n\r\n' + self.data[:500] + '--end--'
+        self.assertEqual(r, (len(expected), False))
+        self.assertEqual(recvall(self.receiver, len(expected)), expected)
+
+    def test_nonblocking_resume(self):
+        # large enough to overflow the socket buffers
+        self.data = self.data * 80
+        self.file.seek(0)
+        self.file.write(self.data)
+        self.file.flush()
+        self.sender.setblocking(0)
+        fd, s = self.file.fileno(), self.sender.fileno()
+        received, offset, eagain = [], 0, True
+        while eagain:
+            sent, eagain = sendfile(fd, s, offset, 0)
+            offset += sent
+            if eagain:
+                received.append(self.receiver.recv(65536))
+        received.append(recvall(self.receiver,
+                                len(self.data) - len(''.join(received))))
+        self.assertEqual(offset, len(self.data))
+        self.assertEqual(''.join(received), self.data)
+
+    def test_errors(self):
+        self.assertRaises(ValueError, sendfile, self.file.fileno(),
+                          self.sender.fileno(), -1, 0)
+        self.assertRaises(TypeError, sendfile, self.file.fileno(),
+                          self.sender.fileno(), 0, 0, [1])
+        try:
+            sendfile(self.file.fileno(), -1, 0, 0)
+        except OSError, e:
+            self.assertEqual(e.errno, errno.EBADF)
+        else:
+            self.fail("sendfile to a bad descriptor succeeded")
+
+
+def test_main():
+    test_support.run_unittest(Test_sendfile)
+
+if __name__ == "__main__":
+    test_main()
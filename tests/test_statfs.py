@@ -0,0 +1,98 @@
+import unittest
+from test import test_support
+import sys, os, errno, time, tempfile, ctypes
+from freebsd import *
+
+class Test_statfs_many(unittest.TestCase):
+
+    def test_results(self):
+        r = statfs_many(['/', '/nonexistent/path', '.'])
+        self.assertEqual(len(r), 3)
+        self.failUnless(r[0]['bsize'] > 0)
+        self.failUnless(r[0]['blocks'] >= r[0]['bfree'])
+        self.failUnless(isinstance(r[1], OSError))
+        self.assertEqual(r[1].errno, errno.ENOENT)
+        self.failUnless(isinstance(r[2], dict))
+
+    def test_more_paths_than_workers(self):
+        paths = ['/'] * 50 + ['/nonexistent'] * 50
+        r = statfs_many(paths, 10.0)
+        self.assertEqual(len(r), 100)
+        self.failUnless(all(isinstance(v, dict) for v in r[:50]))
+        self.failUnless(all(isinstance(v, OSError) for v in r[50:]))
+
+    def test_empty(self):
+        self.assertEqual(statfs_many([]), [])
+
+    def test_arguments(self):
+        self.assertRaises(TypeError, statfs_many, [1])
+        self.assertRaises(TypeError, statfs_many, 1)
+        self.assertRaises(ValueError, statfs_many, ['/'], -1)
+
+
+def thread_count():
+    for line in open('/proc/self/status'):
+        if line.startswith('Threads:'):
+            return int(line.split()[1])
+
+class Test_statfs_many_hung(unittest.TestCase):
+    # A FUSE mount nobody serves: every statfs() under it blocks until
+    # the device is closed.
+
+    def setUp(self):
+        if not sys.platform.startswith('linux') or os.getuid() != 0:
+            self.skipTest('needs root on Linux')
+        self.libc = ctypes.CDLL(None, use_errno=True)
+        self.mnt = tempfile.mkdtemp()
+        try:
+            self.fd = os.open('/dev/fuse', os.O_RDWR)
+        except OSError:
+            os.rmdir(self.mnt)
+            self.skipTest('no /dev/fuse')
+        opts = 'fd=%d,rootmode=40000,user_id=0,group_id=0' % self.fd
+        if self.libc.mount('statfs_test', self.mnt, 'fuse', 0, opts) != 0:
+            os.close(self.fd)
+            os.rmdir(self.mnt)
+            self.skipTest('cannot mount fuse')
+
+    def tearDown(self):
+        os.close(self.fd)
+        self.libc.umount2(self.mnt, 2)          # MNT_DETACH
+        os.rmdir(self.mnt)
+        for i in range(50):                     # let the workers exit
+            if statfs_many([self.mnt])[0] is not None:
+                break
+            time.sleep(0.1)
+
+    def test_same_path(self):
+        base = thread_count()
+        self.assertEqual(statfs_many([self.mnt], 0.2), [None])
+        started = thread_count()
+        self.failUnless(started <= base + 1)
+        for i in range(20):
+            t = time.time()
+            self.assertEqual(statfs_many([self.mnt], 0.2), [None])
+            self.failUnless(time.time() - t < 0.2)
+        self.failUnless(thread_count() <= started)
+        r = statfs_many([self.mnt, '/'], 0.2)
+        self.assertEqual(r[0], None)
+        self.failUnless(isinstance(r[1], dict))
+
+    def test_many_paths(self):
+        base = thread_count()
+        paths = [os.path.join(self.mnt, str(i)) for i in range(40)]
+        for i in range(5):
+            r = statfs_many(paths, 0.1)
+            self.assertEqual(r, [None] * 40)
+            self.failUnless(thread_count() <= base + 16)
+        stuck = thread_count()
+        # the pool is full of stuck workers, so nothing else can start
+        self.assertEqual(statfs_many(['/'], 0.1), [None])
+        self.failUnless(thread_count() <= stuck)
+
+
+def test_main():
+    test_support.run_unittest(Test_statfs_many, Test_statfs_many_hung)
+
+if __name__ == "__main__":
+    test_main()
@@ -22,6 +22,9 @@ class Test_sysctl(unittest.TestCase):
             self.failUnless(0 <= lavg[i] <= 1)
 
 def test_main():
+    if not sys.platform.startswith('freebsd'):
+        print >> sys.stderr, "test_sysctl skipped: FreeBSD only"
+        return
     suite = unittest.TestSuite()
     suite.addTest(unittest.makeSuite(Test_sysctl))
     test_support.run_suite(suite)
@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+#
+# Measures freebsd.sendfile() throughput over a loopback TCP connection.
+#
+#   python tools/bench_sendfile.py [-s size_mb] [-n rounds] [-H header_bytes]
+#
+
+import sys, os, socket, tempfile, threading, time, getopt
+from freebsd import sendfile
+
+def drain(sock, total, result):
+    received = 0
+    while received < total:
+        data = sock.recv(1 << 20)
+        if not data:
+            break
+        received += len(data)
+    result.append(received)
+
+def bench(size, rounds, hdrsize):
+    f = tempfile.TemporaryFile()
+    block = os.urandom(1 << 20)
+    for i in xrange(size >> 20):
+        f.write(block)
+    f.flush()
+
+    lsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    lsock.bind(('127.0.0.1', 0))
+    lsock.listen(1)
+    sender = socket.create_connection(lsock.getsockname())
+    receiver = lsock.accept()[0]
+    lsock.close()
+
+    headers = hdrsize and ['x' * hdrsize] or None
+    total = (size + hdrsize) * rounds
+    result = []
+    t = threading.Thread(target=drain, args=(receiver, total, result))
+    t.start()
+
+    begin = time.time()
+    for i in xrange(rounds):
+        sent, eagain = sendfile(f.fileno(), sender.fileno(), 0, size,
+                                headers)
+        assert sent == size + hdrsize and not eagain
+    t.join()
+    elapsed = time.time() - begin
+
+    sender.close()
+    receiver.close()
+    f.close()
+    return result[0], elapsed
+
+def main():
+    size, rounds, hdrsize = 64, 20, 0
+    opts, args = getopt.getopt(sys.argv[1:], 's:n:H:')
+    for opt, val in opts:
+        if opt == '-s':
+            size = int(val)
+        elif opt == '-n':
+            rounds = int(val)
+        elif opt == '-H':
+            hdrsize = int(val)
+
+    received, elapsed = bench(size << 20, rounds, hdrsize)
+    print "%s: %d bytes in %.3f s, %.2f GB/s" % (
+        sys.platform, received, elapsed, received / elapsed / 1e9)
+
+if __name__ == '__main__':
+    main()
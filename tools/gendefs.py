@@ -13,10 +13,13 @@ pat_const = re.compile(
             '^EXPCONST([A-Z_]*)\s*\(([a-z_0-9 ]+( \*)?)\s*([^\) ]*)\)\s*$')
 pat_func = re.compile('^PyFB_([A-Za-z0-9_]+)\s*\(([^\)]*)\)')
 pat_type = re.compile('^DECLTYPE\s*\(([A-Za-z_0-9 ]+)\s*,\s*([A-Za-z_0-9 ]+)\)\s*$')
+pat_structseq = re.compile(
+            '^DECLSTRUCTSEQ\s*\(([A-Za-z_0-9 ]+)\s*,\s*([A-Za-z_0-9 ]+)\)\s*$')
 pat_libdep = re.compile('LIB_DEPENDS\s*\(\s*([A-Za-z0-9_]+)\s*\)')
 pat_cppif = re.compile('#\s*if')
 pat_cppif_vers = re.compile(
             '#\s*if\s+(__FreeBSD_version\s*[<>=]{1,2}\s*[0-9]+)')
+pat_cppif_os = re.compile('#\s*ifdef\s+(__FreeBSD__)')
 pat_cppendif = re.compile('#\s*endif')
 
 try:
@@ -64,6 +67,11 @@ def printout_type(f, match):
     if __verbose__:
         print "  Type: %s %s" % match
 
+def printout_structseq(f, match):
+    print >> f, 'INITSTRUCTSEQ(%s, %s)' % match
+    if __verbose__:
+        print "  Struct sequence: %s %s" % match
+
 def printout_lib(f, match):
     print >> f, '%s' % match
     if __verbose__:
@@ -92,6 +100,9 @@ def main():
         for line in open(src):
             if pat_cppif.search(line):
                 found = pat_cppif_vers.findall(line)
+                if not found:
+                    found = ['defined(%s)' % m
+                             for m in pat_cppif_os.findall(line)]
                 ifblocks.append(found and found[0])
             elif pat_cppendif.search(line):
                 ifblocks.pop()
@@ -110,6 +121,10 @@ def main():
             if found:
                 react = printout_type, typedef, found[0]
 
+            found = pat_structseq.findall(line)
+            if found:
+                react = printout_structseq, typedef, found[0]
+
             found = pat_libdep.findall(line)
             if found:
                 react = printout_lib, libdef, found[0]